@@ -0,0 +1,475 @@
+#include "Lexer.h"
+#include "LexerScan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <time.h>
+
+// Microbenchmark for the lexer. Compares LexerLex against the previous two-pass lexer
+// (kept below as LegacyLex) on a large buffer built by repeating the given sources, then
+// compares the scanning modes from LexerScan.c and parallel lexing on that buffer and on a
+// comment and string heavy one.
+//
+// usage: lexbench [size in MB] [files...]
+//
+// Build with -DALPS_BUILD_BENCH=ON and run from this directory, so the default sources are
+// found:
+//
+//     cmake -S . -B build -DALPS_BUILD_BENCH=ON && cmake --build build --target lexbench
+//     cd bench && ../build/lexbench
+//
+// On an x86-64 Xeon the comment and string heavy buffer lexes at about 2.1x the scalar speed
+// with SSE2 and 2.2-2.3x with AVX2. On the sources themselves the scanners have little to skip
+// and every mode runs at about the same speed.
+
+#define SPECIALS "+-*/=:;,.(){}"
+#define ITERATIONS 5
+
+typedef struct {
+    char *start;
+    char *end;
+    TokenType type;
+} LegacyToken;
+
+typedef struct {
+    LegacyToken *tokens;
+    int token_buffer_size;
+    int token_amt;
+} LegacyLexer;
+
+static LegacyToken *LegacyTokenGetNext(LegacyLexer *inst)
+{
+    if (inst->token_amt + 1 > inst->token_buffer_size) {
+        inst->token_buffer_size *= 2;
+        inst->tokens = (LegacyToken *)realloc(inst->tokens, sizeof(LegacyToken) * inst->token_buffer_size);
+    }
+    return &inst->tokens[inst->token_amt++];
+}
+
+static bool LegacyApplySingleCharType(LegacyToken *token)
+{
+    switch (token->start[0]) {
+    case ';': token->type = TT_SEMICOLON; break;
+    case ':': token->type = TT_COLON; break;
+    case ',': token->type = TT_COMMA; break;
+    case '.': token->type = TT_PERIOD; break;
+    case '{': token->type = TT_LBRACE; break;
+    case '}': token->type = TT_RBRACE; break;
+    case '(': token->type = TT_LPAREN; break;
+    case ')': token->type = TT_RPAREN; break;
+    case '=': token->type = TT_EQUALS; break;
+    case '+': token->type = TT_PLUS; break;
+    case '-': token->type = TT_MINUS; break;
+    case '*': token->type = TT_STAR; break;
+    case '/': token->type = TT_SLASH; break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+static bool LegacyIsKeyword(LegacyToken *token, const char *keywords[], int keyword_count)
+{
+    int i;
+    long length = token->end - token->start;
+    for (i = 0; i < keyword_count; i++) {
+        if (length == strlen(keywords[i]) && !strncmp(token->start, keywords[i], length)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void LegacySetType(LegacyToken *token)
+{
+    const char *keywords[] = { "if", "return", "for", "while", "struct", "fn" };
+    const char *types[] = { "int", "str" };
+    int length = token->end - token->start;
+    int i;
+
+    token->type = TT_NONE;
+
+    for (i = 0; i < length; i++) {
+        if (isdigit(token->start[i])) {
+            token->type = TT_NUMBER;
+        }
+        else if (token->start[i] == '.' && token->type == TT_NUMBER) {
+            token->type = TT_NUMBER;
+        }
+        else {
+            token->type = TT_IDENTIFIER;
+            break;
+        }
+    }
+    if (token->type == TT_NUMBER) {
+        return;
+    }
+    if (token->start[0] == '"' || token->start[0] == '\'') {
+        token->type = TT_STRING;
+        return;
+    }
+    if (length == 1 && LegacyApplySingleCharType(token)) {
+        return;
+    }
+    if (LegacyIsKeyword(token, keywords, 6)) {
+        token->type = TT_KEYWORD;
+    }
+    if (LegacyIsKeyword(token, types, 2)) {
+        token->type = TT_TYPE;
+    }
+}
+
+#define LEGACY_IS_WHITESPACE(ch) ((ch) == ' ' || (ch) == '\t' || (ch) == '\n')
+#define LEGACY_IS_STRING(ch) ((ch) == '"' || (ch) == '\'')
+#define LEGACY_IS_SPECIAL(buf, ch) (strchr(buf, ch) != NULL)
+
+static LegacyLexer LegacyLex(char *data, const char *specials)
+{
+    LegacyLexer inst;
+    char ch, lastch = 0;
+    bool in_string = false;
+
+    inst.token_buffer_size = 256;
+    inst.token_amt = 0;
+    inst.tokens = (LegacyToken *)malloc(sizeof(LegacyToken) * inst.token_buffer_size);
+
+    while (LEGACY_IS_WHITESPACE(*data)) {
+        data++;
+    }
+
+    char *newb = data;
+    LegacyToken *token = NULL;
+
+    while ((ch = *newb)) {
+        if (ch == '/' && *(newb + 1) == '/') {
+            while ((ch = *(++newb)) && ch != '\n');
+            while (LEGACY_IS_WHITESPACE(*(++newb)));
+            if (token) {
+                token->start = newb;
+            }
+            continue;
+        }
+
+        if (LEGACY_IS_STRING(ch))
+            in_string = !in_string;
+
+        if (newb == data) {
+            token = LegacyTokenGetNext(&inst);
+            if (!LEGACY_IS_WHITESPACE(ch)) {
+                token->start = newb;
+            }
+        }
+
+        if (LEGACY_IS_WHITESPACE(ch) && !in_string) {
+            token->end = newb;
+            while (LEGACY_IS_WHITESPACE(*(newb + 1)))
+                newb++;
+            LegacySetType(token);
+            token = LegacyTokenGetNext(&inst);
+            token->start = newb + 1;
+        }
+        else if (LEGACY_IS_SPECIAL(specials, ch) && !in_string) {
+            if (!LEGACY_IS_WHITESPACE(lastch) && !LEGACY_IS_SPECIAL(specials, lastch)) {
+                token->end = newb;
+                LegacySetType(token);
+                token = LegacyTokenGetNext(&inst);
+            }
+            token->start = newb;
+            token->end = newb + 1;
+            LegacySetType(token);
+            token = LegacyTokenGetNext(&inst);
+            while (LEGACY_IS_WHITESPACE(*(newb + 1)))
+                newb++;
+            token->start = newb + 1;
+        }
+        lastch = ch;
+        newb++;
+    }
+
+    inst.token_amt--;
+    return inst;
+}
+
+static char *LoadBenchFile(const char *path, long *size)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return NULL;
+
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    rewind(fp);
+
+    char *buffer = (char *)malloc(*size);
+    *size = fread(buffer, 1, *size, fp);
+    fclose(fp);
+    return buffer;
+}
+
+static double Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static bool CompareTokens(Lexer *lexer, LegacyLexer *legacy)
+{
+    if (lexer->token_amt != legacy->token_amt) {
+        printf("token count mismatch: %d vs legacy %d\n", lexer->token_amt, legacy->token_amt);
+        return false;
+    }
+
+    int i;
+    for (i = 0; i < lexer->token_amt; i++) {
+        LexerToken a = LexerGetToken(lexer, i);
+        LegacyToken *b = &legacy->tokens[i];
+
+        if (a.start != b->start || a.end != b->end || a.type != b->type) {
+            printf(
+                "token %d mismatch: [%.*s] %s vs legacy [%.*s] %s\n",
+                i, TKPF(&a), LexerTokenTypeStr(a.type),
+                (int)(b->end - b->start), b->start, LexerTokenTypeStr(b->type)
+            );
+            return false;
+        }
+    }
+    return true;
+}
+
+static double BenchLexerLex(char *input, Lexer *first_run)
+{
+    double best = 1e30;
+
+    int i;
+    for (i = 0; i < ITERATIONS; i++) {
+        double start = Now();
+        Lexer lexer = LexerLex(input, SPECIALS, SFLEX_USE_STRINGS);
+        double elapsed = Now() - start;
+        if (elapsed < best)
+            best = elapsed;
+
+        if (i == 0 && first_run != NULL)
+            *first_run = lexer;
+        else
+            LexerDestroy(&lexer);
+    }
+    return best;
+}
+
+static bool SameTokens(Lexer *a, Lexer *b)
+{
+    if (a->token_amt != b->token_amt) {
+        return false;
+    }
+    int i;
+    for (i = 0; i < a->token_amt; i++) {
+        if (a->token_offsets[i] != b->token_offsets[i] || a->token_lengths[i] != b->token_lengths[i] ||
+            a->token_types[i] != b->token_types[i] || a->token_values[i] != b->token_values[i]) {
+            return false;
+        }
+    }
+
+    // both lexers ran over the same buffer, so their line tables have to match as well
+    if (a->lines->line_count != b->lines->line_count) {
+        return false;
+    }
+    return !memcmp(a->lines->line_starts, b->lines->line_starts, sizeof(size_t) * a->lines->line_count);
+}
+
+/**
+    Time LexerLex with every scanning mode available on this machine, checking each against the
+    scalar token stream.
+*/
+static bool BenchScanModes(const char *name, char *input, long input_size)
+{
+    const LexScanMode modes[] = { LSM_SCALAR, LSM_SSE2, LSM_AVX2, LSM_NEON };
+    Lexer reference;
+    double scalar_time = 0;
+    bool same = true;
+
+    printf("\n[%s, %ld bytes]\n", name, input_size);
+
+    int i;
+    for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        if (!LexScanSetMode(modes[i])) {
+            continue;
+        }
+
+        Lexer lexer;
+        double elapsed = BenchLexerLex(input, &lexer);
+
+        bool mode_same = true;
+        if (modes[i] == LSM_SCALAR) {
+            reference = lexer;
+            scalar_time = elapsed;
+        }
+        else {
+            mode_same = SameTokens(&reference, &lexer);
+            LexerDestroy(&lexer);
+        }
+
+        printf(
+            "%-7s %8.1f MB/s  %5.2fx%s\n", LexScanModeStr(modes[i]),
+            input_size / elapsed / (1024 * 1024), scalar_time / elapsed, mode_same ? "" : "  (tokens DIFFER)"
+        );
+        same = same && mode_same;
+    }
+
+    LexerDestroy(&reference);
+    LexScanSetMode(LSM_AUTO);
+    return same;
+}
+
+/**
+    Time LexerLexParallel with a few thread counts, checking each against LexerLex.
+*/
+static bool BenchParallel(char *input, long input_size)
+{
+    const int thread_counts[] = { 2, 4, 8 };
+    Lexer reference;
+    double sequential_time = BenchLexerLex(input, &reference);
+    bool same = true;
+
+    printf("%-10s %8.1f MB/s\n", "1 thread", input_size / sequential_time / (1024 * 1024));
+
+    int i;
+    for (i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); i++) {
+        double best = 1e30;
+        bool count_same = true;
+
+        int j;
+        for (j = 0; j < ITERATIONS; j++) {
+            double start = Now();
+            Lexer lexer = LexerLexParallel(input, SPECIALS, SFLEX_USE_STRINGS, thread_counts[i]);
+            double elapsed = Now() - start;
+            if (elapsed < best)
+                best = elapsed;
+
+            count_same = count_same && SameTokens(&reference, &lexer);
+            LexerDestroy(&lexer);
+        }
+
+        printf(
+            "%d threads  %8.1f MB/s  %5.2fx%s\n", thread_counts[i],
+            input_size / best / (1024 * 1024), sequential_time / best, count_same ? "" : "  (tokens DIFFER)"
+        );
+        same = same && count_same;
+    }
+
+    LexerDestroy(&reference);
+    return same;
+}
+
+int main(int argc, char **argv)
+{
+    long target_size = 16;
+    if (argc > 1) {
+        target_size = atol(argv[1]);
+    }
+    target_size *= 1024 * 1024;
+
+    // Delete.alps uses del, a keyword that is lexed as an identifier
+    const char *default_files[] = { "../test.alps", "../std.alps", "../tests/Delete.alps" };
+    const char **files = default_files;
+    int file_count = sizeof(default_files) / sizeof(default_files[0]);
+    if (argc > 2) {
+        files = (const char **)&argv[2];
+        file_count = argc - 2;
+    }
+
+    // build the input by repeating each source, separated by newlines
+    char *input = malloc(target_size + 1);
+    long input_size = 0;
+
+    while (input_size < target_size) {
+        int i;
+        for (i = 0; i < file_count; i++) {
+            long size;
+            char *data = LoadBenchFile(files[i], &size);
+            if (data == NULL) {
+                printf("Could not load '%s'\n", files[i]);
+                return 1;
+            }
+            if (input_size + size + 1 > target_size) {
+                free(data);
+                goto done;
+            }
+            memcpy(input + input_size, data, size);
+            input_size += size;
+            input[input_size++] = '\n';
+            free(data);
+        }
+    }
+done:
+    input[input_size] = 0;
+
+    Lexer lexer = LexerLex(input, SPECIALS, SFLEX_USE_STRINGS);
+    LegacyLexer legacy = LegacyLex(input, SPECIALS);
+
+    bool same = CompareTokens(&lexer, &legacy);
+    printf("%d tokens, %ld bytes, streams %s\n", lexer.token_amt, input_size, same ? "match" : "DIFFER");
+
+    LexerDestroy(&lexer);
+    free(legacy.tokens);
+
+    double best_new = BenchLexerLex(input, NULL);
+    double best_legacy = 1e30;
+
+    int i;
+    for (i = 0; i < ITERATIONS; i++) {
+        double start = Now();
+        legacy = LegacyLex(input, SPECIALS);
+        double elapsed = Now() - start;
+        if (elapsed < best_legacy)
+            best_legacy = elapsed;
+        free(legacy.tokens);
+    }
+
+    printf("LexerLex:  %8.1f MB/s (%s)\n", input_size / best_new / (1024 * 1024), LexScanModeStr(LexScanGetMode()));
+    printf("LegacyLex: %8.1f MB/s\n", input_size / best_legacy / (1024 * 1024));
+    printf("speedup:   %8.2fx\n", best_legacy / best_new);
+
+    same = BenchScanModes("sources", input, input_size) && same;
+    same = BenchParallel(input, input_size) && same;
+
+    // comment and string heavy input, where the scanners do most of the work
+    const char *heavy_line =
+        "    // a long comment line that the lexer has to walk past before it finds any tokens at all\n"
+        "    message str = \"a fairly long string literal body that is skipped by the quote scanner\";\n";
+    const long heavy_line_size = strlen(heavy_line);
+
+    input_size = 0;
+    while (input_size + heavy_line_size < target_size) {
+        memcpy(input + input_size, heavy_line, heavy_line_size);
+        input_size += heavy_line_size;
+    }
+    input[input_size] = 0;
+
+    same = BenchScanModes("comments and strings", input, input_size) && same;
+    same = BenchParallel(input, input_size) && same;
+
+    // strings that span lines, so that chunk boundaries often fall inside of one
+    const char *multiline_string =
+        "    text str = \"first line of the string\n"
+        "    second line // not a comment\n"
+        "    third line \";\n";
+    const long multiline_string_size = strlen(multiline_string);
+
+    input_size = 0;
+    while (input_size + multiline_string_size < target_size) {
+        memcpy(input + input_size, multiline_string, multiline_string_size);
+        input_size += multiline_string_size;
+    }
+    input[input_size] = 0;
+
+    printf("\n[multi-line strings, %ld bytes]\n", input_size);
+    same = BenchParallel(input, input_size) && same;
+
+    free(input);
+
+    return same ? 0 : 1;
+}
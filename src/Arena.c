@@ -0,0 +1,105 @@
+#include "Arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN ((size_t)_Alignof(max_align_t))
+
+#define AlignUp(size_) (((size_) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+struct ArenaChunk {
+    struct ArenaChunk *next;
+    _Alignas(max_align_t) char bytes[];
+};
+
+struct ArenaCleanup {
+    struct ArenaCleanup *next;
+    void (*func)(void *arg);
+    void *arg;
+};
+
+void ArenaInit(Arena *arena)
+{
+    arena->chunks = NULL;
+    arena->cleanups = NULL;
+    arena->next = NULL;
+    arena->left = 0;
+    arena->last = NULL;
+}
+
+void *ArenaAlloc(Arena *arena, size_t size)
+{
+    size = AlignUp(size);
+
+    if (arena->left < size) {
+        size_t chunk_size = ARENA_CHUNK_SIZE;
+        if (chunk_size < size) {
+            chunk_size = size;
+        }
+
+        ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + chunk_size);
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+
+        arena->next = chunk->bytes;
+        arena->left = chunk_size;
+    }
+
+    void *ptr = arena->next;
+    arena->next += size;
+    arena->left -= size;
+
+    arena->last = ptr;
+    return ptr;
+}
+
+void *ArenaRealloc(Arena *arena, void *ptr, size_t old_size, size_t new_size)
+{
+    if (ptr == NULL) {
+        return ArenaAlloc(arena, new_size);
+    }
+
+    old_size = AlignUp(old_size);
+    new_size = AlignUp(new_size);
+
+    // the last allocation ends at arena->next, so it can grow into the rest of its chunk
+    if (ptr == arena->last && new_size <= old_size + arena->left) {
+        arena->next = (char *)ptr + new_size;
+        arena->left = arena->left + old_size - new_size;
+        return ptr;
+    }
+    if (new_size <= old_size) {
+        return ptr;
+    }
+
+    void *moved = ArenaAlloc(arena, new_size);
+    memcpy(moved, ptr, old_size);
+    return moved;
+}
+
+void ArenaOnFree(Arena *arena, void (*func)(void *arg), void *arg)
+{
+    ArenaCleanup *cleanup = ArenaAlloc(arena, sizeof(ArenaCleanup));
+    cleanup->func = func;
+    cleanup->arg = arg;
+
+    cleanup->next = arena->cleanups;
+    arena->cleanups = cleanup;
+}
+
+void ArenaFree(Arena *arena)
+{
+    // cleanups are stored in the arena, so run them all before releasing any chunk
+    ArenaCleanup *cleanup;
+    for (cleanup = arena->cleanups; cleanup != NULL; cleanup = cleanup->next) {
+        cleanup->func(cleanup->arg);
+    }
+
+    while (arena->chunks != NULL) {
+        ArenaChunk *next = arena->chunks->next;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+    ArenaInit(arena);
+}
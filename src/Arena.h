@@ -0,0 +1,48 @@
+#ifndef CML_ARENA_H
+#define CML_ARENA_H
+
+#include <stddef.h>
+
+// A region allocator. Allocations are carved out of large chunks and are all released at once
+// with ArenaFree, there is no way to free a single allocation.
+
+typedef struct ArenaChunk ArenaChunk;
+typedef struct ArenaCleanup ArenaCleanup;
+
+typedef struct {
+    ArenaChunk *chunks;
+    ArenaCleanup *cleanups;
+
+    char *next;
+    size_t left;
+
+    // the last allocation, which ArenaRealloc can grow in place
+    void *last;
+} Arena;
+
+void ArenaInit(Arena *arena);
+
+/**
+    Allocate `size` bytes, aligned for any type.
+*/
+void *ArenaAlloc(Arena *arena, size_t size);
+
+/**
+    Resize an allocation from the arena. The most recent allocation is resized in place when it
+    fits, anything else is copied to a new allocation.
+*/
+void *ArenaRealloc(Arena *arena, void *ptr, size_t old_size, size_t new_size);
+
+/**
+    Run `func` when the arena is freed, for resources that allocations in the arena refer to.
+    Cleanups run in the reverse order they were added.
+*/
+void ArenaOnFree(Arena *arena, void (*func)(void *arg), void *arg);
+
+/**
+    Run the cleanups and release every allocation made from the arena. The arena can be used
+    again afterwards.
+*/
+void ArenaFree(Arena *arena);
+
+#endif
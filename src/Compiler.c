@@ -1,96 +1,144 @@
 #include "Compiler.h"
+#include "Ir.h"
+#include "RegAlloc.h"
 #include "Lexer.h"
 #include "Parser.h"
 #include "InternalFuncs.h"
+#include "Keywords.h"
 
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #define CmWrite(msg, ...) CmWrite_(cm, msg, __VA_ARGS__)
-#define CmWriteV(msg, va) CmWrite_(cm, msg, va)
-
-// TODO: add all registers + 32 bit variations
-typedef enum {
-    CR_SP,
-    CR_LR,
-    CR_FP,
-
-    CR_X0,
-    CR_X1,
-    CR_X2,
-    CR_X3,
-    CR_X4,
-    CR_X5,
-    CR_X6,
-    CR_X7,
-    CR_X8,
-    CR_X9,
-    CR_X10,
-    CR_X11,
-    CR_X12,
-} RegN;
-
-const char *RegNames[] = {
-    "SP", "LR", "FP",
-    "X0", "X1", "X2", "X3", "X4", "X5", "X6",
-    "X7", "X8", "X9", "X10", "X11", "X12"
-};
 
+// the output buffer is written out to the file once it holds this much
+#define CM_OUTPUT_FLUSH_SIZE (256 * 1024)
+// space reserved for a formatted line before knowing its real length
+#define CM_WRITE_RESERVE 128
+
+// A distinct string in the program's string pool
 typedef struct
 {
-    NodeLiteral *value;
-    char ref_name[64];
+    const LexerLiteral *value;
+    char ref_name[16];
+
+    // the string this one is the tail of, SYM_NONE when it is emitted on its own
+    SymbolId host;
+    int host_offset;
 } CmStringLiteral;
 
 typedef struct {
     Token *name;
-    int stack_index;
     int sp_size;
+    // size of the value the function returns
+    int return_size;
 } CmFunc;
 
+// Stack frame of a function. The slots of 8 byte values are placed above the 4 byte ones, so
+// every slot is aligned without any padding.
 typedef struct {
-    Node *value;
-    Token *name;
+    int sp_size;
 
-    CmFunc *owner_func;
-    int scope;
-    int stack_position;
+    int wide_slots;
+    int narrow_slots;
 
-    RegN reg;
+    // stack positions of the next slots of each size, while they are handed out
+    int wide_index;
+    int narrow_index;
+} CmFrame;
 
-    CmStringLiteral *string_literal;
-} CmVariable;
+// arguments are passed in X0-X7
+#define CM_MAX_ARGUMENTS 8
 
+typedef struct {
+    Token *name;
+
+    // how many functions deep the variable is declared
+    int scope;
+    int size;
 
+    // Variables are kept in a virtual register, unless functions declared inside of the one
+    // that declares them use them. Those are read from the stack frame of the outer function,
+    // so they live in a slot there.
+    bool captured;
+    int stack_position;
+    IrVReg vreg;
+
+    // the variable the name resolved to where this one was declared, hidden until it goes
+    // out of scope
+    VarId shadowed;
+
+    // id of the string the variable was assigned, SYM_NONE when it does not hold a string literal
+    SymbolId string_literal;
+
+    // how many times the variable is assigned inside of functions, and read in expressions
+    int assign_amt;
+    int read_amt;
+
+    // An int assigned a constant once, which its reads are compiled as, see CmFoldConstants.
+    // The assignment is left out when every read was replaced.
+    bool constant;
+    long long constant_value;
+    int folded_read_amt;
+
+    // Variables declared outside of functions are globals, stored in a data section under a
+    // label instead of on the stack. Their initial value is the constant they are assigned
+    // outside of functions.
+    bool global;
+    long long init_value;
+    SymbolId init_string;
+} CmVariable;
 
+typedef struct CmResolver CmResolver;
 
 typedef struct {
     const char *name;
-    void (*func)(Token *call, int arg_count, Node **arguments);
+    // run while resolving names, the call itself generates no code
+    void (*resolve)(CmResolver *res, Token *call, int arg_count, Node **arguments);
 } CmInternalFunc;
 
 
 
-void CmBinOp(NodeBinOp *binop, CmFunc *func, bool should_mov);
-void CmCompileExpr(Node *node, RegN dest, CmFunc *func);
+void CmBinOp(NodeBinOp *binop, IrOperand reg, CmFunc *func, bool should_mov);
+void CmCompileExpr(Node *node, IrOperand dest, CmFunc *func);
+static void CmUnaryOp(NodeUnaryOp *unary, IrOperand dest, CmFunc *func);
 void CmCompileStatement(Node *statement, CmFunc *func);
 void CmCompileBlock(Node *node, CmFunc *cmfunc);
-void InternVarDelete_(Token *call, int arg_count, Node **args);
+static void InternVarDelete_(CmResolver *res, Token *call, int arg_count, Node **args);
+static void CmFlush(Compiler *cm);
 
 static Compiler *cm;
 
 static int current_scope = 0;
 
-static CmVariable variables[64];
-static int var_index = 0;
-static CmStringLiteral string_literals[64];
-static int string_literal_index = 0;
+// the instructions of the program, printed once all of them are generated
+static IrCode code;
+
+// the tokens of the literals that constant folding puts in place of expressions
+static Arena folded_literals;
+
+// every variable declared in the program, indexed by the VarId its names were resolved to
+static CmVariable *variables = NULL;
+static VarId var_amt = 0;
+static VarId var_buffer_size = 0;
 
-static const CmInternalFunc internal_functions[] = {
-    { "del", InternVarDelete_ },
+// every distinct string literal, keyed by its contents. Ids index `string_literals`.
+static InternTable *string_pool = NULL;
+static CmStringLiteral *string_literals = NULL;
+static SymbolId string_literal_buffer_size = 0;
+
+// by symbol, whether a function of that name is called from reachable code. Filled by
+// CmFindReachable when only reachable functions are compiled.
+static bool *called_symbols = NULL;
+static SymbolId called_symbol_buffer_size = 0;
+
+// indexed by the InternalFuncId stored in the keyword table
+static const CmInternalFunc internal_functions[IF_COUNT] = {
+    [IF_DEL] = { "del", InternVarDelete_ },
 };
 
 Compiler CompilerInit(Node *ast, char *output_path)
@@ -99,37 +147,141 @@ Compiler CompilerInit(Node *ast, char *output_path)
 
     compiler.ast = ast;
     compiler.output_file = fopen(output_path, "w");
+    compiler.output = NULL;
+    compiler.output_amt = 0;
+    compiler.output_buffer_size = 0;
+    compiler.echo = false;
+    compiler.reachable_only = false;
+    PeepholeInit(&compiler.peephole);
+    compiler.optimize = true;
 
     return compiler;
 }
 
 void CompilerDestroy()
 {
+    CmFlush(cm);
     fclose(cm->output_file);
+    free(cm->output);
+    cm->output = NULL;
+    cm->output_buffer_size = 0;
+
+    IrDestroy(&code);
+    ArenaFree(&folded_literals);
+
+    free(called_symbols);
+    called_symbols = NULL;
+    called_symbol_buffer_size = 0;
+
+    free(variables);
+    variables = NULL;
+    var_amt = 0;
+    var_buffer_size = 0;
+
+    if (string_pool != NULL) {
+        InternTableDestroy(string_pool);
+        string_pool = NULL;
+    }
+    free(string_literals);
+    string_literals = NULL;
+    string_literal_buffer_size = 0;
 }
 
-void CmWrite_(Compiler *cm, char *msg, ...)
+/**
+    Write the buffered output to the output file, and to stdout when echoing.
+*/
+static void CmFlush(Compiler *cm)
 {
-    int i;
-    for (i = 0; i < current_scope; i++) {
-        printf("\t");
-        fprintf(cm->output_file, "\t");
+    if (cm->output_amt == 0) {
+        return;
     }
-    va_list va;
-    va_start(va, msg);
-    vfprintf(cm->output_file, msg, va);
-    vprintf(msg, va);
-    va_end(va);
+
+    fwrite(cm->output, 1, cm->output_amt, cm->output_file);
+    if (cm->echo) {
+        fwrite(cm->output, 1, cm->output_amt, stdout);
+    }
+    cm->output_amt = 0;
 }
 
-void CmWriteV_(Compiler *cm, char *msg, va_list va)
+/**
+    Make room for `length` more bytes in the output buffer, flushing it first if it is full.
+    @return where the bytes are to be written.
+*/
+static char *CmReserve(Compiler *cm, size_t length)
 {
-    int i;
-    for (i = 0; i < current_scope; i++) {
-        printf("\t");
+    if (cm->output_amt + length > cm->output_buffer_size) {
+        CmFlush(cm);
+
+        if (length > cm->output_buffer_size) {
+            cm->output_buffer_size = (length > CM_OUTPUT_FLUSH_SIZE) ? length : CM_OUTPUT_FLUSH_SIZE;
+            cm->output = (char *)realloc(cm->output, cm->output_buffer_size);
+        }
+    }
+
+    return cm->output + cm->output_amt;
+}
+
+static void CmAppend(const char *str, size_t length)
+{
+    memcpy(CmReserve(cm, length), str, length);
+    cm->output_amt += length;
+}
+
+static void CmAppendStr(const char *str)
+{
+    CmAppend(str, strlen(str));
+}
+
+static void CmAppendInt(long long value)
+{
+    char digits[24];
+    char *start = digits + sizeof(digits);
+
+    // negate as unsigned, so the smallest value does not overflow
+    unsigned long long magnitude = (value < 0) ? -(unsigned long long)value : (unsigned long long)value;
+    do {
+        *--start = '0' + (magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+
+    if (value < 0) {
+        *--start = '-';
     }
-    vfprintf(cm->output_file, msg, va);
-    vprintf(msg, va);
+
+    CmAppend(start, digits + sizeof(digits) - start);
+}
+
+static void CmAppendIndent(int depth)
+{
+    if (depth > 0) {
+        memset(CmReserve(cm, depth), '\t', depth);
+        cm->output_amt += depth;
+    }
+}
+
+void CmWrite_(Compiler *cm, char *msg, ...)
+{
+    CmAppendIndent(current_scope);
+
+    va_list va, retry;
+    va_start(va, msg);
+    va_copy(retry, va);
+
+    char *out = CmReserve(cm, CM_WRITE_RESERVE);
+    const size_t space = cm->output_buffer_size - cm->output_amt;
+    int length = vsnprintf(out, space, msg, va);
+
+    // the line did not fit, format it again now that its length is known
+    if (length >= 0 && (size_t)length >= space) {
+        out = CmReserve(cm, (size_t)length + 1);
+        vsnprintf(out, (size_t)length + 1, msg, retry);
+    }
+    if (length > 0) {
+        cm->output_amt += length;
+    }
+
+    va_end(retry);
+    va_end(va);
 }
 
 
@@ -146,10 +298,12 @@ int GetSPSize(int real_size)
 
 static void ThrowError(Token *token, char *msg, ...)
 {
+    int line, col;
+
     va_list ap;
     va_start(ap, msg);
-    if (token) {
-        printf("[ERROR] [%d,%d]: ", token->file_line, token->file_col);
+    if (token && LexerTokenPosition(token, &line, &col)) {
+        printf("[ERROR] [%d,%d]: ", line, col);
     }
     else {
         printf("[ERROR]: ");
@@ -161,163 +315,271 @@ static void ThrowError(Token *token, char *msg, ...)
 }
 
 
-const char *RegS(RegN reg_n)
+static IrInst *CmEmit(IrOpcode opcode)
 {
-    return RegNames[reg_n];
+    return IrAppend(&code, opcode, current_scope);
 }
 
-
-static void PrintVarList()
+/**
+    Get a new virtual register for a value of `size` bytes.
+*/
+static IrOperand CmTemp(int size)
 {
-    printf("Vars:{");
-    int i;
-    for (i = 0; i < var_index; i++) {
-        printf("%.*s(%d)", TKPF(variables[i].name), variables[i].scope);
-        if (i < var_index - 1) {
-            printf(", ");
-        }
-    }
-    printf("}\n");
+    return IrOpVReg(IrNewVReg(&code), size);
 }
 
-CmVariable *CmNewVariable(Token *name)
+/**
+    Emit `op a, b`.
+*/
+static void CmEmitRR(IrOpcode op, IrOperand a, IrOperand b)
 {
-    CmVariable *var = &variables[var_index++];
-
-    var->name = name;
-    var->value = NULL;
-    var->stack_position = -1;
-    var->reg = CR_X8;
-    var->owner_func = NULL;
-
-    return var;
+    IrInst *inst = CmEmit(op);
+    IrAddOperand(inst, a);
+    IrAddOperand(inst, b);
 }
 
-
-void CmDeleteVariable(int index)
+/**
+    Emit `op a, b, c`.
+*/
+static void CmEmitRRR(IrOpcode op, IrOperand a, IrOperand b, IrOperand c)
 {
-    memset(&variables[index], 0, sizeof(CmVariable));
-    int i;
-    for (i = index; i < var_index - 1; i++) {
-        memcpy(&variables[i], &variables[i + 1], sizeof(CmVariable));
-    }
-    var_index -= 1;
+    IrInst *inst = CmEmit(op);
+    IrAddOperand(inst, a);
+    IrAddOperand(inst, b);
+    IrAddOperand(inst, c);
 }
 
-
-static int MinSz_(int a, int b) {
-    if (a < b) {
-        return a;
-    }
-    return b;
+/**
+    Cut an immediate down to the part a register of `size` bytes holds. Constants that do not
+    fit would wrap around in the register anyway.
+*/
+static long long ImmSized(long long imm, int size)
+{
+    return (size == 4) ? (long long)(int32_t)imm : imm;
 }
 
-CmVariable *CmFindVariable(Token *name, Token *func_name, int scope, int *index)
+/**
+    Emit `op a, #imm`.
+*/
+static void CmEmitRI(IrOpcode op, IrOperand a, long long imm)
 {
-    int i;
-    for (i = 0; i < var_index; i++) {
-        CmVariable *var = &variables[i];
-        if (var->scope <= scope) {
-            if (var->scope == scope && func_name != NULL && strncmp(var->owner_func->name->start, func_name->start, LexerTokenLength(func_name))) {
-                continue;
-            }
-            if (!strncmp(name->start, variables[i].name->start, MinSz_(LexerTokenLength(variables[i].name), LexerTokenLength(name)))) {
-                if (index != NULL) {
-                    (*index) = i;
-                }
-                return &variables[i];
-            }
-        }
-    }
-    PrintVarList();
-    ThrowError(name, "using undeclared variable '%.*s'\n", TKPF(name));
-    return NULL;
+    IrInst *inst = CmEmit(op);
+    IrAddOperand(inst, a);
+    IrAddOperand(inst, IrOpImm(ImmSized(imm, IrOpSize(a))));
 }
 
-
-void InternVarDelete_(Token *call, int arg_count, Node **args)
+/**
+    Emit `op a, b, #imm`.
+*/
+static void CmEmitRRI(IrOpcode op, IrOperand a, IrOperand b, long long imm)
 {
-    int i;
-    for (i = 0; i < arg_count; i++) {
-        if (args[i]->type != NT_VAR) {
-            ThrowError(call, "Invalid argument passed into del!\n");
-        }
-
-        NodeVar *arg = (NodeVar *)args[i];
+    IrInst *inst = CmEmit(op);
+    IrAddOperand(inst, a);
+    IrAddOperand(inst, b);
+    IrAddOperand(inst, IrOpImm(ImmSized(imm, IrOpSize(a))));
+}
 
-        int vindex;
+/**
+    Emit a load or store of `reg` at `offset` bytes from SP.
+*/
+static void CmEmitStack(IrOpcode op, IrOperand reg, int offset)
+{
+    IrInst *inst = CmEmit(op);
+    IrAddOperand(inst, reg);
+    IrAddOperand(inst, IrOpMem(IrOpReg(CR_SP), offset, IA_OFFSET));
+}
 
-        if (CmFindVariable(arg->value, call, current_scope, &vindex)) {
-            CmDeleteVariable(vindex);
-        }
-    }
+/**
+    Emit a load or store of the pair `a`, `b` at `offset` bytes from `base`.
+*/
+static void CmEmitPair(IrOpcode op, RegN a, RegN b, RegN base, int offset, IrAddressing addressing)
+{
+    IrInst *inst = CmEmit(op);
+    IrAddOperand(inst, IrOpReg(a));
+    IrAddOperand(inst, IrOpReg(b));
+    IrAddOperand(inst, IrOpMem(IrOpReg(base), offset, addressing));
 }
 
-static char *LoadFile_(char *path) {
-    FILE *fp = fopen(path, "rb");
-    if (fp == NULL)
-        return NULL;
+static IrSymbol FuncSymbol(Token *name, Token *parent)
+{
+    IrSymbol symbol = { IS_FUNC, IRL_NONE, 0, name, parent };
+    return symbol;
+}
 
-    fseek(fp, 0, SEEK_END);
-    unsigned file_size = ftell(fp);
-    rewind(fp);
+static IrSymbol StringSymbol(SymbolId id, IrRelocation relocation)
+{
+    IrSymbol symbol = { IS_STRING, relocation, id, NULL, NULL };
+    return symbol;
+}
 
-    char *buffer = (char *)malloc(file_size);
-    fread(buffer, 1, file_size, fp);
-    fclose(fp);
-    return buffer;
+static IrSymbol GlobalSymbol(CmVariable *var, IrRelocation relocation)
+{
+    IrSymbol symbol = { IS_GLOBAL, relocation, (uint32_t)(var - variables), NULL, NULL };
+    return symbol;
 }
 
+static CmVariable *NodeVariable(Node *node)
+{
+    return &variables[((NodeVar *)node)->var];
+}
 
-// TODO: determine size by type, do not always assume 64 bit!.
-int GetTypeSz()
+/**
+    Get the size of a value of a type. Strings are pointers.
+*/
+int GetTypeSz(Token *type)
 {
+    if (type->symbol == SYM_INT) {
+        return 4;
+    }
     return 8;
 }
 
-int CountStorageSz(NodeBlock *block)
+/**
+    Count the slot of a variable, or give it its slot or virtual register when `place` is set.
+*/
+static void LayoutVariable(CmFrame *frame, CmVariable *var, bool place)
 {
-    int size = 0;
+    if (!var->captured) {
+        if (place) {
+            var->vreg = IrNewVReg(&code);
+        }
+        return;
+    }
+
+    if (!place) {
+        if (var->size == 8) {
+            frame->wide_slots++;
+        }
+        else {
+            frame->narrow_slots++;
+        }
+    }
+    else if (var->size == 8) {
+        frame->wide_index -= 8;
+        var->stack_position = frame->wide_index;
+    }
+    else {
+        frame->narrow_index -= var->size;
+        var->stack_position = frame->narrow_index;
+    }
+}
 
+/**
+    Lay out the variables declared in a block and the blocks inside of it. Functions declared
+    inside have frames of their own.
+*/
+static void LayoutBlock(CmFrame *frame, NodeBlock *block, bool place)
+{
     int i;
     for (i = 0; i < block->statement_count; i++) {
         Node *statement = block->statements[i];
 
         if (statement->type == NT_DECLARE) {
-            size += GetTypeSz();
+            LayoutVariable(frame, NodeVariable(((NodeDeclare *)statement)->variable), place);
+        }
+        else if (statement->type == NT_BLOCK) {
+            LayoutBlock(frame, (NodeBlock *)statement, place);
         }
     }
+}
 
-    return size;
+static void LayoutFunc(CmFrame *frame, NodeFuncDeclare *nfd, bool place)
+{
+    int i;
+    for (i = 0; i < nfd->argument_count; i++) {
+        LayoutVariable(frame, NodeVariable(nfd->arguments[i]->variable), place);
+    }
+    if (nfd->block) {
+        LayoutBlock(frame, nfd->block, place);
+    }
+}
+
+/**
+    Lay out the stack frame of a function, with a slot for every argument and variable that a
+    function declared inside uses. The others get virtual registers.
+*/
+static void CmFrameLayout(NodeFuncDeclare *nfd, CmFrame *frame)
+{
+    frame->wide_slots = 0;
+    frame->narrow_slots = 0;
+    LayoutFunc(frame, nfd, false);
+
+    frame->sp_size = GetSPSize(frame->wide_slots * 8 + frame->narrow_slots * 4);
+
+    frame->wide_index = frame->sp_size;
+    frame->narrow_index = frame->sp_size - frame->wide_slots * 8;
+    LayoutFunc(frame, nfd, true);
+}
+
+/**
+    Get the value of a number literal, as decoded by the lexer. Literals are ints, so one that
+    does not fit in 32 bits is an error instead of being cut down.
+*/
+static long long LiteralInt(NodeLiteral *lit)
+{
+    if (lit->token->literal->int_value > INT32_MAX) {
+        ThrowError(lit->token, "Integer literal does not fit in an int!\n");
+    }
+    return (long long)lit->token->literal->int_value;
 }
 
-int TokenToInt(Token *tk)
+/**
+    Get the value of a unary minus applied straight to a number literal. This is the only place
+    2^31 fits, as -2^31 is the smallest int.
+    @return false if the operator is not a minus on a number literal.
+*/
+static bool NegatedLiteral(NodeUnaryOp *unary, long long *value)
 {
-    char v[48];
-    const int length = LexerTokenLength(tk);
-    strncpy(v, tk->start, length);
-    v[length] = 0;
-    return atoi(v);
+    if (unary->op->type != TT_MINUS || unary->node->type != NT_LITERAL) {
+        return false;
+    }
+
+    NodeLiteral *lit = (NodeLiteral *)unary->node;
+    if (lit->token->type != TT_NUMBER) {
+        return false;
+    }
+    if (lit->token->literal->int_value > (int64_t)INT32_MAX + 1) {
+        ThrowError(lit->token, "Integer literal does not fit in an int!\n");
+    }
+    *value = -(long long)lit->token->literal->int_value;
+    return true;
 }
 
 static bool CallInternalFuncs(NodeFuncCall *call)
 {
-    int i;
-    const int func_count = sizeof(internal_functions) / sizeof(CmInternalFunc);
+    Token *name = call->func->value;
+    const Keyword *kw = KeywordFromSymbol(name->symbol);
 
-    for (i = 0; i < func_count; i++) {
-        Token *name = call->func->value;
-        int name_len = LexerTokenLength(name);
+    if (kw == NULL || kw->internal_func == IF_NONE) {
+        return false;
+    }
 
-        const CmInternalFunc *func = &internal_functions[i];
+    printf("Calling %s\n", internal_functions[kw->internal_func].name);
+    return true;
+}
 
-        if (name_len == strlen(func->name) && !strncmp(name->start, internal_functions[i].name, name_len)) {
-            printf("Calling %s\n", func->name);
-            func->func(name, call->argument_count, call->arguments);
-            return true;
+/**
+    Get the size of the value of an expression. The types of arguments are not known at the
+    call, so the results of calls are passed on in full.
+*/
+static int ExprSize(Node *node)
+{
+    switch (node->type) {
+        case NT_LITERAL:
+            return (((NodeLiteral *)node)->token->type == TT_STRING) ? 8 : 4;
+        case NT_VAR:
+            return NodeVariable(node)->size;
+        case NT_UNARYOP:
+            return ExprSize(((NodeUnaryOp *)node)->node);
+        case NT_BINOP: {
+            const int left = ExprSize(((NodeBinOp *)node)->left);
+            const int right = ExprSize(((NodeBinOp *)node)->right);
+            return (left > right) ? left : right;
         }
+        default:
+            break;
     }
-    return false;
+    return 8;
 }
 
 void CmFuncCall(NodeFuncCall *call, CmFunc *func)
@@ -326,70 +588,211 @@ void CmFuncCall(NodeFuncCall *call, CmFunc *func)
         return;
     }
 
+    if (call->argument_count > CM_MAX_ARGUMENTS) {
+        ThrowError(call->func->value, "Functions can take at most %d arguments!\n", CM_MAX_ARGUMENTS);
+    }
+
+    // the arguments are only moved into place once all of them are computed, as computing one
+    // can call other functions
+    IrOperand arguments[CM_MAX_ARGUMENTS];
+
     int i;
     for (i = 0; i < call->argument_count; i++) {
-        CmCompileExpr(call->arguments[i], CR_X0 + i, func);
-
+        arguments[i] = CmTemp(ExprSize(call->arguments[i]));
+        CmCompileExpr(call->arguments[i], arguments[i], func);
     }
-    CmWrite("bl %.*s\n", TKPF(call->func->value));
+    for (i = 0; i < call->argument_count; i++) {
+        CmEmitRR(IR_MOV, IrOpReg(RegSized(CR_X0 + i, IrOpSize(arguments[i]))), arguments[i]);
+    }
+    IrAddOperand(CmEmit(IR_BL), IrOpSymbol(FuncSymbol(call->func->value, NULL)));
 }
 
-const char *ArithTypeToInstr(TokenType type)
+IrOpcode ArithTypeToInstr(TokenType type)
 {
     switch (type) {
         case TT_PLUS:
-            return "add";
+            return IR_ADD;
         case TT_MINUS:
-            return "sub";
+            return IR_SUB;
         case TT_STAR:
-            return "mul";
+            return IR_MUL;
         case TT_SLASH:
-            return "udiv";
+            return IR_SDIV;
         default:
             break;
     }
 
-    return "add";
+    return IR_ADD;
 }
 
-void CmArithInst(char *instr, bool should_mov, RegN dest, RegN src)
+void CmArithInst(IrOpcode instr, bool should_mov, IrOperand dest, IrOperand src)
 {
-    const char *dests = RegS(dest);
-    const char *srcs = RegS(src);
-
     if (should_mov) {
-        CmWrite("mov %s, %s\n", dests, srcs);
+        CmEmitRR(IR_MOV, dest, src);
+    }
+    else if (instr == IR_SDIV) {
+        // the results of calls are passed on in 8 byte registers, whose upper half is not the
+        // sign of the int, so division is always done on the 4 byte values
+        CmEmitRRR(instr, IrOpSized(dest, 4), IrOpSized(dest, 4), IrOpSized(src, 4));
     }
     else {
-        CmWrite("%s %s, %s, %s\n", instr, dests, dests, srcs);
+        CmEmitRRR(instr, dest, dest, src);
     }
 }
 
-
-void CmArithInstImm(char *instr, TokenType op_type, bool should_mov, RegN dest, int imm)
+/**
+    Divide by a power of two with shifts. An arithmetic shift rounds towards minus infinity, so
+    negative values are first biased by `divisor - 1` to round towards zero like sdiv.
+*/
+static void CmDividePow2(IrOperand dest, long long divisor)
 {
-    const char *dests = RegS(dest);
+    const int bits = IrOpSize(dest) * 8;
+    int shift = 0;
+    while ((1LL << shift) != divisor) {
+        shift++;
+    }
+    // all ones for negative values, shifted down to the bias
+    const IrOperand bias = CmTemp(IrOpSize(dest));
+    CmEmitRRI(IR_ASR, bias, dest, bits - 1);
+    CmEmitRRI(IR_LSR, bias, bias, bits - shift);
+    CmEmitRRR(IR_ADD, dest, dest, bias);
+    CmEmitRRI(IR_ASR, dest, dest, shift);
+}
 
+void CmArithInstImm(IrOpcode instr, TokenType op_type, bool should_mov, IrOperand dest, long long imm)
+{
     if (should_mov) {
-        CmWrite("mov %s, %d\n", dest, imm);
+        CmEmitRI(IR_MOV, dest, imm);
     }
     else {
-        if (op_type == TT_STAR || op_type == TT_SLASH) {
-            CmWrite("mov %s, #%d\n", RegS(CR_X10), imm);
-            CmWrite("%s %s, %s, %s\n", instr, dests, dests, RegS(CR_X10));
+        if (op_type == TT_SLASH) {
+            // done on the 4 byte values, like in CmArithInst
+            dest = IrOpSized(dest, 4);
+        }
+
+        const long long divisor = ImmSized(imm, IrOpSize(dest));
+        if (op_type == TT_SLASH && divisor > 1 && (divisor & (divisor - 1)) == 0) {
+            CmDividePow2(dest, divisor);
+        }
+        else if (op_type == TT_STAR || op_type == TT_SLASH) {
+            const IrOperand scratch = CmTemp(IrOpSize(dest));
+            CmEmitRI(IR_MOV, scratch, imm);
+            CmEmitRRR(instr, dest, dest, scratch);
         }
         else {
-            CmWrite("%s %s, %s, #%d\n", instr, dests, dests, imm);
+            // add and sub only take positive immediates, so negative ones use the other one
+            const int size = IrOpSize(dest);
+            const long long negated = ImmSized((long long)(0ULL - (unsigned long long)imm), size);
+            if (ImmSized(imm, size) < 0 && negated > 0) {
+                instr = (instr == IR_ADD) ? IR_SUB : IR_ADD;
+                imm = negated;
+            }
+            CmEmitRRI(instr, dest, dest, imm);
         }
     }
 }
 
-void CmLoadStr(RegN dest, char *name)
+/**
+    Add a string literal to the pool. Strings with the same contents share one entry and label.
+*/
+static SymbolId CmAddString(NodeLiteral *lit)
+{
+    const LexerLiteral *literal = lit->token->literal;
+
+    if (string_pool == NULL) {
+        string_pool = InternTableCreate();
+    }
+
+    const uint32_t amt_before = InternTableCount(string_pool);
+    const SymbolId id = InternTableAdd(string_pool, literal->string, literal->string_length);
+
+    if (InternTableCount(string_pool) == amt_before) {
+        return id;
+    }
+
+    if (id >= string_literal_buffer_size) {
+        string_literal_buffer_size = string_literal_buffer_size ? string_literal_buffer_size * 2 : 64;
+        string_literals = realloc(string_literals, sizeof(CmStringLiteral) * string_literal_buffer_size);
+    }
+
+    CmStringLiteral *string_lit = &string_literals[id];
+    string_lit->value = literal;
+    string_lit->host = SYM_NONE;
+    string_lit->host_offset = 0;
+    sprintf(string_lit->ref_name, "Str%u", id - 1);
+
+    return id;
+}
+
+void CmLoadStr(IrOperand dest, SymbolId string_id)
+{
+    // the address is always 8 bytes
+    dest = IrOpSized(dest, 8);
+
+    IrInst *inst = CmEmit(IR_ADRP);
+    IrAddOperand(inst, dest);
+    IrAddOperand(inst, IrOpSymbol(StringSymbol(string_id, IRL_PAGE)));
+
+    inst = CmEmit(IR_ADD);
+    IrAddOperand(inst, dest);
+    IrAddOperand(inst, dest);
+    IrAddOperand(inst, IrOpSymbol(StringSymbol(string_id, IRL_PAGEOFF)));
+}
+
+/**
+    Write the label of a global variable. The id keeps globals of the same name apart.
+*/
+static void GlobalLabel(CmVariable *var, char *label, size_t label_size)
+{
+    snprintf(label, label_size, ".L.G%u.%.*s", (unsigned)(var - variables), TKPF(var->name));
+}
+
+/**
+    Load or store a global, with its address formed in `address`.
+*/
+static void CmAccessGlobal(IrOpcode op, IrOperand reg, IrOperand address, CmVariable *var)
+{
+    IrInst *inst = CmEmit(IR_ADRP);
+    IrAddOperand(inst, address);
+    IrAddOperand(inst, IrOpSymbol(GlobalSymbol(var, IRL_PAGE)));
+
+    IrOperand mem = IrOpMem(address, 0, IA_PAGEOFF);
+    mem.symbol = GlobalSymbol(var, IRL_PAGEOFF);
+
+    inst = CmEmit(op);
+    IrAddOperand(inst, reg);
+    IrAddOperand(inst, mem);
+}
+
+/**
+    Load a global into `dest`, addressing it through the register itself.
+*/
+static void CmLoadGlobal(IrOperand dest, CmVariable *var)
+{
+    const IrOperand address = IrOpSized(dest, 8);
+    CmAccessGlobal(IR_LDR, IrOpSized(dest, var->size), address, var);
+}
+
+/**
+    Store `src` into a global, addressing it through a register of its own.
+*/
+static void CmStoreGlobal(IrOperand src, CmVariable *var)
+{
+    CmAccessGlobal(IR_STR, src, CmTemp(8), var);
+}
+
+/**
+    Get the virtual register of a variable that is kept in one, holding a value of `size` bytes.
+*/
+static IrOperand VariableReg(CmVariable *var, int size)
 {
-    CmWrite("adrp %s, .L.%s@PAGE\n", RegS(dest), name);
-    CmWrite("add %s, %s, .L.%s@PAGEOFF\n", RegS(dest), RegS(dest), name);
+    return IrOpVReg(var->vreg, size);
 }
 
+/**
+    Get the offset from SP of a variable of an enclosing function, which is reached by going
+    up the stack frames in between.
+*/
 int GetExternalStackOffset_(CmVariable *variable, CmFunc *func)
 {
     int offset = (64 * (current_scope - variable->scope));
@@ -407,96 +810,178 @@ int GetExternalStackOffset_(CmVariable *variable, CmFunc *func)
     @param should_mov - should be true if this is the first call taking place for an operation.
         this will use mov instructions as opposed to accumulating on an existing register.
 */
-void CmSide(Node *side, RegN reg, CmFunc *func, TokenType op_type, bool should_mov)
+void CmSide(Node *side, IrOperand reg, CmFunc *func, TokenType op_type, bool should_mov)
 {
-    char *instr = (char *)ArithTypeToInstr(op_type);
+    const IrOpcode instr = ArithTypeToInstr(op_type);
 
     if (side->type == NT_BINOP) {
-        CmBinOp((NodeBinOp *)side, func, false);
+        CmBinOp((NodeBinOp *)side, reg, func, false);
     }
     else if (side->type == NT_VAR) {
-        CmVariable *var = CmFindVariable(((NodeVar *)side)->value, func->name, current_scope, NULL);
-        if (var->string_literal != NULL) {
-            CmLoadStr(reg, var->string_literal->ref_name);
+        CmVariable *var = NodeVariable(side);
+        if (var->string_literal != SYM_NONE) {
+            CmLoadStr(reg, var->string_literal);
+        }
+        else if (var->global) {
+            const IrOperand value = CmTemp(var->size);
+            CmLoadGlobal(value, var);
+            CmArithInst(instr, should_mov, reg, IrOpSized(value, IrOpSize(reg)));
+        }
+        else if (!var->captured) {
+            CmArithInst(instr, should_mov, reg, VariableReg(var, IrOpSize(reg)));
         }
         else {
+            // loads of 4 bytes clear the upper half, so the value can be used at any size
+            const IrOperand value = CmTemp(var->size);
             int offset = GetExternalStackOffset_(var, func);
-            CmWrite("ldr %s, [%s, #%d]\n", RegS(CR_X9), RegS(CR_SP), var->stack_position + offset);
+            CmEmitStack(IR_LDR, value, var->stack_position + offset);
             // CmWrite("%s %s, %s, w9\n", instr, RegS(reg), RegS(reg));
-            CmArithInst(instr, should_mov, reg, CR_X9);
+            CmArithInst(instr, should_mov, reg, IrOpSized(value, IrOpSize(reg)));
         }
     }
     else if (side->type == NT_LITERAL) {
         NodeLiteral *lit = (NodeLiteral  *)side;
 
         if (lit->token->type == TT_STRING) {
-            CmStringLiteral *string_lit = &string_literals[string_literal_index++];
-
-            char name[16];
-            sprintf(name, "Str%d", string_literal_index);
-
-            strcpy(string_lit->ref_name, name);
-            string_lit->value = lit;
-
+            CmAddString(lit);
             return;
         }
 
-        CmArithInstImm(instr, op_type, should_mov, reg, TokenToInt(lit->token));
+        CmArithInstImm(instr, op_type, should_mov, reg, LiteralInt(lit));
+    }
+    else if (side->type == NT_UNARYOP) {
+        const IrOperand value = CmTemp(IrOpSize(reg));
+        CmUnaryOp((NodeUnaryOp *)side, value, func);
+        CmArithInst(instr, should_mov, reg, value);
     }
     else if (side->type == NT_FUNC_CALL) {
-        CmWrite("str %s, [%s, -16]!\n", RegS(reg), RegS(CR_SP));
-        // CmWrite("mov w9, w8\n", 0);
+        // the register allocator keeps `reg` in a register that the call does not clobber
         CmFuncCall((NodeFuncCall *)side, func);
-        CmWrite("ldr %s, [%s], 16\n", RegS(reg), RegS(CR_SP));
-        // CmWrite("mov w8, w9\n", 0);
         // CmWrite("%s %s, %s, w0\n", instr, RegS(reg), RegS(reg));
-        CmArithInst(instr, should_mov, reg, CR_X0);
+        CmArithInst(instr, should_mov, reg, IrOpReg(RegSized(CR_X0, IrOpSize(reg))));
     }
 }
 
 /**
-    Precalculate constants for some instructions
+    Apply a binary operator to two constants. Values wrap around on overflow like they do in a
+    register, and division rounds towards zero like sdiv. Constant expressions are ints, so
+    division is done on the 4 byte values, which the other operators do not need as the upper
+    bits of their results do not affect the lower ones.
+    @return false for a division by zero, which is left for the program to run into.
 */
-int CmPrecalc(NodeBinOp *binop)
+static bool FoldBinary(TokenType op, long long x, long long y, long long *value)
 {
-    NodeLiteral *a = (NodeLiteral *)binop->left;
-    NodeLiteral *b = (NodeLiteral *)binop->right;
-
-    int x = TokenToInt(a->token);
-    int y = TokenToInt(b->token);
+    // the arithmetic is done unsigned, where overflow is defined
+    const unsigned long long ux = (unsigned long long)x;
+    const unsigned long long uy = (unsigned long long)y;
 
-    switch (binop->op->type) {
+    switch (op) {
         case TT_PLUS:
-            return x + y;
+            *value = (long long)(ux + uy);
+            return true;
         case TT_MINUS:
-            return x - y;
+            *value = (long long)(ux - uy);
+            return true;
         case TT_STAR:
-            return x * y;
-        case TT_SLASH:
-            return x / y;
-        default:
-            break;
-    }
-    return 0;
+            *value = (long long)(ux * uy);
+            return true;
+        case TT_SLASH: {
+            const int32_t x32 = (int32_t)x;
+            const int32_t y32 = (int32_t)y;
+            if (y32 == 0) {
+                return false;
+            }
+            // the one quotient that does not fit, which wraps around to the dividend
+            *value = (x32 == INT32_MIN && y32 == -1) ? x32 : x32 / y32;
+            return true;
+        }
+        default:
+            break;
+    }
+    return false;
 }
 
 /**
-    Compile both sides of a binary operator. This function resolves the sides in proper order when given an unordered tree.
+    Apply a unary operator to a constant.
 */
-void CmBinOp(NodeBinOp *binop, CmFunc *func, bool should_mov)
+static long long FoldUnary(TokenType op, long long x)
 {
-    if (binop->left->type == NT_LITERAL && binop->right->type == NT_LITERAL) {
-        CmWrite("mov %s, #%d\n", RegS(CR_X8), CmPrecalc(binop));
-        return;
+    if (op == TT_MINUS) {
+        return (long long)(0ULL - (unsigned long long)x);
+    }
+    return x;
+}
+
+/**
+    Evaluate an integer expression that only uses literals.
+    @return false if the expression is not constant.
+*/
+static bool EvalConstant(Node *node, long long *value)
+{
+    if (node->type == NT_LITERAL) {
+        NodeLiteral *lit = (NodeLiteral *)node;
+        if (lit->token->type != TT_NUMBER) {
+            return false;
+        }
+        *value = LiteralInt(lit);
+        return true;
+    }
+
+    if (node->type == NT_UNARYOP) {
+        NodeUnaryOp *unary = (NodeUnaryOp *)node;
+        if (NegatedLiteral(unary, value)) {
+            return true;
+        }
+        if (!EvalConstant(unary->node, value)) {
+            return false;
+        }
+        *value = FoldUnary(unary->op->type, *value);
+        return true;
+    }
+
+    if (node->type == NT_BINOP) {
+        NodeBinOp *binop = (NodeBinOp *)node;
+        long long x, y;
+        if (!EvalConstant(binop->left, &x) || !EvalConstant(binop->right, &y)) {
+            return false;
+        }
+        return FoldBinary(binop->op->type, x, y, value);
     }
+    return false;
+}
+
+/**
+    Compile both sides of a binary operator. This function resolves the sides in proper order when given an unordered tree.
+    @param reg - the register to accumulate the result in, of the size of the result
+*/
+void CmBinOp(NodeBinOp *binop, IrOperand reg, CmFunc *func, bool should_mov)
+{
     // if there is a branch on the right side, swap the output order to preserve order of operations
     if (binop->right->type == NT_BINOP) {
-        CmSide(binop->right, CR_X8, func, TT_NONE, true);
-        CmSide(binop->left, CR_X8, func, binop->op->type, false);
+        CmSide(binop->right, reg, func, TT_NONE, true);
+        CmSide(binop->left, reg, func, binop->op->type, false);
     }
     else {
-        CmSide(binop->left, CR_X8, func, TT_NONE, true);
-        CmSide(binop->right, CR_X8, func, binop->op->type, false);
+        CmSide(binop->left, reg, func, TT_NONE, true);
+        CmSide(binop->right, reg, func, binop->op->type, false);
+    }
+}
+
+/**
+    Compile a unary operator into `dest`, which holds the operand before it is negated.
+*/
+static void CmUnaryOp(NodeUnaryOp *unary, IrOperand dest, CmFunc *func)
+{
+    long long value;
+    if (NegatedLiteral(unary, &value)) {
+        CmEmitRI(IR_MOV, dest, value);
+        return;
+    }
+
+    CmCompileExpr(unary->node, dest, func);
+
+    if (unary->op->type == TT_MINUS) {
+        CmEmitRR(IR_NEG, dest, dest);
     }
 }
 
@@ -505,172 +990,856 @@ void CmBinOp(NodeBinOp *binop, CmFunc *func, bool should_mov)
 */
 void CmFuncEnd(CmFunc *func)
 {
-    CmWrite("add %s, %s, #%d\n", RegS(CR_SP), RegS(CR_SP), func->sp_size);
-    CmWrite("ldp %s, %s, [%s], 64\n", RegS(CR_FP), RegS(CR_LR), RegS(CR_SP));
+    CmEmitRRI(IR_ADD, IrOpReg(CR_SP), IrOpReg(CR_SP), func->sp_size);
+    CmEmitPair(IR_LDP, CR_FP, CR_LR, CR_SP, 64, IA_POST_INDEX);
 
     // if (strncmp(func->name->start, "_main", LexerTokenLength(func->name))) {
     //     CmWrite("bx lr\n", 0);
     // }
-    CmWrite("ret\n", 0);
+    CmEmit(IR_RET);
 }
 
 
 
-void CmClearVariableScope(int scope)
+
+void CmCompileExpr(Node *node, IrOperand dest, CmFunc *func)
+{
+    if (node->type == NT_LITERAL) {
+        NodeLiteral *lit = (NodeLiteral *)node;
+
+
+        if (lit->token->type == TT_STRING) {
+            const SymbolId string_id = CmAddString(lit);
+            CmLoadStr(dest, string_id);
+        }
+        else {
+            CmEmitRI(IR_MOV, dest, LiteralInt(lit));
+        }
+    }
+    else {
+        // CmWrite("mov w8, wzr\n", 0);
+        // CmCompileExpr(assign->right, CR_X8);
+        if (node->type == NT_BINOP) {
+            // accumulated in a register of its own, as `dest` can be a variable the expression
+            // uses or a register that calls in the expression overwrite
+            const IrOperand reg = CmTemp(IrOpSize(dest));
+            CmBinOp((NodeBinOp *)node, reg, func, true);
+            CmEmitRR(IR_MOV, dest, reg);
+        }
+        else if (node->type == NT_VAR) {
+            CmVariable *variable = NodeVariable(node);
+
+            if (variable->global) {
+                CmLoadGlobal(dest, variable);
+                return;
+            }
+            if (!variable->captured) {
+                CmEmitRR(IR_MOV, dest, VariableReg(variable, IrOpSize(dest)));
+                return;
+            }
+
+            // if we are accessing from a lower scope, add the stack frame size and our stack pointer index.
+            int offset = GetExternalStackOffset_(variable, func);
+
+            CmEmitStack(IR_LDR, IrOpSized(dest, variable->size), variable->stack_position + offset);
+        }
+        else if (node->type == NT_FUNC_CALL) {
+            CmCompileStatement(node, func);
+            CmEmitRR(IR_MOV, dest, IrOpReg(RegSized(CR_X0, IrOpSize(dest))));
+        }
+        else if (node->type == NT_UNARYOP) {
+            CmUnaryOp((NodeUnaryOp *)node, dest, func);
+        }
+        // CmCompileStatement(assign->right, func);
+    }
+}
+
+/**
+    Compile the functions declared in a function's body, including the ones in blocks inside
+    of it, which are left out when the body is compiled.
+*/
+void PullOutFunctionDeclarations_(NodeBlock *block, CmFunc *func)
 {
     int i;
-    int removed_indices = 0;
-    for (i = 0; i < var_index; i++) {
-        CmVariable *var = &variables[i];
-        if (var->scope >= scope) {
-            memset(var, 0, sizeof(CmVariable));
-            removed_indices++;
+    for (i = 0; i < block->statement_count; i++) {
+        if (block->statements[i]->type == NT_FUNC_DECLARE) {
+            CmCompileStatement(block->statements[i], func);
+        }
+        else if (block->statements[i]->type == NT_BLOCK) {
+            PullOutFunctionDeclarations_((NodeBlock *)block->statements[i], func);
         }
     }
-    var_index -= removed_indices;
 }
 
+static bool IsCalled(SymbolId symbol)
+{
+    return symbol < called_symbol_buffer_size && called_symbols[symbol];
+}
 
+// State of CmFindReachable
+typedef struct {
+    // by symbol, the last function of that name that is waiting for the name to be called, or -1
+    int *last_waiting;
+
+    // functions that have been found but not reached, chained through `waiting_prev`
+    NodeFuncDeclare **waiting;
+    int *waiting_prev;
+    int waiting_amt;
+    int waiting_buffer_size;
+
+    // functions that have been reached and still have to be scanned
+    NodeFuncDeclare **queue;
+    int queue_amt;
+    int queue_buffer_size;
+} CmReach;
+
+static Token *FuncName(NodeFuncDeclare *nfd)
+{
+    return ((NodeVar *)nfd->declaration->variable)->value;
+}
 
-void CmCompileExpr(Node *node, RegN dest, CmFunc *func)
+static void GrowCalledSymbols(CmReach *reach, SymbolId symbol)
 {
-    if (node->type == NT_LITERAL) {
-        NodeLiteral *lit = (NodeLiteral *)node;
+    if (symbol < called_symbol_buffer_size) {
+        return;
+    }
+
+    SymbolId new_size = called_symbol_buffer_size ? called_symbol_buffer_size : 256;
+    while (new_size <= symbol) {
+        new_size *= 2;
+    }
+
+    called_symbols = realloc(called_symbols, sizeof(bool) * new_size);
+    reach->last_waiting = realloc(reach->last_waiting, sizeof(int) * new_size);
+
+    SymbolId i;
+    for (i = called_symbol_buffer_size; i < new_size; i++) {
+        called_symbols[i] = false;
+        reach->last_waiting[i] = -1;
+    }
+    called_symbol_buffer_size = new_size;
+}
+
+static void QueueFunc(CmReach *reach, NodeFuncDeclare *nfd)
+{
+    if (reach->queue_amt == reach->queue_buffer_size) {
+        reach->queue_buffer_size = reach->queue_buffer_size ? reach->queue_buffer_size * 2 : 64;
+        reach->queue = realloc(reach->queue, sizeof(NodeFuncDeclare *) * reach->queue_buffer_size);
+    }
+    reach->queue[reach->queue_amt++] = nfd;
+}
+
+/**
+    Record a function declaration. It is reached right away if its name is already called,
+    otherwise once it is.
+*/
+static void ReachFuncDecl(CmReach *reach, NodeFuncDeclare *nfd)
+{
+    const SymbolId name = FuncName(nfd)->symbol;
+    GrowCalledSymbols(reach, name);
+
+    if (called_symbols[name]) {
+        QueueFunc(reach, nfd);
+        return;
+    }
+
+    if (reach->waiting_amt == reach->waiting_buffer_size) {
+        reach->waiting_buffer_size = reach->waiting_buffer_size ? reach->waiting_buffer_size * 2 : 64;
+        reach->waiting = realloc(reach->waiting, sizeof(NodeFuncDeclare *) * reach->waiting_buffer_size);
+        reach->waiting_prev = realloc(reach->waiting_prev, sizeof(int) * reach->waiting_buffer_size);
+    }
+    reach->waiting[reach->waiting_amt] = nfd;
+    reach->waiting_prev[reach->waiting_amt] = reach->last_waiting[name];
+    reach->last_waiting[name] = reach->waiting_amt++;
+}
+
+/**
+    Mark a name as called, reaching every function of that name found so far.
+*/
+static void ReachCall(CmReach *reach, SymbolId name)
+{
+    GrowCalledSymbols(reach, name);
+
+    if (called_symbols[name]) {
+        return;
+    }
+    called_symbols[name] = true;
+
+    int i;
+    for (i = reach->last_waiting[name]; i >= 0; i = reach->waiting_prev[i]) {
+        QueueFunc(reach, reach->waiting[i]);
+    }
+    reach->last_waiting[name] = -1;
+}
+
+/**
+    Find the calls and function declarations in reachable code. Function bodies are not
+    entered, they are scanned once the function is reached.
+*/
+static void ScanReachable(CmReach *reach, Node *node)
+{
+    int i;
+
+    switch (node->type) {
+        case NT_BINOP:
+            ScanReachable(reach, ((NodeBinOp *)node)->left);
+            ScanReachable(reach, ((NodeBinOp *)node)->right);
+            break;
+        case NT_UNARYOP:
+            ScanReachable(reach, ((NodeUnaryOp *)node)->node);
+            break;
+        case NT_ASSIGN:
+            ScanReachable(reach, ((NodeAssign *)node)->right);
+            break;
+        case NT_RETURN:
+            ScanReachable(reach, ((NodeReturn *)node)->value);
+            break;
+        case NT_BLOCK: {
+            NodeBlock *block = (NodeBlock *)node;
+            for (i = 0; i < block->statement_count; i++) {
+                ScanReachable(reach, block->statements[i]);
+            }
+            break;
+        }
+        case NT_FUNC_CALL: {
+            NodeFuncCall *call = (NodeFuncCall *)node;
+            ReachCall(reach, call->func->value->symbol);
+            for (i = 0; i < call->argument_count; i++) {
+                ScanReachable(reach, call->arguments[i]);
+            }
+            break;
+        }
+        case NT_FUNC_DECLARE:
+            ReachFuncDecl(reach, (NodeFuncDeclare *)node);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+    Find the functions that can be called from `_main` and the top level code, the way `bl`
+    resolves calls by name. Bodies that were skipped by the parser are parsed as their
+    functions are reached, so unused functions are never parsed.
+*/
+static void CmFindReachable(Node *program)
+{
+    CmReach reach;
+    memset(&reach, 0, sizeof(CmReach));
+
+    ReachCall(&reach, InternString("_main", 5));
+    ScanReachable(&reach, program);
+
+    while (reach.queue_amt > 0) {
+        NodeFuncDeclare *nfd = reach.queue[--reach.queue_amt];
+
+        ParserParseBody(nfd);
+        if (nfd->block) {
+            ScanReachable(&reach, (Node *)nfd->block);
+        }
+    }
+
+    free(reach.last_waiting);
+    free(reach.waiting);
+    free(reach.waiting_prev);
+    free(reach.queue);
+}
+
+// State of CmResolveNames
+struct CmResolver {
+    // by symbol, the variable that the name resolves to where the pass is, VAR_NONE if none
+    VarId *bindings;
+    SymbolId binding_buffer_size;
+
+    // the variables of the scopes that are open, in the order they were declared
+    VarId *declared;
+    int declared_amt;
+    int declared_buffer_size;
+
+    // how many functions deep the pass is
+    int scope;
+};
+
+static VarId *GetBinding(CmResolver *res, SymbolId symbol)
+{
+    if (symbol >= res->binding_buffer_size) {
+        SymbolId new_size = res->binding_buffer_size ? res->binding_buffer_size : 256;
+        while (new_size <= symbol) {
+            new_size *= 2;
+        }
+
+        res->bindings = realloc(res->bindings, sizeof(VarId) * new_size);
+        memset(res->bindings + res->binding_buffer_size, 0, sizeof(VarId) * (new_size - res->binding_buffer_size));
+        res->binding_buffer_size = new_size;
+    }
+    return &res->bindings[symbol];
+}
+
+/**
+    Add a variable in the innermost scope. It hides any variable of the same name until the
+    scope is closed.
+*/
+static void ResolveDeclare(CmResolver *res, NodeDeclare *declare)
+{
+    NodeVar *node_var = (NodeVar *)declare->variable;
+
+    // VAR_NONE is never handed out
+    if (var_amt == VAR_NONE) {
+        var_amt = VAR_NONE + 1;
+    }
+    if (var_amt >= var_buffer_size) {
+        var_buffer_size = var_buffer_size ? var_buffer_size * 2 : 64;
+        variables = realloc(variables, sizeof(CmVariable) * var_buffer_size);
+    }
+    if (res->declared_amt == res->declared_buffer_size) {
+        res->declared_buffer_size = res->declared_buffer_size ? res->declared_buffer_size * 2 : 64;
+        res->declared = realloc(res->declared, sizeof(VarId) * res->declared_buffer_size);
+    }
+
+    const VarId id = var_amt++;
+    VarId *binding = GetBinding(res, node_var->value->symbol);
+
+    CmVariable *var = &variables[id];
+    var->name = node_var->value;
+    var->scope = res->scope;
+    var->size = GetTypeSz(declare->type);
+
+    var->global = (res->scope == 0);
+    var->init_value = 0;
+    var->init_string = SYM_NONE;
+
+    // the slot or register is given by CmFrameLayout, once it is known whether the variable
+    // is captured
+    var->captured = false;
+    var->stack_position = -1;
+    var->vreg = VREG_NONE;
+
+    var->shadowed = *binding;
+    var->string_literal = SYM_NONE;
+
+    var->assign_amt = 0;
+    var->read_amt = 0;
+    var->constant = false;
+    var->constant_value = 0;
+    var->folded_read_amt = 0;
+
+    *binding = id;
+    res->declared[res->declared_amt++] = id;
+    node_var->var = id;
+}
+
+static void ResolveVariable(CmResolver *res, NodeVar *node_var)
+{
+    node_var->var = *GetBinding(res, node_var->value->symbol);
+
+    if (node_var->var == VAR_NONE) {
+        ThrowError(node_var->value, "using undeclared variable '%.*s'\n", TKPF(node_var->value));
+    }
+
+    // used from a function declared inside the one that declares it
+    CmVariable *var = &variables[node_var->var];
+    if (!var->global && var->scope < res->scope) {
+        var->captured = true;
+    }
+}
+
+/**
+    Close the scopes opened since `declared_amt` was `start`, making the variables they hid
+    visible again.
+*/
+static void ResolveCloseScope(CmResolver *res, int start)
+{
+    while (res->declared_amt > start) {
+        const CmVariable *var = &variables[res->declared[--res->declared_amt]];
+        VarId *binding = GetBinding(res, var->name->symbol);
+
+        // variables that were deleted are not bound anymore
+        if (*binding == res->declared[res->declared_amt]) {
+            *binding = var->shadowed;
+        }
+    }
+}
+
+static void InternVarDelete_(CmResolver *res, Token *call, int arg_count, Node **args)
+{
+    int i;
+    for (i = 0; i < arg_count; i++) {
+        if (args[i]->type != NT_VAR) {
+            ThrowError(call, "Invalid argument passed into del!\n");
+        }
+
+        NodeVar *arg = (NodeVar *)args[i];
+        ResolveVariable(res, arg);
+
+        *GetBinding(res, arg->value->symbol) = variables[arg->var].shadowed;
+    }
+}
+
+static void ResolveFuncDecl(CmResolver *res, NodeFuncDeclare *nfd);
+static void ResolveStatement(CmResolver *res, Node *node);
+
+static void ResolveExpr(CmResolver *res, Node *node)
+{
+    int i;
+
+    switch (node->type) {
+        case NT_VAR:
+            ResolveVariable(res, (NodeVar *)node);
+            NodeVariable(node)->read_amt++;
+            break;
+        case NT_BINOP:
+            ResolveExpr(res, ((NodeBinOp *)node)->left);
+            ResolveExpr(res, ((NodeBinOp *)node)->right);
+            break;
+        case NT_UNARYOP:
+            ResolveExpr(res, ((NodeUnaryOp *)node)->node);
+            break;
+        case NT_FUNC_CALL: {
+            NodeFuncCall *call = (NodeFuncCall *)node;
+            Token *name = call->func->value;
+            const Keyword *kw = KeywordFromSymbol(name->symbol);
+
+            if (kw != NULL && kw->internal_func != IF_NONE) {
+                internal_functions[kw->internal_func].resolve(res, name, call->argument_count, call->arguments);
+                break;
+            }
+            for (i = 0; i < call->argument_count; i++) {
+                ResolveExpr(res, call->arguments[i]);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+/**
+    Resolve a block's statements in its own scope, in the order CmCompileBlock compiles them.
+*/
+static void ResolveBlock(CmResolver *res, NodeBlock *block)
+{
+    const int start = res->declared_amt;
+
+    int i;
+    for (i = 0; i < block->statement_count; i++) {
+        ResolveStatement(res, block->statements[i]);
+    }
+
+    // the blocks of included files share the scope of globals
+    if (res->scope > 0) {
+        ResolveCloseScope(res, start);
+    }
+}
+
+/**
+    Record the initial value of a global, from an assignment outside of functions.
+*/
+static void ResolveGlobalInit(NodeAssign *assign)
+{
+    CmVariable *var = NodeVariable(assign->left);
+    Node *value = assign->right;
+
+    if (value->type == NT_LITERAL && ((NodeLiteral *)value)->token->type == TT_STRING) {
+        if (var->size != 8) {
+            ThrowError(assign->op, "Assigning a string to '%.*s', which is not a str!\n", TKPF(var->name));
+        }
+        var->init_string = CmAddString((NodeLiteral *)value);
+        return;
+    }
+
+    if (!EvalConstant(value, &var->init_value)) {
+        ThrowError(assign->op, "Globals can only be initialized with constants!\n");
+    }
+}
+
+static void ResolveStatement(CmResolver *res, Node *node)
+{
+    switch (node->type) {
+        case NT_DECLARE:
+            ResolveDeclare(res, (NodeDeclare *)node);
+            break;
+        case NT_ASSIGN: {
+            NodeAssign *assign = (NodeAssign *)node;
+            ResolveVariable(res, (NodeVar *)assign->left);
+
+            if (res->scope == 0) {
+                ResolveGlobalInit(assign);
+                break;
+            }
+            ResolveExpr(res, assign->right);
+            NodeVariable(assign->left)->assign_amt++;
+            break;
+        }
+        case NT_RETURN:
+            ResolveExpr(res, ((NodeReturn *)node)->value);
+            break;
+        case NT_FUNC_CALL:
+            ResolveExpr(res, node);
+            break;
+        case NT_FUNC_DECLARE:
+            ResolveFuncDecl(res, (NodeFuncDeclare *)node);
+            break;
+        case NT_BLOCK:
+            ResolveBlock(res, (NodeBlock *)node);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+    Resolve a function in the order CmFuncDecl compiles it. Nested functions come after the rest
+    of the body, so they see all of its variables.
+*/
+static void ResolveFuncDecl(CmResolver *res, NodeFuncDeclare *nfd)
+{
+    if (cm->reachable_only && !IsCalled(FuncName(nfd)->symbol)) {
+        return;
+    }
+
+    const int start = res->declared_amt;
+    res->scope++;
+
+    int i;
+    for (i = 0; i < nfd->argument_count; i++) {
+        ResolveDeclare(res, nfd->arguments[i]);
+        // arguments are assigned by the call
+        NodeVariable(nfd->arguments[i]->variable)->assign_amt++;
+    }
+
+    if (nfd->block) {
+        NodeBlock *block = nfd->block;
+
+        for (i = 0; i < block->statement_count; i++) {
+            if (block->statements[i]->type != NT_FUNC_DECLARE) {
+                ResolveStatement(res, block->statements[i]);
+            }
+        }
+        for (i = 0; i < block->statement_count; i++) {
+            if (block->statements[i]->type == NT_FUNC_DECLARE) {
+                ResolveFuncDecl(res, (NodeFuncDeclare *)block->statements[i]);
+            }
+        }
+    }
+
+    ResolveCloseScope(res, start);
+    res->scope--;
+}
+
+/**
+    Resolve every variable name in the program to its declaration through a table of the names
+    in scope, and find the variables that functions declared inside of others use. Code
+    generation then reads the variable from the node instead of looking the name up.
+*/
+static void CmResolveNames(Node *program)
+{
+    CmResolver res;
+    memset(&res, 0, sizeof(CmResolver));
+
+    if (program->type == NT_BLOCK) {
+        ResolveBlock(&res, (NodeBlock *)program);
+    }
+
+    free(res.bindings);
+    free(res.declared);
+}
+
+// A number literal made up by constant folding
+typedef struct {
+    Token token;
+    LexerLiteral literal;
+} CmFoldedLiteral;
+
+/**
+    Get the value of a variable that holds the same constant everywhere it is used: globals
+    that are never assigned in functions, and ints that are assigned a constant once.
+    @return false if the variable is not constant.
+*/
+static bool VariableConstant(const CmVariable *var, long long *value)
+{
+    if (var->global) {
+        if (var->assign_amt > 0 || var->init_string != SYM_NONE || var->size != 4) {
+            return false;
+        }
+        *value = ImmSized(var->init_value, var->size);
+        return true;
+    }
+
+    if (!var->constant) {
+        return false;
+    }
+    *value = var->constant_value;
+    return true;
+}
+
+/**
+    Turn an expression node into a number literal of `value`, in place. Every expression node
+    is at least as large as a literal.
+*/
+static void ReplaceWithConstant(Node *node, long long value)
+{
+    // errors about the literal point at the operator or name it replaced
+    Token *token;
+    switch (node->type) {
+        case NT_BINOP:
+            token = ((NodeBinOp *)node)->op;
+            break;
+        case NT_UNARYOP:
+            token = ((NodeUnaryOp *)node)->op;
+            break;
+        case NT_VAR:
+            token = ((NodeVar *)node)->value;
+            break;
+        default:
+            return;
+    }
 
+    CmFoldedLiteral *folded = ArenaAlloc(&folded_literals, sizeof(CmFoldedLiteral));
+    memset(&folded->literal, 0, sizeof(LexerLiteral));
+    // constant expressions are ints, stored like a literal of the same value would be
+    folded->literal.int_value = (int32_t)value;
 
-        if (lit->token->type == TT_STRING) {
-            char strname[16];
-            sprintf(strname, "Str%d", string_literal_index);
+    folded->token = *token;
+    folded->token.type = TT_NUMBER;
+    folded->token.symbol = SYM_NONE;
+    folded->token.literal = &folded->literal;
+
+    node->type = NT_LITERAL;
+    ((NodeLiteral *)node)->token = &folded->token;
+}
+
+static bool FoldExpr(Node *node, long long *value);
 
-            CmStringLiteral *string_lit = &string_literals[string_literal_index++];
+/**
+    Fold an expression that is used as a whole, such as an argument or the value of a return.
+*/
+static void FoldRoot(Node *node)
+{
+    long long value;
+    if (FoldExpr(node, &value) && node->type != NT_LITERAL) {
+        ReplaceWithConstant(node, value);
+    }
+}
 
-            strcpy(string_lit->ref_name, strname);
-            string_lit->value = lit;
+/**
+    Evaluate the constant parts of an expression. The largest constant parts are replaced by
+    literals, so a constant expression is left for the caller to replace.
+    @return true if the whole expression is constant, with its value in `value`.
+*/
+static bool FoldExpr(Node *node, long long *value)
+{
+    int i;
 
-            CmLoadStr(dest, strname);
+    switch (node->type) {
+        case NT_LITERAL: {
+            NodeLiteral *lit = (NodeLiteral *)node;
+            if (lit->token->type != TT_NUMBER) {
+                return false;
+            }
+            *value = LiteralInt(lit);
+            return true;
         }
-        else {
-            CmWrite("mov %s, #%.*s\n", RegS(dest), TKPF(((NodeLiteral *)node)->token));
+        case NT_VAR: {
+            CmVariable *var = NodeVariable(node);
+            if (!VariableConstant(var, value)) {
+                return false;
+            }
+            // constant parts are always replaced by whoever asked for them
+            var->folded_read_amt++;
+            return true;
         }
-    }
-    else {
-        // CmWrite("mov w8, wzr\n", 0);
-        // CmCompileExpr(assign->right, CR_X8);
-        if (node->type == NT_BINOP) {
-            // TODO: remove the only w8 restriction on CmBinOp
-            CmBinOp((NodeBinOp *)node, func, true);
-            if (dest != CR_X8) {
-                CmWrite("mov %s, %s\n", RegS(dest), RegS(CR_X8));
+        case NT_UNARYOP: {
+            NodeUnaryOp *unary = (NodeUnaryOp *)node;
+            if (NegatedLiteral(unary, value)) {
+                return true;
+            }
+            if (!FoldExpr(unary->node, value)) {
+                return false;
             }
+            *value = FoldUnary(unary->op->type, *value);
+            return true;
         }
-        else if (node->type == NT_VAR) {
-            CmVariable *variable = CmFindVariable(((NodeVar *)node)->value, func->name, current_scope, NULL);
-
-            // if we are accessing from a lower scope, add the stack frame size and our stack pointer index.
-            // TODO: remove this, our global variables should be in .bss or similar!
-
-            int offset = GetExternalStackOffset_(variable, func);
-
-            CmWrite("ldr %s, [%s, %d]\n", RegS(dest), RegS(CR_SP), variable->stack_position + offset);
+        case NT_BINOP: {
+            NodeBinOp *binop = (NodeBinOp *)node;
+            long long x, y;
+            const bool left = FoldExpr(binop->left, &x);
+            const bool right = FoldExpr(binop->right, &y);
+
+            if (left && right && FoldBinary(binop->op->type, x, y, value)) {
+                return true;
+            }
+            if (left && binop->left->type != NT_LITERAL) {
+                ReplaceWithConstant(binop->left, x);
+            }
+            if (right && binop->right->type != NT_LITERAL) {
+                ReplaceWithConstant(binop->right, y);
+            }
+            return false;
         }
-        else if (node->type == NT_FUNC_CALL) {
-            CmCompileStatement(node, func);
-            CmWrite("mov %s, %s\n", RegS(dest), RegS(CR_X0));
+        case NT_FUNC_CALL: {
+            NodeFuncCall *call = (NodeFuncCall *)node;
+            const Keyword *kw = KeywordFromSymbol(call->func->value->symbol);
+
+            // internal functions take the variables themselves
+            if (kw != NULL && kw->internal_func != IF_NONE) {
+                return false;
+            }
+            for (i = 0; i < call->argument_count; i++) {
+                FoldRoot(call->arguments[i]);
+            }
+            return false;
         }
-        // CmCompileStatement(assign->right, func);
+        default:
+            break;
     }
+    return false;
 }
 
-CmVariable *CmVarDeclare(Node *statement, RegN dest, CmFunc *func)
+static void FoldFuncDecl(NodeFuncDeclare *nfd);
+
+static void FoldStatement(Node *node, bool in_function)
 {
-    NodeDeclare *declare = (NodeDeclare *)statement;
-    NodeVar *node_var = ((NodeVar*)declare->variable);
+    int i;
 
-    CmVariable *var = CmNewVariable(node_var->value);
-    var->owner_func = func;
-    var->string_literal = NULL;
-    var->reg = dest;
-    var->scope = current_scope;
+    switch (node->type) {
+        case NT_ASSIGN: {
+            NodeAssign *assign = (NodeAssign *)node;
+            CmVariable *var = NodeVariable(assign->left);
 
-    func->stack_index -= GetTypeSz();
+            // the initial values of globals were evaluated while resolving
+            if (!in_function) {
+                break;
+            }
 
-    if (var) {
-        var->stack_position = func->stack_index;
+            long long value;
+            if (!FoldExpr(assign->right, &value)) {
+                break;
+            }
+            if (var->size == 4 && !var->global && var->assign_amt == 1) {
+                var->constant = true;
+                var->constant_value = ImmSized(value, var->size);
+            }
+            if (assign->right->type != NT_LITERAL) {
+                ReplaceWithConstant(assign->right, value);
+            }
+            break;
+        }
+        case NT_RETURN:
+            FoldRoot(((NodeReturn *)node)->value);
+            break;
+        case NT_FUNC_CALL:
+            FoldRoot(node);
+            break;
+        case NT_FUNC_DECLARE:
+            FoldFuncDecl((NodeFuncDeclare *)node);
+            break;
+        case NT_BLOCK: {
+            NodeBlock *block = (NodeBlock *)node;
+            for (i = 0; i < block->statement_count; i++) {
+                FoldStatement(block->statements[i], in_function);
+            }
+            break;
+        }
+        default:
+            break;
     }
-
-    return var;
 }
 
-
-void PullOutFunctionDeclarations_(NodeBlock *block, CmFunc *func)
+/**
+    Fold a function in the order CmFuncDecl compiles it, so that nested functions see the
+    constants of the whole body.
+*/
+static void FoldFuncDecl(NodeFuncDeclare *nfd)
 {
+    if (!nfd->block || (cm->reachable_only && !IsCalled(FuncName(nfd)->symbol))) {
+        return;
+    }
+
+    NodeBlock *block = nfd->block;
     int i;
+    for (i = 0; i < block->statement_count; i++) {
+        if (block->statements[i]->type != NT_FUNC_DECLARE) {
+            FoldStatement(block->statements[i], true);
+        }
+    }
     for (i = 0; i < block->statement_count; i++) {
         if (block->statements[i]->type == NT_FUNC_DECLARE) {
-            CmCompileStatement(block->statements[i], func);
+            FoldFuncDecl((NodeFuncDeclare *)block->statements[i]);
         }
     }
 }
 
-void CmCompileBlockWithoutFuncDecls_(Node *node, CmFunc *func)
+/**
+    Evaluate the constant parts of every expression in the program ahead of code generation,
+    replacing them with literals. Variables that are assigned a constant once hold it
+    everywhere after that, as the code has no branches, so their reads are replaced too.
+*/
+static void CmFoldConstants(Node *program)
 {
-    NodeBlock *block = (NodeBlock *)node;
-
-
-    int i;
-    for (i = 0; i < block->statement_count; i++) {
-        if (block->statements[i]->type != NT_FUNC_DECLARE) {
-            CmCompileStatement(block->statements[i], func);
-        }
+    if (program->type == NT_BLOCK) {
+        FoldStatement(program, false);
     }
-
 }
 
 void CmFuncDecl(NodeFuncDeclare *nfd, CmFunc *func)
 {
     Token *name = ((NodeVar *)nfd->declaration->variable)->value;
 
-    if (func) {
-        CmWrite("%.*s.%.*s:\n", TKPF(func->name), TKPF(name));
-    }
-    else {
-        CmWrite("%.*s:\n", TKPF(name));
+    if (cm->reachable_only && !IsCalled(name->symbol)) {
+        return;
     }
 
+    IrAddOperand(CmEmit(IR_LABEL), IrOpSymbol(FuncSymbol(name, func ? func->name : NULL)));
 
-    int storage_size = 0;
-    if (nfd->block) {
-        storage_size = CountStorageSz(nfd->block);
-    }
 
-    const int arguments_size =  nfd->argument_count * GetTypeSz();
-    const int sp_size =  GetSPSize(storage_size + arguments_size);
+    CmFrame frame;
+    CmFrameLayout(nfd, &frame);
+    const int sp_size = frame.sp_size;
 
-    CmFunc *cmfunc = malloc(sizeof(CmFunc));
-    cmfunc->stack_index = sp_size;
+    // only referenced while the function is being compiled
+    CmFunc function;
+    CmFunc *cmfunc = &function;
     cmfunc->sp_size = sp_size;
+    cmfunc->return_size = GetTypeSz(nfd->declaration->type);
     cmfunc->name = name;
 
     current_scope++;
 
-    CmWrite("stp %s, %s, [%s, -64]!\n", RegS(CR_FP), RegS(CR_LR), RegS(CR_SP));
-    CmWrite("sub %s, %s, #%d\n", RegS(CR_SP), RegS(CR_SP), sp_size);
+    const uint32_t start = code.inst_amt;
 
-    // compile each argument's declare statements
+    CmEmitPair(IR_STP, CR_FP, CR_LR, CR_SP, -64, IA_PRE_INDEX);
+    CmEmitRRI(IR_SUB, IrOpReg(CR_SP), IrOpReg(CR_SP), sp_size);
+
+    if (nfd->argument_count > CM_MAX_ARGUMENTS) {
+        ThrowError(name, "Functions can take at most %d arguments!\n", CM_MAX_ARGUMENTS);
+    }
+
+    // move the arguments to their registers or slots
     int i;
     for (i = 0; i < nfd->argument_count; i++) {
-        // CmCompileStatement((Node *)nfd->arguments[i], cmfunc);
+        CmVariable *var = NodeVariable(nfd->arguments[i]->variable);
+        const IrOperand arg = IrOpReg(RegSized(CR_X0 + i, var->size));
 
-        CmVariable *var = CmVarDeclare((Node *)nfd->arguments[i], CR_X1 + i, cmfunc);
-        CmWrite("str %s, [%s, #%d]\n", RegS(CR_X0 + i), RegS(CR_SP), var->stack_position);
+        if (var->captured) {
+            CmEmitStack(IR_STR, arg, var->stack_position);
+        }
+        else {
+            CmEmitRR(IR_MOV, VariableReg(var, var->size), arg);
+        }
     }
 
 
     // compile the block
     if (nfd->block) {
-        CmCompileBlockWithoutFuncDecls_((Node *)nfd->block, cmfunc);
+        CmCompileBlock((Node *)nfd->block, cmfunc);
+    }
+
+    // the registers are allocated before the nested functions are compiled, so that the code
+    // of the function is in one piece
+    RegAllocRange(&code, start, sp_size);
+
+    if (nfd->block) {
         PullOutFunctionDeclarations_(nfd->block, cmfunc);
-        CmClearVariableScope(current_scope);
     }
 
     current_scope--;
@@ -680,41 +1849,52 @@ void CmCompileStatement(Node *statement, CmFunc *func)
 {
     if (statement->type == NT_LITERAL) {
         NodeLiteral *lit = (NodeLiteral *)statement;
-        CmWrite("#%.*s", TKPF(lit->token));
-    }
-    else if (statement->type == NT_DECLARE) {
-        CmVarDeclare(statement, CR_X8, func);
+        if (lit->token->type == TT_NUMBER) {
+            IrAddOperand(CmEmit(IR_IMM), IrOpImm(LiteralInt(lit)));
+        }
     }
-
     else if (statement->type == NT_ASSIGN) {
         NodeAssign *assign = (NodeAssign *)statement;
 
         // TODO: do not expect just a variable on lhs
-        NodeVar *node_var = (NodeVar *)assign->left;
-
-        CmVariable *var = CmFindVariable(node_var->value, func->name, current_scope, NULL);
+        CmVariable *var = NodeVariable(assign->left);
 
-        if (var == NULL) {
-            printf("Could not find variable!\n");
+        // assignments outside of functions are the initial values of globals, output as data
+        if (func == NULL) {
+            return;
+        }
+        // the reads of variables that hold a constant were replaced by it
+        if (var->constant && var->folded_read_amt == var->read_amt) {
+            return;
         }
 
-        CmCompileExpr(assign->right, CR_X8, func);
+        const IrOperand reg = var->captured || var->global ? CmTemp(var->size) : VariableReg(var, var->size);
+        CmCompileExpr(assign->right, reg, func);
+
+        if (var->global) {
+            CmStoreGlobal(reg, var);
+            return;
+        }
 
         if (assign->right->type == NT_LITERAL) {
             NodeLiteral *lit = (NodeLiteral *)assign->right;
             if (lit->token->type == TT_STRING) {
-                var->string_literal = &string_literals[string_literal_index - 1];
+                var->string_literal = CmAddString(lit);
             }
         }
 
+        if (!var->captured) {
+            return;
+        }
+
         int offset = GetExternalStackOffset_(var, func);
 
         // save variable onto stack
-        CmWrite("str %s, [%s, #%d]\n", RegS(CR_X8), RegS(CR_SP), var->stack_position + offset);
+        CmEmitStack(IR_STR, reg, var->stack_position + offset);
     }
     else if (statement->type == NT_RETURN) {
         NodeReturn *ret = (NodeReturn *)statement;
-        CmCompileExpr(ret->value, CR_X0, func);
+        CmCompileExpr(ret->value, IrOpReg(RegSized(CR_X0, func->return_size)), func);
         CmFuncEnd(func);
     }
     else if (statement->type == NT_FUNC_CALL) {
@@ -728,20 +1908,380 @@ void CmCompileStatement(Node *statement, CmFunc *func)
     }
 }
 
+/**
+    Escape part of the decoded contents of a string literal for an assembler string directive.
+    @return a NUL terminated string that the caller frees.
+*/
+static char *EscapeAsmString(const char *string, int length)
+{
+    // every byte takes at most 4 characters as an octal escape
+    char *escaped = malloc(length * 4 + 1);
+    char *out = escaped;
+
+    int i;
+    for (i = 0; i < length; i++) {
+        const unsigned char c = (unsigned char)string[i];
+
+        switch (c) {
+            case '"':
+                *out++ = '\\';
+                *out++ = '"';
+                break;
+            case '\\':
+                *out++ = '\\';
+                *out++ = '\\';
+                break;
+            case '\n':
+                *out++ = '\\';
+                *out++ = 'n';
+                break;
+            case '\t':
+                *out++ = '\\';
+                *out++ = 't';
+                break;
+            default:
+                if (c < 0x20 || c >= 0x7F) {
+                    out += sprintf(out, "\\%03o", c);
+                }
+                else {
+                    *out++ = c;
+                }
+                break;
+        }
+    }
+    *out = 0;
+
+    return escaped;
+}
+
+/**
+    Order strings by their contents read backwards, so that a string comes right before the
+    strings that end with it.
+*/
+static int CompareStringTails(const void *a, const void *b)
+{
+    const LexerLiteral *x = string_literals[*(const SymbolId *)a].value;
+    const LexerLiteral *y = string_literals[*(const SymbolId *)b].value;
+
+    int i;
+    for (i = 1; i <= x->string_length && i <= y->string_length; i++) {
+        const unsigned char cx = (unsigned char)x->string[x->string_length - i];
+        const unsigned char cy = (unsigned char)y->string[y->string_length - i];
+        if (cx != cy) {
+            return (cx < cy) ? -1 : 1;
+        }
+    }
+    return x->string_length - y->string_length;
+}
+
+static bool IsTailOf(const LexerLiteral *tail, const LexerLiteral *string)
+{
+    return tail->string_length <= string->string_length
+        && !memcmp(tail->string, string->string + string->string_length - tail->string_length, tail->string_length);
+}
+
+/**
+    Point every string that is the tail of a longer one into that string, so it takes no space
+    of its own. Strings with a NUL inside can not share, a reader would stop at the NUL.
+*/
+static void MergeStringTails(SymbolId string_amt)
+{
+    SymbolId *order = malloc(sizeof(SymbolId) * string_amt);
+    SymbolId order_amt = 0;
+
+    SymbolId id;
+    for (id = 1; id < string_amt; id++) {
+        const LexerLiteral *value = string_literals[id].value;
+        if (memchr(value->string, 0, value->string_length) == NULL) {
+            order[order_amt++] = id;
+        }
+    }
+    qsort(order, order_amt, sizeof(SymbolId), CompareStringTails);
+
+    // every string that ends the one after it also ends the host of that one
+    SymbolId host = SYM_NONE;
+    while (order_amt > 0) {
+        id = order[--order_amt];
+
+        if (host != SYM_NONE && IsTailOf(string_literals[id].value, string_literals[host].value)) {
+            string_literals[id].host = host;
+            string_literals[id].host_offset = string_literals[host].value->string_length - string_literals[id].value->string_length;
+        }
+        else {
+            host = id;
+        }
+    }
+
+    free(order);
+}
+
+/**
+    Order the tails of strings by their host, and by where they start in it.
+*/
+static int CompareTailPlacement(const void *a, const void *b)
+{
+    const CmStringLiteral *x = &string_literals[*(const SymbolId *)a];
+    const CmStringLiteral *y = &string_literals[*(const SymbolId *)b];
+
+    if (x->host != y->host) {
+        return (x->host < y->host) ? -1 : 1;
+    }
+    return x->host_offset - y->host_offset;
+}
+
+/**
+    Output the string pool. Strings go into a section of C strings that the linker can merge,
+    and the strings that end another one get a label inside of it instead of a copy.
+*/
 void CmExportDataSection()
 {
-    if (string_literal_index <= 0) {
+    if (string_pool == NULL) {
         return;
     }
-    CmWrite(".data\n", 0);
-    int i;
-    for (i = 0; i < string_literal_index; i++) {
-        CmStringLiteral *strlit = (CmStringLiteral *)&string_literals[i];
-        CmWrite(".L.%s: .asciz %.*s\n", strlit->ref_name, TKPF(strlit->value->token));
+    const SymbolId string_amt = InternTableCount(string_pool);
+
+    MergeStringTails(string_amt);
+
+    SymbolId *tails = malloc(sizeof(SymbolId) * string_amt);
+    SymbolId tail_amt = 0;
+    bool has_nul_strings = false;
+
+    SymbolId id;
+    for (id = 1; id < string_amt; id++) {
+        if (string_literals[id].host != SYM_NONE) {
+            tails[tail_amt++] = id;
+        }
+    }
+    qsort(tails, tail_amt, sizeof(SymbolId), CompareTailPlacement);
+
+    CmWrite(".cstring\n", 0);
+
+    SymbolId tail = 0;
+    for (id = 1; id < string_amt; id++) {
+        const CmStringLiteral *host = &string_literals[id];
+
+        if (memchr(host->value->string, 0, host->value->string_length) != NULL) {
+            has_nul_strings = true;
+            continue;
+        }
+        if (host->host != SYM_NONE) {
+            continue;
+        }
+
+        // the host is split into pieces where its tails start, the last piece ends in the NUL
+        const char *label = host->ref_name;
+        int offset = 0;
+
+        for (; tail < tail_amt && string_literals[tails[tail]].host == id; tail++) {
+            const CmStringLiteral *next = &string_literals[tails[tail]];
+
+            char *escaped = EscapeAsmString(host->value->string + offset, next->host_offset - offset);
+            CmWrite(".L.%s: .ascii \"%s\"\n", label, escaped);
+            free(escaped);
+
+            label = next->ref_name;
+            offset = next->host_offset;
+        }
+
+        char *escaped = EscapeAsmString(host->value->string + offset, host->value->string_length - offset);
+        CmWrite(".L.%s: .asciz \"%s\"\n", label, escaped);
+        free(escaped);
+    }
+    free(tails);
+
+    // strings with a NUL inside would be split apart in a section of C strings
+    if (has_nul_strings) {
+        CmWrite(".data\n", 0);
+        for (id = 1; id < string_amt; id++) {
+            const LexerLiteral *value = string_literals[id].value;
+            if (memchr(value->string, 0, value->string_length) != NULL) {
+                char *escaped = EscapeAsmString(value->string, value->string_length);
+                CmWrite(".L.%s: .asciz \"%s\"\n", string_literals[id].ref_name, escaped);
+                free(escaped);
+            }
+        }
+    }
+}
+
+
+/**
+    Output the globals that belong in one section.
+    @param section - .data for globals that are written to and start out with a value, .bss for
+        the ones that start out as zero and .const for the ones that are never written to.
+*/
+static void CmExportGlobalSection(const char *section)
+{
+    bool section_started = false;
+
+    VarId id;
+    for (id = VAR_NONE + 1; id < var_amt; id++) {
+        CmVariable *var = &variables[id];
+        if (!var->global) {
+            continue;
+        }
+
+        const bool zero = (var->init_value == 0 && var->init_string == SYM_NONE);
+
+        // pointers to strings are relocated, so they are always written
+        const char *var_section = ".bss";
+        if (var->assign_amt == 0 && var->init_string == SYM_NONE) {
+            var_section = ".const";
+        }
+        else if (!zero) {
+            var_section = ".data";
+        }
+
+        if (strcmp(var_section, section)) {
+            continue;
+        }
+        if (!section_started) {
+            CmWrite("%s\n", section);
+            section_started = true;
+        }
+
+        char label[128];
+        GlobalLabel(var, label, sizeof(label));
+
+        CmWrite(".p2align %d\n", (var->size == 8) ? 3 : 2);
+        if (var->init_string != SYM_NONE) {
+            CmWrite("%s: .quad .L.%s\n", label, string_literals[var->init_string].ref_name);
+        }
+        else if (zero) {
+            CmWrite("%s: .zero %d\n", label, var->size);
+        }
+        else if (var->size == 8) {
+            CmWrite("%s: .quad %lld\n", label, var->init_value);
+        }
+        else {
+            CmWrite("%s: .word %d\n", label, (int)var->init_value);
+        }
+    }
+}
+
+void CmExportGlobals()
+{
+    CmExportGlobalSection(".data");
+    CmExportGlobalSection(".const");
+    CmExportGlobalSection(".bss");
+}
+
+static void CmPrintSymbol(const IrSymbol *symbol)
+{
+    if (symbol->kind == IS_FUNC) {
+        if (symbol->parent) {
+            CmAppend(symbol->parent->start, LexerTokenLength(symbol->parent));
+            CmAppend(".", 1);
+        }
+        CmAppend(symbol->name->start, LexerTokenLength(symbol->name));
+    }
+    else if (symbol->kind == IS_STRING) {
+        CmAppend(".L.", 3);
+        CmAppendStr(string_literals[symbol->id].ref_name);
+    }
+    else {
+        char label[128];
+        GlobalLabel(&variables[symbol->id], label, sizeof(label));
+        CmAppendStr(label);
+    }
+
+    if (symbol->relocation == IRL_PAGE) {
+        CmAppend("@PAGE", 5);
+    }
+    else if (symbol->relocation == IRL_PAGEOFF) {
+        CmAppend("@PAGEOFF", 8);
+    }
+}
+
+static void CmPrintOperand(const IrOperand *operand)
+{
+    switch (operand->kind) {
+        case IO_REG:
+            CmAppendStr(RegS(operand->reg));
+            break;
+        case IO_VREG:
+            // only seen when printing before registers are allocated
+            CmAppend("v", 1);
+            CmAppendInt(operand->vreg);
+            break;
+        case IO_IMM:
+            CmAppend("#", 1);
+            CmAppendInt(operand->value);
+            break;
+        case IO_SYMBOL:
+            CmPrintSymbol(&operand->symbol);
+            break;
+        case IO_MEM:
+            CmAppend("[", 1);
+            if (operand->vreg != VREG_NONE) {
+                CmAppend("v", 1);
+                CmAppendInt(operand->vreg);
+            }
+            else {
+                CmAppendStr(RegS(operand->reg));
+            }
+
+            if (operand->addressing == IA_OFFSET) {
+                CmAppend(", #", 3);
+                CmAppendInt(operand->value);
+                CmAppend("]", 1);
+            }
+            else if (operand->addressing == IA_PRE_INDEX) {
+                CmAppend(", ", 2);
+                CmAppendInt(operand->value);
+                CmAppend("]!", 2);
+            }
+            else if (operand->addressing == IA_POST_INDEX) {
+                CmAppend("], ", 3);
+                CmAppendInt(operand->value);
+            }
+            else {
+                CmAppend(", ", 2);
+                CmPrintSymbol(&operand->symbol);
+                CmAppend("]", 1);
+            }
+            break;
+        default:
+            break;
     }
 }
 
+/**
+    Print the instructions as assembly.
+*/
+static void CmPrintIr(const IrCode *ir)
+{
+    uint32_t i;
+    for (i = 0; i < ir->inst_amt; i++) {
+        const IrInst *inst = &ir->insts[i];
+
+        CmAppendIndent(inst->depth);
+
+        if (inst->opcode == IR_LABEL) {
+            CmPrintSymbol(&inst->operands[0].symbol);
+            CmAppend(":\n", 2);
+            continue;
+        }
+        // literal statements are output without a line break
+        if (inst->opcode == IR_IMM) {
+            CmPrintOperand(&inst->operands[0]);
+            continue;
+        }
+
+        CmAppendStr(IrOpcodeName(inst->opcode));
+
+        int operand;
+        for (operand = 0; operand < inst->operand_amt; operand++) {
+            CmAppend((operand == 0) ? " " : ", ", (operand == 0) ? 1 : 2);
+            CmPrintOperand(&inst->operands[operand]);
+        }
+        CmAppend("\n", 1);
+    }
+}
 
+/**
+    Compile the statements of a block. Functions declared inside of another function are left
+    for PullOutFunctionDeclarations_.
+*/
 void CmCompileBlock(Node *node, CmFunc *cmfunc)
 {
     NodeBlock *block = (NodeBlock *)node;
@@ -749,10 +2289,21 @@ void CmCompileBlock(Node *node, CmFunc *cmfunc)
 
     int i;
     for (i = 0; i < block->statement_count; i++) {
-        CmCompileStatement(block->statements[i], cmfunc);
-    }
+        Node *statement = block->statements[i];
+
+        if (cmfunc && statement->type == NT_FUNC_DECLARE) {
+            continue;
+        }
+
+        const uint32_t start = code.inst_amt;
+        CmCompileStatement(statement, cmfunc);
 
-    CmClearVariableScope(current_scope);
+        // code outside of functions gets its registers statement by statement
+        const bool top_level_code = (statement->type != NT_FUNC_DECLARE && statement->type != NT_BLOCK);
+        if (cmfunc == NULL && top_level_code && !RegAllocRange(&code, start, -1)) {
+            ThrowError(NULL, "Statement is too complex to compile outside of a function!\n");
+        }
+    }
 }
 
 void CmCompileProgram(Compiler *cm_)
@@ -761,8 +2312,20 @@ void CmCompileProgram(Compiler *cm_)
     CmWrite(".text\n", 0);
     CmWrite(".globl _main\n", 0);
     CmWrite(".align 2\n", 0);
+    if (cm->reachable_only) {
+        CmFindReachable(cm->ast);
+    }
+    CmResolveNames(cm->ast);
+    ArenaInit(&folded_literals);
+    CmFoldConstants(cm->ast);
+    IrInit(&code);
     if (cm->ast->type == NT_BLOCK) {
         CmCompileBlock(cm->ast, NULL);
     }
+    if (cm->optimize) {
+        PeepholeRun(&cm->peephole, &code, 0);
+    }
+    CmPrintIr(&code);
+    CmExportGlobals();
     CmExportDataSection();
 }
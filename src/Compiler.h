@@ -2,6 +2,7 @@
 #define CML_COMPILER_H
 
 #include "Parser.h"
+#include "Peephole.h"
 
 #include <stdio.h>
 
@@ -10,6 +11,22 @@ typedef struct {
     // Parser parser;
     Node *ast;
     FILE *output_file;
+
+    // assembly waiting to be written to `output_file`
+    char *output;
+    size_t output_amt;
+    size_t output_buffer_size;
+
+    // also print the assembly to stdout
+    bool echo;
+
+    // only generate code for functions that can be called from `_main` or the top level code.
+    // Needed when function bodies are parsed lazily, as the others are never parsed.
+    bool reachable_only;
+
+    // optimizes the instructions before they are printed, when `optimize` is set
+    Peephole peephole;
+    bool optimize;
 } Compiler;
 
 
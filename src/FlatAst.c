@@ -0,0 +1,325 @@
+#include "FlatAst.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define FLAT_BUFFER_START 256
+
+static FlatIndex FlatAddNode(FlatAst *flat, NodeType type, Token *token)
+{
+    if (flat->node_amt + 1 > flat->node_buffer_size) {
+        flat->node_buffer_size *= 2;
+        flat->nodes = realloc(flat->nodes, sizeof(FlatNode) * flat->node_buffer_size);
+    }
+
+    FlatNode *node = &flat->nodes[flat->node_amt];
+    node->type = (uint8_t)type;
+    node->token = FLAT_NONE;
+    node->a = FLAT_NONE;
+    node->b = FLAT_NONE;
+
+    if (token != NULL) {
+        if (flat->token_amt + 1 > flat->token_buffer_size) {
+            flat->token_buffer_size *= 2;
+            flat->tokens = realloc(flat->tokens, sizeof(Token *) * flat->token_buffer_size);
+        }
+        node->token = flat->token_amt;
+        flat->tokens[flat->token_amt++] = token;
+    }
+
+    return flat->node_amt++;
+}
+
+/**
+    Reserve a range of `count` children, filled in as the children are flattened.
+*/
+static FlatIndex FlatReserveChildren(FlatAst *flat, uint32_t count)
+{
+    while (flat->child_amt + count > flat->child_buffer_size) {
+        flat->child_buffer_size *= 2;
+        flat->children = realloc(flat->children, sizeof(FlatIndex) * flat->child_buffer_size);
+    }
+
+    const FlatIndex first = flat->child_amt;
+    flat->child_amt += count;
+    return first;
+}
+
+static FlatIndex FlatAddTree(FlatAst *flat, Node *node);
+
+/**
+    Flatten a list of nodes into the range reserved for the node at `index`. Flattening a child
+    can move the children array, so it is only written to by index.
+*/
+static void FlatAddRange(FlatAst *flat, FlatIndex index, Node **nodes, int count)
+{
+    const FlatIndex first = flat->nodes[index].a;
+
+    int i;
+    for (i = 0; i < count; i++) {
+        const FlatIndex child = FlatAddTree(flat, nodes[i]);
+        flat->children[first + i] = child;
+    }
+}
+
+static FlatIndex FlatAddTree(FlatAst *flat, Node *node)
+{
+    if (node == NULL) {
+        return FLAT_NONE;
+    }
+
+    FlatIndex index = FLAT_NONE;
+    FlatIndex a = FLAT_NONE;
+    FlatIndex b = FLAT_NONE;
+
+    // nodes are added before their children, so the array is in pre-order
+    switch (node->type) {
+        case NT_LITERAL:
+            index = FlatAddNode(flat, node->type, ((NodeLiteral *)node)->token);
+            break;
+
+        case NT_VAR:
+            index = FlatAddNode(flat, node->type, ((NodeVar *)node)->value);
+            break;
+
+        case NT_UNARYOP: {
+            NodeUnaryOp *unary = (NodeUnaryOp *)node;
+            index = FlatAddNode(flat, node->type, unary->op);
+            a = FlatAddTree(flat, unary->node);
+            break;
+        }
+
+        case NT_BINOP: {
+            NodeBinOp *binop = (NodeBinOp *)node;
+            index = FlatAddNode(flat, node->type, binop->op);
+            a = FlatAddTree(flat, binop->left);
+            b = FlatAddTree(flat, binop->right);
+            break;
+        }
+
+        case NT_ASSIGN: {
+            NodeAssign *assign = (NodeAssign *)node;
+            index = FlatAddNode(flat, node->type, assign->op);
+            a = FlatAddTree(flat, assign->left);
+            b = FlatAddTree(flat, assign->right);
+            break;
+        }
+
+        case NT_DECLARE: {
+            NodeDeclare *declare = (NodeDeclare *)node;
+            index = FlatAddNode(flat, node->type, declare->type);
+            a = FlatAddTree(flat, declare->variable);
+            break;
+        }
+
+        case NT_RETURN:
+            index = FlatAddNode(flat, node->type, NULL);
+            a = FlatAddTree(flat, ((NodeReturn *)node)->value);
+            break;
+
+        case NT_BLOCK: {
+            NodeBlock *block = (NodeBlock *)node;
+            index = FlatAddNode(flat, node->type, NULL);
+            flat->nodes[index].a = FlatReserveChildren(flat, block->statement_count);
+            flat->nodes[index].b = block->statement_count;
+
+            FlatAddRange(flat, index, block->statements, block->statement_count);
+            return index;
+        }
+
+        case NT_FUNC_CALL: {
+            NodeFuncCall *call = (NodeFuncCall *)node;
+            index = FlatAddNode(flat, node->type, call->func->value);
+            flat->nodes[index].a = FlatReserveChildren(flat, call->argument_count);
+            flat->nodes[index].b = call->argument_count;
+
+            FlatAddRange(flat, index, call->arguments, call->argument_count);
+            return index;
+        }
+
+        case NT_FUNC_DECLARE: {
+            NodeFuncDeclare *fdecl = (NodeFuncDeclare *)node;
+            index = FlatAddNode(flat, node->type, NULL);
+
+            const uint32_t count = FLAT_FUNC_ARGUMENTS + fdecl->argument_count;
+            const FlatIndex first = FlatReserveChildren(flat, count);
+            flat->nodes[index].a = first;
+            flat->nodes[index].b = count;
+
+            FlatIndex child = FlatAddTree(flat, (Node *)fdecl->declaration);
+            flat->children[first + FLAT_FUNC_DECLARATION] = child;
+
+            // arguments come before the block, the same order they are printed in
+            int i;
+            for (i = 0; i < fdecl->argument_count; i++) {
+                child = FlatAddTree(flat, (Node *)fdecl->arguments[i]);
+                flat->children[first + FLAT_FUNC_ARGUMENTS + i] = child;
+            }
+
+            child = FlatAddTree(flat, (Node *)fdecl->block);
+            flat->children[first + FLAT_FUNC_BLOCK] = child;
+
+            return index;
+        }
+    }
+
+    flat->nodes[index].a = a;
+    flat->nodes[index].b = b;
+
+    return index;
+}
+
+FlatAst FlatAstBuild(Node *root)
+{
+    FlatAst flat;
+
+    flat.node_buffer_size = FLAT_BUFFER_START;
+    flat.nodes = malloc(sizeof(FlatNode) * flat.node_buffer_size);
+    flat.node_amt = 0;
+
+    flat.child_buffer_size = FLAT_BUFFER_START;
+    flat.children = malloc(sizeof(FlatIndex) * flat.child_buffer_size);
+    flat.child_amt = 0;
+
+    flat.token_buffer_size = FLAT_BUFFER_START;
+    flat.tokens = malloc(sizeof(Token *) * flat.token_buffer_size);
+    flat.token_amt = 0;
+
+    flat.root = FlatAddTree(&flat, root);
+    return flat;
+}
+
+const FlatIndex *FlatAstChildren(const FlatAst *flat, FlatIndex index, uint32_t *count)
+{
+    *count = flat->nodes[index].b;
+    return &flat->children[flat->nodes[index].a];
+}
+
+Token *FlatAstToken(const FlatAst *flat, FlatIndex index)
+{
+    const uint32_t token = flat->nodes[index].token;
+    return (token == FLAT_NONE) ? NULL : flat->tokens[token];
+}
+
+/**
+    Get how many nodes directly under a node are printed below it. Function declarations print
+    their declaration on their own line, so it is not counted.
+*/
+static uint32_t FlatPrintedChildren(const FlatAst *flat, const FlatNode *node)
+{
+    switch ((NodeType)node->type) {
+        case NT_UNARYOP:
+        case NT_DECLARE:
+        case NT_RETURN:
+            return (node->a != FLAT_NONE);
+
+        case NT_BINOP:
+        case NT_ASSIGN:
+            return (node->a != FLAT_NONE) + (node->b != FLAT_NONE);
+
+        case NT_BLOCK:
+        case NT_FUNC_CALL:
+            return node->b;
+
+        case NT_FUNC_DECLARE:
+            return node->b - FLAT_FUNC_ARGUMENTS + (flat->children[node->a + FLAT_FUNC_BLOCK] != FLAT_NONE);
+
+        default:
+            break;
+    }
+    return 0;
+}
+
+void FlatAstPrint(const FlatAst *flat)
+{
+    // The nodes are in the order they are printed in, so the tree is printed in one pass over
+    // the array. `pending` holds the amount of nodes still to come on every level above the
+    // current node, which gives its depth.
+    uint32_t *pending = malloc(sizeof(uint32_t) * (flat->node_amt + 1));
+    uint32_t depth = 0;
+
+    FlatIndex index;
+    for (index = 0; index < flat->node_amt; index++) {
+        const FlatNode *node = &flat->nodes[index];
+        Token *token = FlatAstToken(flat, index);
+
+        uint32_t i;
+        for (i = 0; i < depth; i++) {
+            printf("    ");
+        }
+
+        switch ((NodeType)node->type) {
+            case NT_LITERAL:
+                printf("LITERAL (%.*s)\n", TKPF(token));
+                break;
+            case NT_UNARYOP:
+                printf("UNARYOP %.*s\n", TKPF(token));
+                break;
+            case NT_BINOP:
+                printf("BINOP %.*s\n", TKPF(token));
+                break;
+            case NT_BLOCK:
+                printf("BLOCK\n");
+                break;
+            case NT_ASSIGN:
+                printf("ASSIGN %.*s\n", TKPF(token));
+                break;
+            case NT_DECLARE:
+                printf("DECLARE %.*s\n", TKPF(token));
+                break;
+            case NT_VAR:
+                printf("VARIABLE %.*s\n", TKPF(token));
+                break;
+            case NT_FUNC_CALL:
+                printf("FUNCCALL %.*s\n", TKPF(token));
+                break;
+            case NT_RETURN:
+                printf("RETURN\n");
+                break;
+
+            case NT_FUNC_DECLARE: {
+                // the declaration and its variable come right after the function
+                const FlatIndex declaration = flat->children[node->a + FLAT_FUNC_DECLARATION];
+                Token *name = FlatAstToken(flat, flat->nodes[declaration].a);
+                printf("FUNCDECL %.*s -> %.*s\n", TKPF(name), TKPF(FlatAstToken(flat, declaration)));
+                index = flat->nodes[declaration].a;
+                break;
+            }
+
+            default:
+                printf("UNKNOWN %d\n", node->type);
+                break;
+        }
+
+        if (depth > 0) {
+            pending[depth - 1]--;
+        }
+
+        const uint32_t children = FlatPrintedChildren(flat, node);
+        if (children > 0) {
+            pending[depth++] = children;
+        }
+        else {
+            while (depth > 0 && pending[depth - 1] == 0) {
+                depth--;
+            }
+        }
+    }
+
+    free(pending);
+}
+
+void FlatAstDestroy(FlatAst *flat)
+{
+    free(flat->nodes);
+    free(flat->children);
+    free(flat->tokens);
+
+    flat->nodes = NULL;
+    flat->children = NULL;
+    flat->tokens = NULL;
+    flat->node_amt = 0;
+    flat->child_amt = 0;
+    flat->token_amt = 0;
+    flat->root = FLAT_NONE;
+}
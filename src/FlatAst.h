@@ -0,0 +1,72 @@
+#ifndef CML_FLAT_AST_H
+#define CML_FLAT_AST_H
+
+#include "Parser.h"
+
+// A flattened copy of the AST. Nodes live in one array in pre-order and refer to their children
+// by index, and the statements of blocks and the arguments of functions are ranges in a shared
+// side array. Read-only passes like printing the tree are then a linear walk over the node array,
+// and as it has no pointers it is also the form precompiled modules store trees in.
+
+// index of a node in a FlatAst
+typedef uint32_t FlatIndex;
+#define FLAT_NONE UINT32_MAX
+
+typedef struct {
+    // a NodeType
+    uint8_t type;
+
+    // index into FlatAst.tokens, FLAT_NONE for nodes without a token
+    uint32_t token;
+
+    // Children of the node, depending on its type:
+    //   NT_UNARYOP, NT_DECLARE, NT_RETURN: `a` is the child
+    //   NT_BINOP, NT_ASSIGN:               `a` is the left side, `b` the right side
+    //   NT_BLOCK, NT_FUNC_CALL:            `a` is the first of `b` indices in FlatAst.children
+    //   NT_FUNC_DECLARE:                   a range like NT_BLOCK, holding the declaration, the
+    //                                      block (FLAT_NONE without a body) and the arguments
+    FlatIndex a;
+    FlatIndex b;
+} FlatNode;
+
+// indices into the children of an NT_FUNC_DECLARE
+#define FLAT_FUNC_DECLARATION 0
+#define FLAT_FUNC_BLOCK 1
+#define FLAT_FUNC_ARGUMENTS 2
+
+typedef struct {
+    FlatNode *nodes;
+    uint32_t node_amt;
+    uint32_t node_buffer_size;
+
+    FlatIndex *children;
+    uint32_t child_amt;
+    uint32_t child_buffer_size;
+
+    Token **tokens;
+    uint32_t token_amt;
+    uint32_t token_buffer_size;
+
+    FlatIndex root;
+} FlatAst;
+
+/**
+    Flatten the tree under `root`.
+*/
+FlatAst FlatAstBuild(Node *root);
+
+/**
+    Get the children of a range node (NT_BLOCK, NT_FUNC_CALL or NT_FUNC_DECLARE).
+*/
+const FlatIndex *FlatAstChildren(const FlatAst *flat, FlatIndex index, uint32_t *count);
+
+Token *FlatAstToken(const FlatAst *flat, FlatIndex index);
+
+/**
+    Print the tree, in the same form as the parser builds it.
+*/
+void FlatAstPrint(const FlatAst *flat);
+
+void FlatAstDestroy(FlatAst *flat);
+
+#endif
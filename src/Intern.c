@@ -0,0 +1,225 @@
+#include "Intern.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SYMBOL_BUFFER_START 1024
+#define NAME_CHUNK_SIZE (64 * 1024)
+
+typedef struct {
+    const char *name;
+    uint32_t length;
+    uint32_t hash;
+} Symbol;
+
+static const char *predefined_names[SYM_PREDEFINED_COUNT] = {
+    [SYM_NONE] = "",
+
+    [SYM_IF] = "if",
+    [SYM_RETURN] = "return",
+    [SYM_FOR] = "for",
+    [SYM_WHILE] = "while",
+    [SYM_STRUCT] = "struct",
+    [SYM_FN] = "fn",
+
+    [SYM_INT] = "int",
+    [SYM_STR] = "str",
+
+    [SYM_DEL] = "del",
+    [SYM_INCLUDE] = "include",
+};
+
+struct InternTable {
+    // symbols, indexed by their id
+    Symbol *symbols;
+    uint32_t symbol_count;
+    uint32_t symbol_buffer_size;
+
+    // open addressing hash table of symbol ids. SYM_NONE marks an empty slot.
+    SymbolId *slots;
+    uint32_t slot_count;
+
+    // names in the global table are copied into chunks, so they outlive the source buffers.
+    // Private tables point into the buffer being lexed.
+    bool copy_names;
+    char *name_chunk;
+    size_t name_chunk_left;
+};
+
+static InternTable global_table = { .copy_names = true };
+
+static uint32_t HashName(const char *str, int length)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    int i;
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static const char *CopyName(InternTable *table, const char *str, int length)
+{
+    if (!table->copy_names) {
+        return str;
+    }
+
+    if (table->name_chunk_left < (size_t)length + 1) {
+        size_t chunk_size = NAME_CHUNK_SIZE;
+        if (chunk_size < (size_t)length + 1) {
+            chunk_size = length + 1;
+        }
+        table->name_chunk = malloc(chunk_size);
+        table->name_chunk_left = chunk_size;
+    }
+
+    char *name = table->name_chunk;
+    memcpy(name, str, length);
+    name[length] = 0;
+
+    table->name_chunk += length + 1;
+    table->name_chunk_left -= length + 1;
+    return name;
+}
+
+static void InsertSlot(InternTable *table, SymbolId symbol)
+{
+    const uint32_t mask = table->slot_count - 1;
+
+    uint32_t slot = table->symbols[symbol].hash & mask;
+    while (table->slots[slot] != SYM_NONE) {
+        slot = (slot + 1) & mask;
+    }
+    table->slots[slot] = symbol;
+}
+
+static void GrowSlots(InternTable *table)
+{
+    free(table->slots);
+
+    table->slot_count = table->slot_count ? table->slot_count * 2 : SYMBOL_BUFFER_START * 2;
+    table->slots = calloc(table->slot_count, sizeof(SymbolId));
+
+    SymbolId i;
+    for (i = 1; i < table->symbol_count; i++) {
+        InsertSlot(table, i);
+    }
+}
+
+static SymbolId AddSymbol(InternTable *table, const char *str, int length, uint32_t hash)
+{
+    if (table->symbol_count + 1 > table->symbol_buffer_size) {
+        table->symbol_buffer_size = table->symbol_buffer_size ? table->symbol_buffer_size * 2 : SYMBOL_BUFFER_START;
+        table->symbols = realloc(table->symbols, sizeof(Symbol) * table->symbol_buffer_size);
+    }
+
+    SymbolId symbol = table->symbol_count++;
+    table->symbols[symbol].name = CopyName(table, str, length);
+    table->symbols[symbol].length = length;
+    table->symbols[symbol].hash = hash;
+
+    // keep the table at most half full
+    if (table->symbol_count * 2 > table->slot_count) {
+        GrowSlots(table);
+    }
+    else if (symbol != SYM_NONE) {
+        InsertSlot(table, symbol);
+    }
+    return symbol;
+}
+
+static SymbolId TableIntern(InternTable *table, const char *str, int length)
+{
+    const uint32_t hash = HashName(str, length);
+    const uint32_t mask = table->slot_count - 1;
+    uint32_t slot = hash & mask;
+
+    SymbolId symbol;
+    while ((symbol = table->slots[slot]) != SYM_NONE) {
+        const Symbol *sym = &table->symbols[symbol];
+        if (sym->hash == hash && sym->length == (uint32_t)length && !memcmp(sym->name, str, length)) {
+            return symbol;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    return AddSymbol(table, str, length, hash);
+}
+
+static void AddPredefined(InternTable *table)
+{
+    int i;
+    for (i = 0; i < SYM_PREDEFINED_COUNT; i++) {
+        const char *name = predefined_names[i];
+        AddSymbol(table, name, strlen(name), HashName(name, strlen(name)));
+    }
+}
+
+static void InternInit(void)
+{
+    AddPredefined(&global_table);
+}
+
+SymbolId InternString(const char *str, int length)
+{
+    if (global_table.symbols == NULL) {
+        InternInit();
+    }
+    return TableIntern(&global_table, str, length);
+}
+
+const char *SymbolName(SymbolId symbol, int *length)
+{
+    if (global_table.symbols == NULL) {
+        InternInit();
+    }
+    if (length != NULL) {
+        *length = global_table.symbols[symbol].length;
+    }
+    return global_table.symbols[symbol].name;
+}
+
+InternTable *InternTableCreate(void)
+{
+    InternTable *table = calloc(1, sizeof(InternTable));
+
+    // reserve id 0 so that SYM_NONE means the same thing in every table
+    AddSymbol(table, "", 0, 0);
+    return table;
+}
+
+InternTable *InternTableCreatePredefined(void)
+{
+    InternTable *table = calloc(1, sizeof(InternTable));
+    AddPredefined(table);
+    return table;
+}
+
+SymbolId InternTableAdd(InternTable *table, const char *str, int length)
+{
+    return TableIntern(table, str, length);
+}
+
+uint32_t InternTableCount(const InternTable *table)
+{
+    return table->symbol_count;
+}
+
+const char *InternTableName(const InternTable *table, SymbolId symbol, int *length)
+{
+    *length = table->symbols[symbol].length;
+    return table->symbols[symbol].name;
+}
+
+void InternTableDestroy(InternTable *table)
+{
+    if (table == NULL) {
+        return;
+    }
+    free(table->symbols);
+    free(table->slots);
+    free(table);
+}
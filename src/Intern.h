@@ -0,0 +1,62 @@
+#ifndef CML_INTERN_H
+#define CML_INTERN_H
+
+#include <stdint.h>
+
+// Global string table. Every identifier is interned while lexing, so names can be compared
+// by their 32-bit symbol id instead of by their text.
+
+typedef uint32_t SymbolId;
+
+// names that the lexer, parser and compiler look for, interned up front in this order
+typedef enum {
+    SYM_NONE,
+
+    SYM_IF,
+    SYM_RETURN,
+    SYM_FOR,
+    SYM_WHILE,
+    SYM_STRUCT,
+    SYM_FN,
+
+    SYM_INT,
+    SYM_STR,
+
+    SYM_DEL,
+    SYM_INCLUDE,
+
+    SYM_PREDEFINED_COUNT,
+} PredefinedSymbol;
+
+/**
+    Get the symbol id for a name, adding it to the table if it has not been seen before.
+*/
+SymbolId InternString(const char *str, int length);
+
+/**
+    Get the text of an interned symbol. The returned string is NUL terminated and stays valid
+    for the rest of the program.
+*/
+const char *SymbolName(SymbolId symbol, int *length);
+
+// A private table of names, for interning on threads other than the main one. Ids are local to
+// the table and start at 1, names point into the interned text instead of being copied.
+typedef struct InternTable InternTable;
+
+InternTable *InternTableCreate(void);
+
+/**
+    Create a private table that starts out with the predefined names under their global ids, so
+    only the ids from SYM_PREDEFINED_COUNT on are local to it.
+*/
+InternTable *InternTableCreatePredefined(void);
+SymbolId InternTableAdd(InternTable *table, const char *str, int length);
+
+/**
+    Get the amount of ids used by the table, including SYM_NONE.
+*/
+uint32_t InternTableCount(const InternTable *table);
+const char *InternTableName(const InternTable *table, SymbolId symbol, int *length);
+void InternTableDestroy(InternTable *table);
+
+#endif
@@ -0,0 +1,190 @@
+#include "Ir.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+const char *RegNames[] = {
+    "SP", "LR", "FP",
+    "X0", "X1", "X2", "X3", "X4", "X5", "X6",
+    "X7", "X8", "X9", "X10", "X11", "X12", "X13", "X14",
+    "X15", "X16", "X17", "X18", "X19", "X20", "X21", "X22",
+    "X23", "X24", "X25", "X26", "X27", "X28",
+    "W0", "W1", "W2", "W3", "W4", "W5", "W6",
+    "W7", "W8", "W9", "W10", "W11", "W12", "W13", "W14",
+    "W15", "W16", "W17", "W18", "W19", "W20", "W21", "W22",
+    "W23", "W24", "W25", "W26", "W27", "W28"
+};
+
+// indexed by IrOpcode
+static const char *opcode_names[IR_OPCODE_COUNT] = {
+    [IR_LABEL] = "",
+    [IR_MOV] = "mov",
+    [IR_ADD] = "add",
+    [IR_SUB] = "sub",
+    [IR_MUL] = "mul",
+    [IR_SDIV] = "sdiv",
+    [IR_NEG] = "neg",
+    [IR_LSL] = "lsl",
+    [IR_LSR] = "lsr",
+    [IR_ASR] = "asr",
+    [IR_LDR] = "ldr",
+    [IR_STR] = "str",
+    [IR_LDP] = "ldp",
+    [IR_STP] = "stp",
+    [IR_ADRP] = "adrp",
+    [IR_BL] = "bl",
+    [IR_RET] = "ret",
+    [IR_IMM] = "",
+};
+
+const char *RegS(RegN reg_n)
+{
+    return RegNames[reg_n];
+}
+
+int RegSize(RegN reg)
+{
+    return (reg >= CR_W0) ? 4 : 8;
+}
+
+RegN RegSized(RegN reg, int size)
+{
+    if (reg >= CR_W0 && size == 8) {
+        return reg - CR_W0 + CR_X0;
+    }
+    if (reg >= CR_X0 && reg < CR_W0 && size == 4) {
+        return reg - CR_X0 + CR_W0;
+    }
+    return reg;
+}
+
+void IrInit(IrCode *code)
+{
+    code->insts = NULL;
+    code->inst_amt = 0;
+    code->inst_buffer_size = 0;
+    code->vreg_amt = 0;
+}
+
+void IrDestroy(IrCode *code)
+{
+    free(code->insts);
+    IrInit(code);
+}
+
+IrInst *IrAppend(IrCode *code, IrOpcode opcode, int depth)
+{
+    if (code->inst_amt >= code->inst_buffer_size) {
+        code->inst_buffer_size = code->inst_buffer_size ? code->inst_buffer_size * 2 : 256;
+        code->insts = realloc(code->insts, sizeof(IrInst) * code->inst_buffer_size);
+    }
+
+    IrInst *inst = &code->insts[code->inst_amt++];
+    inst->opcode = opcode;
+    inst->operand_amt = 0;
+    inst->depth = depth;
+
+    return inst;
+}
+
+void IrAddOperand(IrInst *inst, IrOperand operand)
+{
+    inst->operands[inst->operand_amt++] = operand;
+}
+
+IrVReg IrNewVReg(IrCode *code)
+{
+    return ++code->vreg_amt;
+}
+
+static IrOperand IrOperandOf(IrOperandKind kind)
+{
+    IrOperand operand;
+    memset(&operand, 0, sizeof(IrOperand));
+    operand.kind = kind;
+    return operand;
+}
+
+IrOperand IrOpReg(RegN reg)
+{
+    IrOperand operand = IrOperandOf(IO_REG);
+    operand.reg = reg;
+    return operand;
+}
+
+IrOperand IrOpVReg(IrVReg vreg, int size)
+{
+    IrOperand operand = IrOperandOf(IO_VREG);
+    operand.vreg = vreg;
+    operand.size = size;
+    return operand;
+}
+
+IrOperand IrOpImm(long long value)
+{
+    IrOperand operand = IrOperandOf(IO_IMM);
+    operand.value = value;
+    return operand;
+}
+
+IrOperand IrOpMem(IrOperand base, long long offset, IrAddressing addressing)
+{
+    IrOperand operand = IrOperandOf(IO_MEM);
+    operand.reg = base.reg;
+    operand.vreg = base.vreg;
+    operand.value = offset;
+    operand.addressing = addressing;
+    return operand;
+}
+
+IrOperand IrOpSymbol(IrSymbol symbol)
+{
+    IrOperand operand = IrOperandOf(IO_SYMBOL);
+    operand.symbol = symbol;
+    return operand;
+}
+
+int IrOpSize(IrOperand reg)
+{
+    if (reg.kind == IO_VREG) {
+        return reg.size;
+    }
+    return RegSize(reg.reg);
+}
+
+IrOperand IrOpSized(IrOperand reg, int size)
+{
+    if (reg.kind == IO_VREG) {
+        reg.size = size;
+    }
+    else {
+        reg.reg = RegSized(reg.reg, size);
+    }
+    return reg;
+}
+
+bool IrWritesFirst(IrOpcode opcode)
+{
+    switch (opcode) {
+        case IR_MOV:
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_SDIV:
+        case IR_NEG:
+        case IR_LSL:
+        case IR_LSR:
+        case IR_ASR:
+        case IR_LDR:
+        case IR_ADRP:
+            return true;
+        default:
+            break;
+    }
+    return false;
+}
+
+const char *IrOpcodeName(IrOpcode opcode)
+{
+    return opcode_names[opcode];
+}
@@ -0,0 +1,257 @@
+#ifndef CML_IR_H
+#define CML_IR_H
+
+#include "Parser.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Linear IR of the target instructions. Code generation appends the instructions of the whole
+// program to one list as it walks the AST, in the order they are output. Passes can then rework
+// the list before it is printed as assembly.
+
+typedef enum {
+    CR_SP,
+    CR_LR,
+    CR_FP,
+
+    CR_X0,
+    CR_X1,
+    CR_X2,
+    CR_X3,
+    CR_X4,
+    CR_X5,
+    CR_X6,
+    CR_X7,
+    CR_X8,
+    CR_X9,
+    CR_X10,
+    CR_X11,
+    CR_X12,
+    CR_X13,
+    CR_X14,
+    CR_X15,
+    CR_X16,
+    CR_X17,
+    CR_X18,
+    CR_X19,
+    CR_X20,
+    CR_X21,
+    CR_X22,
+    CR_X23,
+    CR_X24,
+    CR_X25,
+    CR_X26,
+    CR_X27,
+    CR_X28,
+
+    // lower 32 bits of X0-X28, for values of 4 bytes
+    CR_W0,
+    CR_W1,
+    CR_W2,
+    CR_W3,
+    CR_W4,
+    CR_W5,
+    CR_W6,
+    CR_W7,
+    CR_W8,
+    CR_W9,
+    CR_W10,
+    CR_W11,
+    CR_W12,
+    CR_W13,
+    CR_W14,
+    CR_W15,
+    CR_W16,
+    CR_W17,
+    CR_W18,
+    CR_W19,
+    CR_W20,
+    CR_W21,
+    CR_W22,
+    CR_W23,
+    CR_W24,
+    CR_W25,
+    CR_W26,
+    CR_W27,
+    CR_W28,
+} RegN;
+
+const char *RegS(RegN reg_n);
+
+/**
+    Get the size in bytes of the values a register holds.
+*/
+int RegSize(RegN reg);
+
+/**
+    Get the register with the same number as `reg` that holds values of `size` bytes.
+*/
+RegN RegSized(RegN reg, int size);
+
+typedef enum {
+    // the label of a function, its operand is the function symbol
+    IR_LABEL,
+
+    IR_MOV,
+    IR_ADD,
+    IR_SUB,
+    IR_MUL,
+    IR_SDIV,
+    IR_NEG,
+    IR_LSL,
+    IR_LSR,
+    IR_ASR,
+    IR_LDR,
+    IR_STR,
+    IR_LDP,
+    IR_STP,
+    IR_ADRP,
+    IR_BL,
+    IR_RET,
+
+    // a lone immediate, output for literals that are used as statements
+    IR_IMM,
+
+    IR_OPCODE_COUNT,
+} IrOpcode;
+
+typedef enum {
+    IO_NONE,
+    IO_REG,
+    IO_VREG,
+    IO_IMM,
+    IO_MEM,
+    IO_SYMBOL,
+} IrOperandKind;
+
+// How the address of an IO_MEM operand is formed from its base register
+typedef enum {
+    // [base, #offset]
+    IA_OFFSET,
+    // [base, offset]!, the base is moved by the offset before the access
+    IA_PRE_INDEX,
+    // [base], offset, the base is moved by the offset after the access
+    IA_POST_INDEX,
+    // [base, symbol@PAGEOFF]
+    IA_PAGEOFF,
+} IrAddressing;
+
+typedef enum {
+    // a function, by its name and the name of the function it is declared in
+    IS_FUNC,
+    // a string in the string pool, by its id
+    IS_STRING,
+    // a global variable, by its VarId
+    IS_GLOBAL,
+} IrSymbolKind;
+
+// Which part of the address of a symbol is used
+typedef enum {
+    IRL_NONE,
+    IRL_PAGE,
+    IRL_PAGEOFF,
+} IrRelocation;
+
+typedef struct {
+    uint8_t kind;
+    uint8_t relocation;
+
+    // SymbolId of IS_STRING, VarId of IS_GLOBAL
+    uint32_t id;
+
+    // IS_FUNC only, `parent` is NULL for functions at the top level
+    Token *name;
+    Token *parent;
+} IrSymbol;
+
+// A virtual register, to be assigned a real one before printing. 0 is not a register.
+typedef uint32_t IrVReg;
+
+#define VREG_NONE 0
+
+typedef struct {
+    // an IrOperandKind
+    uint8_t kind;
+    // an IrAddressing, for IO_MEM
+    uint8_t addressing;
+    // size of the value in an IO_VREG
+    uint8_t size;
+
+    // IO_REG, or the base register of IO_MEM
+    RegN reg;
+    // IO_VREG, or the base register of IO_MEM when it is virtual
+    IrVReg vreg;
+
+    // IO_IMM, or the offset of IO_MEM
+    long long value;
+
+    // IO_SYMBOL, or the symbol of IO_MEM with IA_PAGEOFF
+    IrSymbol symbol;
+} IrOperand;
+
+#define IR_MAX_OPERANDS 3
+
+typedef struct {
+    // an IrOpcode
+    uint8_t opcode;
+    uint8_t operand_amt;
+
+    // how many functions deep the instruction is, which it is indented by
+    uint16_t depth;
+
+    IrOperand operands[IR_MAX_OPERANDS];
+} IrInst;
+
+typedef struct {
+    IrInst *insts;
+    uint32_t inst_amt;
+    uint32_t inst_buffer_size;
+
+    // virtual registers handed out so far
+    IrVReg vreg_amt;
+} IrCode;
+
+void IrInit(IrCode *code);
+void IrDestroy(IrCode *code);
+
+/**
+    Append an instruction without operands to the end of the code.
+    @return the instruction, valid until the next instruction is appended.
+*/
+IrInst *IrAppend(IrCode *code, IrOpcode opcode, int depth);
+
+/**
+    Add an operand to the end of the operands of an instruction.
+*/
+void IrAddOperand(IrInst *inst, IrOperand operand);
+
+IrVReg IrNewVReg(IrCode *code);
+
+IrOperand IrOpReg(RegN reg);
+IrOperand IrOpVReg(IrVReg vreg, int size);
+IrOperand IrOpImm(long long value);
+IrOperand IrOpMem(IrOperand base, long long offset, IrAddressing addressing);
+IrOperand IrOpSymbol(IrSymbol symbol);
+
+/**
+    Get the size in bytes of the value in a register operand, real or virtual.
+*/
+int IrOpSize(IrOperand reg);
+
+/**
+    Get the same register as `reg`, holding a value of `size` bytes.
+*/
+IrOperand IrOpSized(IrOperand reg, int size);
+
+/**
+    Whether an instruction writes its first operand. The other register operands are read.
+*/
+bool IrWritesFirst(IrOpcode opcode);
+
+/**
+    Get the assembly mnemonic of an opcode.
+*/
+const char *IrOpcodeName(IrOpcode opcode);
+
+#endif
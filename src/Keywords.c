@@ -0,0 +1,73 @@
+#include "Keywords.h"
+
+#include <string.h>
+
+// Perfect hash over the first and last character of every reserved word. The multiplier was
+// picked so that no two words share a slot; the assert below the tables fails when a new word
+// takes a slot that is already used, then pick a new multiplier.
+#define KEYWORD_TABLE_SIZE 16
+#define KW_HASH(first_, last_) ((((unsigned char)(first_)) + ((unsigned char)(last_)) * 6) & (KEYWORD_TABLE_SIZE - 1))
+
+// Every reserved word with its first and last characters, which are passed separately as C does
+// not allow indexing a string literal in a constant expression.
+#define KEYWORD_LIST(X) \
+    X("if", 'i', 'f', TT_KEYWORD, IF_NONE, SYM_IF) \
+    X("return", 'r', 'n', TT_KEYWORD, IF_NONE, SYM_RETURN) \
+    X("for", 'f', 'r', TT_KEYWORD, IF_NONE, SYM_FOR) \
+    X("while", 'w', 'e', TT_KEYWORD, IF_NONE, SYM_WHILE) \
+    X("struct", 's', 't', TT_KEYWORD, IF_NONE, SYM_STRUCT) \
+    X("fn", 'f', 'n', TT_KEYWORD, IF_NONE, SYM_FN) \
+    \
+    X("int", 'i', 't', TT_TYPE, IF_NONE, SYM_INT) \
+    X("str", 's', 'r', TT_TYPE, IF_NONE, SYM_STR) \
+    \
+    X("del", 'd', 'l', TT_IDENTIFIER, IF_DEL, SYM_DEL)
+
+#define KW_ENTRY(name_, first_, last_, type_, internal_, symbol_) \
+    [KW_HASH(first_, last_)] = { name_, sizeof(name_) - 1, type_, internal_, symbol_ },
+
+#define KW_SYMBOL_ENTRY(name_, first_, last_, type_, internal_, symbol_) \
+    [symbol_] = &keyword_table[KW_HASH(first_, last_)],
+
+// the slot of a word as a bit. The slots are all different exactly when adding up the bits
+// gives the same as or-ing them, as any shared bit would carry.
+#define KW_SLOT_ADD(name_, first_, last_, type_, internal_, symbol_) + (1u << KW_HASH(first_, last_))
+#define KW_SLOT_OR(name_, first_, last_, type_, internal_, symbol_) | (1u << KW_HASH(first_, last_))
+
+static const Keyword keyword_table[KEYWORD_TABLE_SIZE] = {
+    KEYWORD_LIST(KW_ENTRY)
+};
+
+// reserved words indexed by their predefined symbol id
+static const Keyword *keyword_symbols[SYM_PREDEFINED_COUNT] = {
+    KEYWORD_LIST(KW_SYMBOL_ENTRY)
+};
+
+_Static_assert((0u KEYWORD_LIST(KW_SLOT_ADD)) == (0u KEYWORD_LIST(KW_SLOT_OR)),
+    "two reserved words hash to the same slot of keyword_table, change the multiplier of KW_HASH");
+
+/**
+    Find a reserved word with one hash and one compare.
+    @return the keyword entry, or NULL if the string is not reserved.
+*/
+const Keyword *KeywordLookup(const char *str, int length)
+{
+    if (length <= 0) {
+        return NULL;
+    }
+
+    const Keyword *kw = &keyword_table[KW_HASH(str[0], str[length - 1])];
+
+    if (kw->length != length || memcmp(kw->name, str, length)) {
+        return NULL;
+    }
+    return kw;
+}
+
+const Keyword *KeywordFromSymbol(SymbolId symbol)
+{
+    if (symbol >= SYM_PREDEFINED_COUNT) {
+        return NULL;
+    }
+    return keyword_symbols[symbol];
+}
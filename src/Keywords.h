@@ -0,0 +1,35 @@
+#ifndef CML_KEYWORDS_H
+#define CML_KEYWORDS_H
+
+#include "Lexer.h"
+#include "Intern.h"
+
+// ids for the compiler's internal functions, used to index its handler table.
+typedef enum {
+    IF_NONE = -1,
+
+    IF_DEL,
+
+    IF_COUNT,
+} InternalFuncId;
+
+typedef struct {
+    const char *name;
+    int length;
+
+    // token type given to the identifier by the lexer
+    TokenType type;
+    InternalFuncId internal_func;
+
+    SymbolId symbol;
+} Keyword;
+
+const Keyword *KeywordLookup(const char *str, int length);
+
+/**
+    Find the reserved word for an interned name.
+    @return the keyword entry, or NULL if the symbol is not reserved.
+*/
+const Keyword *KeywordFromSymbol(SymbolId symbol);
+
+#endif
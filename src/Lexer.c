@@ -1,35 +1,174 @@
 #include "Lexer.h"
+#include "Keywords.h"
+#include "LexerScan.h"
+#include "ThreadPool.h"
 
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
 
-#include <ctype.h>
-
 #define TOKEN_BUFFER_START 256
+#define LEX_SHORT_SPACE_RUN 8
+
+#define LEX_LITERAL_BLOCK_SHIFT 8
+#define LEX_LITERAL_BLOCK_SIZE (1 << LEX_LITERAL_BLOCK_SHIFT)
+#define LEX_STRING_BLOCK_SIZE (16 * 1024)
+
+// inputs are not split into chunks smaller than this, as each chunk has a fixed setup cost
+#define LEX_PARALLEL_MIN_CHUNK (64 * 1024)
+// chunks per thread, so that threads that finish early can pick up more work
+#define LEX_PARALLEL_CHUNKS_PER_THREAD 4
+
+// Character classes for the lexer's state machine. Every input byte is mapped to one of these
+// through Lexer.char_class, so the main loop never has to search the specials string.
+typedef enum {
+    LC_END,
+    LC_SPACE,
+    LC_NEWLINE,
+    LC_SPECIAL,
+    LC_QUOTE,
+    LC_DIGIT,
+    // only used when '.' is not in the specials string
+    LC_PERIOD,
+    LC_WORD,
+
+    LC_COUNT,
+} LexClass;
+
+// states while scanning a word (number or identifier)
+typedef enum {
+    LS_NUMBER,
+    LS_DECIMAL,
+    LS_IDENT,
+
+    LS_ACCEPT,
+    LS_ERROR,
+} LexState;
+
+static const unsigned char word_transitions[LS_ACCEPT][LC_COUNT] = {
+    //                END        SPACE      NEWLINE    SPECIAL    QUOTE      DIGIT       PERIOD      WORD
+    [LS_NUMBER]  = { LS_ACCEPT, LS_ACCEPT, LS_ACCEPT, LS_ACCEPT, LS_ACCEPT, LS_NUMBER,  LS_DECIMAL, LS_IDENT },
+    [LS_DECIMAL] = { LS_ACCEPT, LS_ACCEPT, LS_ACCEPT, LS_ACCEPT, LS_ACCEPT, LS_DECIMAL, LS_ERROR,   LS_IDENT },
+    [LS_IDENT]   = { LS_ACCEPT, LS_ACCEPT, LS_ACCEPT, LS_ACCEPT, LS_ACCEPT, LS_IDENT,   LS_IDENT,   LS_IDENT },
+};
+
+// token types for single character specials. Unknown specials are lexed as identifiers.
+static const TokenType special_types[256] = {
+    [';'] = TT_SEMICOLON,
+    [':'] = TT_COLON,
+    [','] = TT_COMMA,
+    ['.'] = TT_PERIOD,
+    ['{'] = TT_LBRACE,
+    ['}'] = TT_RBRACE,
+    ['('] = TT_LPAREN,
+    [')'] = TT_RPAREN,
+    ['='] = TT_EQUALS,
+    ['+'] = TT_PLUS,
+    ['-'] = TT_MINUS,
+    ['*'] = TT_STAR,
+    ['/'] = TT_SLASH,
+};
+
+#define LINE_BUFFER_START 256
 
-// #define SFLEX_IS_WHITESPACE(ch) (ch == ' ' || ch == '\t' || ch == '\n')
-#define SFLEX_IS_WHITESPACE(inst, ch) LexerIsWhitespace(inst, (ch))
-#define SFLEX_IS_STRING(ch, flags) ((flags & SFLEX_USE_STRINGS) && (ch == '"' || ch == '\''))
-#define SFLEX_IS_SPECIAL(buf, ch) (strchr(buf, ch) != NULL)
+struct LexStringBlock {
+    struct LexStringBlock *next;
+    char bytes[];
+};
 
-static int LexGetFileColumn(Lexer *inst)
+// every line table that belongs to a live lexer, used to find the position of any token
+static LexerLineTable *line_tables = NULL;
+// positions of tokens that were not lexed, see LexerAddPositions
+static LexerPositionTable *position_tables = NULL;
+
+static void LexStoreToken(Lexer *inst, LexerToken *token)
 {
-    return (int)(inst->newb - inst->_line_start_ptr);
+    if (inst->token_amt + 1 > inst->token_buffer_size) {
+        inst->token_buffer_size *= 2;
+        inst->token_offsets = (uint32_t *)realloc(inst->token_offsets, sizeof(uint32_t) * inst->token_buffer_size);
+        inst->token_lengths = (uint32_t *)realloc(inst->token_lengths, sizeof(uint32_t) * inst->token_buffer_size);
+        inst->token_types = (unsigned char *)realloc(inst->token_types, inst->token_buffer_size);
+        inst->token_values = (uint32_t *)realloc(inst->token_values, sizeof(uint32_t) * inst->token_buffer_size);
+    }
+
+    const int index = inst->token_amt++;
+    inst->token_offsets[index] = (uint32_t)(token->start - inst->data);
+    inst->token_lengths[index] = (uint32_t)(token->end - token->start);
+    inst->token_types[index] = (unsigned char)token->type;
+
+    // tokens are stored right after they are lexed, so a token's literal is the last one decoded
+    inst->token_values[index] = (token->literal != NULL) ? (uint32_t)(inst->literal_amt - 1) : token->symbol;
 }
 
-static LexerToken *LexTokenGetNext(Lexer *inst) {
-    if (inst->token_amt+1 > inst->token_buffer_size) {
-        inst->token_buffer_size *= 2;
-        inst->tokens = (LexerToken *)realloc(inst->tokens, inst->token_buffer_size);
+static LexerLiteral *LexLiteralAt(const Lexer *inst, uint32_t index)
+{
+    return &inst->literal_blocks[index >> LEX_LITERAL_BLOCK_SHIFT][index & (LEX_LITERAL_BLOCK_SIZE - 1)];
+}
+
+static void LexReserveLiterals(Lexer *inst, int amt)
+{
+    const int blocks_needed = (amt + LEX_LITERAL_BLOCK_SIZE - 1) >> LEX_LITERAL_BLOCK_SHIFT;
+    if (blocks_needed <= inst->literal_block_amt) {
+        return;
     }
 
-    LexerToken *token = &inst->tokens[inst->token_amt++];
-    token->file_line = inst->current_line + 1;
-    token->file_col = LexGetFileColumn(inst);
+    inst->literal_blocks = (LexerLiteral **)realloc(inst->literal_blocks, sizeof(LexerLiteral *) * blocks_needed);
+    while (inst->literal_block_amt < blocks_needed) {
+        inst->literal_blocks[inst->literal_block_amt++] = (LexerLiteral *)malloc(sizeof(LexerLiteral) * LEX_LITERAL_BLOCK_SIZE);
+    }
+}
 
-    return token;
+static LexerLiteral *LexNewLiteral(Lexer *inst)
+{
+    if (inst->literal_window != 0 && inst->literal_amt == inst->literal_window) {
+        inst->literal_amt = 0;
+    }
+    LexReserveLiterals(inst, inst->literal_amt + 1);
+
+    LexerLiteral *literal = LexLiteralAt(inst, inst->literal_amt++);
+    literal->int_value = 0;
+    literal->decimal_value = 0;
+    literal->is_decimal = false;
+    literal->string = NULL;
+    literal->string_length = 0;
+    return literal;
+}
+
+static char *LexAllocString(Lexer *inst, size_t size)
+{
+    if (inst->string_bytes_left < size) {
+        size_t block_size = LEX_STRING_BLOCK_SIZE;
+        if (block_size < size) {
+            block_size = size;
+        }
+
+        LexStringBlock *block = (LexStringBlock *)malloc(sizeof(LexStringBlock) + block_size);
+        block->next = inst->string_blocks;
+        inst->string_blocks = block;
+
+        inst->string_bytes = block->bytes;
+        inst->string_bytes_left = block_size;
+    }
+
+    char *bytes = inst->string_bytes;
+    inst->string_bytes += size;
+    inst->string_bytes_left -= size;
+    return bytes;
+}
+
+static void LexAddLine(Lexer *inst, char *line_start)
+{
+    LexerLineTable *lines = inst->lines;
+
+    if (lines->line_count + 1 > lines->line_buffer_size) {
+        lines->line_buffer_size *= 2;
+        lines->line_starts = (size_t *)realloc(lines->line_starts, sizeof(size_t) * lines->line_buffer_size);
+    }
+    lines->line_starts[lines->line_count++] = line_start - inst->data;
+
+    inst->current_line++;
+    inst->_line_start_ptr = line_start;
 }
 
 const char *LexerTokenTypeStr(TokenType type) {
@@ -80,259 +219,837 @@ const char *LexerTokenTypeStr(TokenType type) {
     return "Unknown";
 }
 
-bool LexerApplySingleCharType(LexerToken *token)
+static void ThrowError(Lexer *inst, const char *msg)
 {
-    char ch = token->start[0];
-    switch (ch) {
-    case ';':
-        token->type = TT_SEMICOLON;
-        break;
-    case ':':
-        token->type = TT_COLON;
-        break;
-    case ',':
-        token->type = TT_COMMA;
-        break;
-    case '.':
-        token->type = TT_PERIOD;
-        break;
-    case '{':
-        token->type = TT_LBRACE;
-        break;
-    case '}':
-        token->type = TT_RBRACE;
-        break;
-    case '(':
-        token->type = TT_LPAREN;
-        break;
-    case ')':
-        token->type = TT_RPAREN;
-        break;
-    case '=':
-        token->type = TT_EQUALS;
-        break;
-    case '+':
-        token->type = TT_PLUS;
-        break;
-    case '-':
-        token->type = TT_MINUS;
-        break;
-    case '*':
-        token->type = TT_STAR;
-        break;
-    case '/':
-        token->type = TT_SLASH;
-        break;
-    default:
+    if (inst->error_jump != NULL) {
+        longjmp(*inst->error_jump, 1);
+    }
+
+    printf("[ERROR] [line %d]: ", inst->current_line + 1);
+    printf("%s", msg);
+    exit(1);
+}
+
+long LexerTokenLength(LexerToken *token)
+{
+    return token->end - token->start;
+}
+
+LexerToken LexerGetToken(Lexer *inst, int index)
+{
+    LexerToken token;
+
+    if (index >= inst->token_amt) {
+        token.start = inst->newb;
+        token.end = inst->newb;
+        token.type = TT_NONE;
+        token.symbol = SYM_NONE;
+        token.literal = NULL;
+        return token;
+    }
+
+    token.start = inst->data + inst->token_offsets[index];
+    token.end = token.start + inst->token_lengths[index];
+    token.type = (TokenType)inst->token_types[index];
+
+    if (token.type == TT_NUMBER || token.type == TT_STRING) {
+        token.symbol = SYM_NONE;
+        token.literal = LexLiteralAt(inst, inst->token_values[index]);
+    }
+    else {
+        token.symbol = inst->token_values[index];
+        token.literal = NULL;
+    }
+    return token;
+}
+
+bool LexerTokenPosition(const LexerToken *token, int *line, int *col)
+{
+    // tokens of modules were never lexed and have no buffer, their positions are stored
+    const LexerPositionTable *positions;
+    for (positions = position_tables; positions != NULL; positions = positions->next) {
+        if (token >= positions->tokens && token < positions->tokens + positions->token_count) {
+            const LexerPosition *position = &positions->positions[token - positions->tokens];
+            *line = (int)position->line;
+            *col = (int)position->col;
+            return position->line != 0;
+        }
+    }
+
+    // the token belongs to the buffer whose lexed text contains it
+    LexerLineTable *lines = NULL;
+    LexerLineTable *table;
+    for (table = line_tables; table != NULL; table = table->next) {
+        if (table->data <= token->start && token->start <= table->end) {
+            lines = table;
+            break;
+        }
+    }
+    if (lines == NULL) {
         return false;
     }
+
+    const size_t offset = token->start - lines->data;
+
+    // find the last line that starts at or before the token
+    int low = 0;
+    int high = lines->line_count - 1;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (lines->line_starts[mid] <= offset) {
+            low = mid;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+
+    *line = low + 1;
+    *col = (int)(offset - lines->line_starts[low]) + 1;
     return true;
 }
 
+void LexerAddPositions(LexerPositionTable *table)
+{
+    table->next = position_tables;
+    position_tables = table;
+}
 
-static void ThrowError(Lexer *inst, const char *msg)
+void LexerRemovePositions(LexerPositionTable *table)
 {
-    printf("[ERROR] [line %d]: ", inst->current_line);
-    printf("%s", msg);
-    exit(1);
+    LexerPositionTable **link;
+    for (link = &position_tables; *link != NULL; link = &(*link)->next) {
+        if (*link == table) {
+            *link = table->next;
+            break;
+        }
+    }
 }
 
-bool IfIsKeyword(LexerToken *token, const char *keywords[], int keyword_count)
+void LexerDestroy(Lexer *inst) {
+    if (inst == NULL)
+        return;
+
+    free(inst->token_offsets);
+    free(inst->token_lengths);
+    free(inst->token_types);
+    free(inst->token_values);
+    inst->token_offsets = NULL;
+    inst->token_lengths = NULL;
+    inst->token_types = NULL;
+    inst->token_values = NULL;
+
+    inst->token_amt = 0;
+    inst->token_buffer_size = 0;
+
+    int i;
+    for (i = 0; i < inst->literal_block_amt; i++) {
+        free(inst->literal_blocks[i]);
+    }
+    free(inst->literal_blocks);
+    inst->literal_blocks = NULL;
+    inst->literal_block_amt = 0;
+    inst->literal_amt = 0;
+
+    while (inst->string_blocks != NULL) {
+        LexStringBlock *next = inst->string_blocks->next;
+        free(inst->string_blocks);
+        inst->string_blocks = next;
+    }
+    inst->string_bytes = NULL;
+    inst->string_bytes_left = 0;
+
+    // a detached lexer that was never attached
+    InternTableDestroy(inst->local_symbols);
+    inst->local_symbols = NULL;
+
+    if (inst->lines != NULL) {
+        LexerLineTable **link;
+        for (link = &line_tables; *link != NULL; link = &(*link)->next) {
+            if (*link == inst->lines) {
+                *link = inst->lines->next;
+                break;
+            }
+        }
+        free(inst->lines->line_starts);
+        free(inst->lines);
+        inst->lines = NULL;
+    }
+}
+
+static void LexBuildClassTable(Lexer *inst, const char *specials, int flags)
 {
     int i;
-    for (i = 0; i < keyword_count; i++) {
-        if (LexerTokenLength(token) == strlen(keywords[i]) && !strncmp(token->start, keywords[i], LexerTokenLength(token))) {
-            return true;
+    for (i = 0; i < 256; i++) {
+        inst->char_class[i] = LC_WORD;
+    }
+    for (i = '0'; i <= '9'; i++) {
+        inst->char_class[i] = LC_DIGIT;
+    }
+    inst->char_class['.'] = LC_PERIOD;
+
+    if (specials != NULL) {
+        for (; *specials; specials++) {
+            inst->char_class[(unsigned char)*specials] = LC_SPECIAL;
         }
     }
-    return false;
+    if (flags & SFLEX_USE_STRINGS) {
+        inst->char_class['"'] = LC_QUOTE;
+        inst->char_class['\''] = LC_QUOTE;
+    }
+
+    inst->char_class[' '] = LC_SPACE;
+    inst->char_class['\t'] = LC_SPACE;
+    inst->char_class['\r'] = LC_SPACE;
+    inst->char_class['\n'] = LC_NEWLINE;
+    inst->char_class[0] = LC_END;
 }
 
-void LexerCheckKeywords(LexerToken *token)
+static void LexDecodeNumber(Lexer *inst, LexerToken *token, bool is_decimal)
 {
-    const char *keywords[] = {
-        "if", "return", "for", "while",
-        "struct", "fn"
-    };
+    LexerLiteral *literal = LexNewLiteral(inst);
+    const char *p = token->start;
 
-    if (IfIsKeyword(token, keywords, sizeof(keywords) / sizeof(keywords[0]))) {
-        token->type = TT_KEYWORD;
+    uint64_t value = 0;
+    for (; p < token->end && *p != '.'; p++) {
+        const uint64_t digit = *p - '0';
+        if (value > (INT64_MAX - digit) / 10) {
+            ThrowError(inst, is_decimal ? "Decimal literal is too large!\n" : "Integer literal is too large!\n");
+        }
+        value = value * 10 + digit;
     }
 
-    const char *types[] = {
-        "int", "str"
-    };
+    literal->int_value = (int64_t)value;
+    literal->decimal_value = (double)value;
+    literal->is_decimal = is_decimal;
 
-    if (IfIsKeyword(token, types, 2)) {
-        token->type = TT_TYPE;
+    if (is_decimal) {
+        double scale = 0.1;
+        for (p++; p < token->end; p++) {
+            literal->decimal_value += (*p - '0') * scale;
+            scale *= 0.1;
+        }
     }
+
+    token->literal = literal;
 }
 
-void LexerSetType(Lexer *inst, LexerToken *token)
+static char LexEscapedChar(Lexer *inst, char c)
 {
-    int length = LexerTokenLength(token);
+    switch (c) {
+        case 'n':
+            return '\n';
+        case 't':
+            return '\t';
+        case 'r':
+            return '\r';
+        case '0':
+            return '\0';
+        case '\\':
+        case '"':
+        case '\'':
+            return c;
+        default:
+            break;
+    }
+    ThrowError(inst, "Unknown escape sequence in string literal!\n");
+    return c;
+}
 
-    token->type = TT_NONE;
+static void LexDecodeString(Lexer *inst, LexerToken *token)
+{
+    LexerLiteral *literal = LexNewLiteral(inst);
+    const char *body = token->start + 1;
+    const size_t body_length = (token->end - 1) - body;
 
-    bool decimal_found = false;
+    // strings without escapes are used straight from the source
+    const char *escape = memchr(body, '\\', body_length);
+    if (escape == NULL) {
+        literal->string = body;
+        literal->string_length = (int)body_length;
+        token->literal = literal;
+        return;
+    }
 
-    // parse numbers
-    int i;
-    for (i = 0; i < length; i++) {
-        if (isnumber(token->start[i])) {
-            token->type = TT_NUMBER;
+    // escapes only ever make the string shorter
+    char *bytes = LexAllocString(inst, body_length);
+    size_t length = escape - body;
+    memcpy(bytes, body, length);
+
+    const char *p;
+    for (p = escape; p < token->end - 1; p++) {
+        bytes[length++] = (*p == '\\') ? LexEscapedChar(inst, *(++p)) : *p;
+    }
+
+    literal->string = bytes;
+    literal->string_length = (int)length;
+    token->literal = literal;
+}
+
+/**
+    Check if the quote at `quote` is escaped by an odd amount of backslashes before it.
+*/
+static bool LexIsEscaped(const char *string_start, const char *quote)
+{
+    const char *p = quote;
+    while (p > string_start && p[-1] == '\\') {
+        p--;
+    }
+    return ((quote - p) & 1) != 0;
+}
+
+/**
+    Lex the next token from the input in a single pass, setting its type as it is scanned.
+    @return false when the end of the input has been reached.
+*/
+static bool LexScanToken(Lexer *inst, LexerToken *token)
+{
+    const unsigned char *classes = inst->char_class;
+    char *p = inst->newb;
+
+    for (;;) {
+        // lex comments
+        if (p[0] == '/' && p[1] == '/') {
+            p = (char *)lex_scan.line_end(p + 2);
+            continue;
+        }
+
+        unsigned char cls = classes[(unsigned char)*p];
+
+        switch (cls) {
+        case LC_END:
+            inst->newb = p;
+            return false;
+
+        case LC_SPACE: {
+            // single spaces and indentation are cheaper to walk directly, only hand long runs
+            // to the vector scanner.
+            const char *short_run_end = p + LEX_SHORT_SPACE_RUN;
+            while (classes[(unsigned char)*(++p)] == LC_SPACE) {
+                if (p == short_run_end) {
+                    p = (char *)lex_scan.spaces(p);
+                    break;
+                }
+            }
+            continue;
+        }
+
+        case LC_NEWLINE:
+            LexAddLine(inst, ++p);
+            continue;
+
+        case LC_SPECIAL:
+            token->start = p;
+            token->end = p + 1;
+            token->type = special_types[(unsigned char)*p];
+            if (token->type == TT_NONE) {
+                token->type = TT_IDENTIFIER;
+            }
+            token->symbol = SYM_NONE;
+            token->literal = NULL;
+            inst->newb = p + 1;
+            return true;
+
+        case LC_QUOTE: {
+            const char quote = *p;
+            token->start = p;
+
+            for (;;) {
+                p = (char *)lex_scan.quote(p + 1, quote);
+
+                if (*p == quote) {
+                    if (!LexIsEscaped(token->start + 1, p)) {
+                        break;
+                    }
+                }
+                else if (*p == '\0') {
+                    ThrowError(inst, "Unterminated string literal!\n");
+                }
+                else {
+                    // newline inside of the string
+                    LexAddLine(inst, p + 1);
+                }
+            }
+
+            token->end = p + 1;
+            token->type = TT_STRING;
+            token->symbol = SYM_NONE;
+            inst->newb = p + 1;
+
+            LexDecodeString(inst, token);
+            return true;
         }
-        else if (token->start[i] == '.' && token->type == TT_NUMBER) {
-            if (decimal_found) {
+
+        default: {
+            LexState state = (cls == LC_DIGIT) ? LS_NUMBER : LS_IDENT;
+            LexState next;
+
+            token->start = p;
+
+            while ((next = word_transitions[state][classes[(unsigned char)*(++p)]]) < LS_ACCEPT) {
+                state = next;
+            }
+            if (next == LS_ERROR) {
                 ThrowError(inst, "Invalid number format!\n");
             }
-            token->type = TT_NUMBER;
-            decimal_found = true;
+
+            token->end = p;
+            inst->newb = p;
+
+            if (state == LS_IDENT) {
+                const int length = (int)(p - token->start);
+                token->literal = NULL;
+                const Keyword *kw = KeywordLookup(token->start, length);
+
+                if (kw != NULL) {
+                    token->type = kw->type;
+                    token->symbol = kw->symbol;
+                }
+                else if (inst->local_symbols != NULL) {
+                    token->type = TT_IDENTIFIER;
+                    token->symbol = InternTableAdd(inst->local_symbols, token->start, length);
+                }
+                else {
+                    token->type = TT_IDENTIFIER;
+                    token->symbol = InternString(token->start, length);
+                }
+            }
+            else {
+                token->type = TT_NUMBER;
+                token->symbol = SYM_NONE;
+                LexDecodeNumber(inst, token, state == LS_DECIMAL);
+            }
+            return true;
         }
-        else {
-            token->type = TT_IDENTIFIER;
-            break;
         }
     }
+}
+
+/**
+    Set up a lexer with a line table that is not registered in `line_tables`.
+*/
+static void LexSetup(Lexer *inst, char *data, const char *specials, int flags)
+{
+    inst->token_buffer_size = 0;
+    inst->token_amt = 0;
+    inst->token_offsets = NULL;
+    inst->token_lengths = NULL;
+    inst->token_types = NULL;
+    inst->token_values = NULL;
+    inst->data = data;
 
+    inst->literal_blocks = NULL;
+    inst->literal_block_amt = 0;
+    inst->literal_amt = 0;
+    inst->literal_window = 0;
+    inst->string_blocks = NULL;
+    inst->string_bytes = NULL;
+    inst->string_bytes_left = 0;
+    inst->newb = data;
 
-    if (token->type == TT_NUMBER) {
-        return;
+    inst->current_line = 0;
+    inst->_line_start_ptr = data;
+
+    LexerLineTable *lines = (LexerLineTable *)malloc(sizeof(LexerLineTable));
+    lines->data = data;
+    lines->end = data;
+    lines->line_buffer_size = LINE_BUFFER_START;
+    lines->line_starts = (size_t *)malloc(sizeof(size_t) * lines->line_buffer_size);
+    lines->line_starts[0] = 0;
+    lines->line_count = 1;
+    lines->next = NULL;
+    inst->lines = lines;
+
+    inst->local_symbols = NULL;
+    inst->error_jump = NULL;
+
+    LexScanInit();
+    LexBuildClassTable(inst, specials, flags);
+}
+
+static void LexAllocTokens(Lexer *inst, int buffer_size)
+{
+    inst->token_buffer_size = buffer_size;
+    inst->token_offsets = (uint32_t *)malloc(sizeof(uint32_t) * buffer_size);
+    inst->token_lengths = (uint32_t *)malloc(sizeof(uint32_t) * buffer_size);
+    inst->token_types = (unsigned char *)malloc(buffer_size);
+    inst->token_values = (uint32_t *)malloc(sizeof(uint32_t) * buffer_size);
+}
+
+Lexer LexerInit(char *data, const char *specials, int flags)
+{
+    // Setup sflex structure
+    Lexer inst;
+    LexSetup(&inst, data, specials, flags);
+
+    inst.lines->next = line_tables;
+    line_tables = inst.lines;
+
+    return inst;
+}
+
+bool LexerNext(Lexer *inst, LexerToken *token)
+{
+    const bool found = LexScanToken(inst, token);
+    inst->lines->end = inst->newb;
+    if (found) {
+        return true;
     }
 
-    if (token->start[0] == '"' || token->start[0] == '\'') {
-        token->type = TT_STRING;
-        return;
+    // end of input, fill in an end marker. Further calls keep returning it.
+    token->start = inst->newb;
+    token->end = inst->newb;
+    token->type = TT_NONE;
+    token->symbol = SYM_NONE;
+    token->literal = NULL;
+
+    return false;
+}
+
+Lexer LexerLex(char *data, const char *specials, int flags) {
+    Lexer inst = LexerInit(data, specials, flags);
+    LexAllocTokens(&inst, TOKEN_BUFFER_START);
+
+    LexerToken token;
+    while (LexerNext(&inst, &token)) {
+        if (token.end - inst.data > UINT32_MAX) {
+            ThrowError(&inst, "Input is too large for the token store, use LexerNext instead!\n");
+        }
+        LexStoreToken(&inst, &token);
     }
 
-    // parse single character tokens
-    if (length == 1 && LexerApplySingleCharType(token)) {
-        return;
+    return inst;
+}
+
+Lexer LexerLexDetached(char *data, const char *specials, int flags)
+{
+    Lexer inst;
+    LexSetup(&inst, data, specials, flags);
+    LexAllocTokens(&inst, TOKEN_BUFFER_START);
+    inst.local_symbols = InternTableCreatePredefined();
+
+    LexerToken token;
+    while (LexerNext(&inst, &token)) {
+        if (token.end - inst.data > UINT32_MAX) {
+            ThrowError(&inst, "Input is too large for the token store, use LexerNext instead!\n");
+        }
+        LexStoreToken(&inst, &token);
     }
 
-    LexerCheckKeywords(token);
+    return inst;
+}
+
+void LexerAttach(Lexer *inst)
+{
+    InternTable *local_symbols = inst->local_symbols;
+    const uint32_t symbol_count = InternTableCount(local_symbols);
+
+    SymbolId *symbol_map = (SymbolId *)malloc(sizeof(SymbolId) * symbol_count);
+
+    SymbolId symbol;
+    for (symbol = 0; symbol < SYM_PREDEFINED_COUNT; symbol++) {
+        symbol_map[symbol] = symbol;
+    }
+    for (; symbol < symbol_count; symbol++) {
+        int length;
+        const char *name = InternTableName(local_symbols, symbol, &length);
+        symbol_map[symbol] = InternString(name, length);
+    }
 
-    if (token->type == TT_NONE && token->end - token->start > 0 && isalpha(token->start[0])) {
-        token->type = TT_IDENTIFIER;
+    // keywords carry their global symbol, which is also their id in the local table, so
+    // identifiers like `del` map to themselves
+    int i;
+    for (i = 0; i < inst->token_amt; i++) {
+        if (inst->token_types[i] == TT_IDENTIFIER) {
+            inst->token_values[i] = symbol_map[inst->token_values[i]];
+        }
     }
+
+    free(symbol_map);
+    InternTableDestroy(local_symbols);
+    inst->local_symbols = NULL;
+
+    inst->lines->next = line_tables;
+    line_tables = inst->lines;
 }
 
-long LexerTokenLength(LexerToken *token)
+
+//////////////////////////////
+// Parallel lexing
+//////////////////////////////
+
+// A slice of the input that starts at the beginning of a line. Chunks are lexed speculatively,
+// assuming that no token crosses into them from the previous chunk. When that turns out to be
+// wrong, the chunk is lexed again from where the previous chunk's last token ended.
+typedef struct {
+    Lexer lexer;
+    const char *specials;
+    int flags;
+
+    char *start;
+    char *end;
+
+    // where lexing of this chunk started. Only differs from `start` when it was lexed again.
+    char *lex_start;
+    // end of the last token that starts inside of the chunk, or `lex_start` without tokens
+    char *last_end;
+    // an error was hit while lexing speculatively
+    bool failed;
+
+    // global ids for the chunk's local symbol ids
+    SymbolId *symbol_map;
+    // index of the chunk's first token and literal in the merged store
+    int first_token;
+    int first_literal;
+} LexChunk;
+
+typedef struct {
+    Lexer *merged;
+    LexChunk *chunk;
+} LexCopyJob;
+
+static void LexChunkReset(LexChunk *chunk, char *data, char *lex_start)
 {
-    return token->end - token->start;
+    LexSetup(&chunk->lexer, data, chunk->specials, chunk->flags);
+    LexAllocTokens(&chunk->lexer, TOKEN_BUFFER_START);
+
+    // lines are only added by the newlines this chunk scans over
+    chunk->lexer.lines->line_count = 0;
+    chunk->lexer.newb = lex_start;
+    chunk->lexer.local_symbols = InternTableCreatePredefined();
+
+    chunk->lex_start = lex_start;
+    chunk->last_end = lex_start;
+    chunk->failed = false;
 }
 
-void LexerDestroy(Lexer *inst) {
-    if (inst == NULL)
-        return;
+static void LexChunkFree(LexChunk *chunk)
+{
+    InternTableDestroy(chunk->lexer.local_symbols);
+    chunk->lexer.local_symbols = NULL;
 
-    if (inst->tokens != NULL)
-        free(inst->tokens);
+    // the line table was never registered, so LexerDestroy only frees it
+    LexerDestroy(&chunk->lexer);
+    free(chunk->symbol_map);
+    chunk->symbol_map = NULL;
+}
 
-    inst->token_amt = 0;
-    inst->token_buffer_size = 0;
+/**
+    Lex every token that starts inside of the chunk. The token after the last one is scanned
+    to find where the chunk ends, and then thrown away; it is the first token of the next chunk.
+*/
+static void LexChunkRun(LexChunk *chunk)
+{
+    Lexer *inst = &chunk->lexer;
+    LexerToken token;
+
+    while (LexerNext(inst, &token) && token.start < chunk->end) {
+        LexStoreToken(inst, &token);
+        chunk->last_end = token.end;
+    }
+
+    // drop the literal of the token that was thrown away, so literal indices match LexerLex
+    if (token.literal != NULL) {
+        inst->literal_amt--;
+    }
 }
 
-bool LexerIsWhitespace(Lexer *inst, char ch)
+static void LexChunkJob(void *arg)
 {
-    if (ch == '\n') {
-        inst->current_line++;
-        inst->_line_start_ptr = inst->newb;
+    LexChunk *chunk = (LexChunk *)arg;
+    jmp_buf error_jump;
+
+    // the error may only exist because the chunk started in the middle of a string, so leave
+    // reporting it to the merge
+    if (setjmp(error_jump)) {
+        chunk->failed = true;
+        return;
     }
-    return (ch == ' ' || ch == '\t' || ch == '\n');
+    chunk->lexer.error_jump = &error_jump;
+
+    LexChunkRun(chunk);
+
+    chunk->lexer.error_jump = NULL;
 }
 
-Lexer LexerLex(char *data, const char *specials, int flags) {
-    char ch, lastch;
-    // Setup sflex structure
-    Lexer inst;
+static void LexCopyChunkJob(void *arg)
+{
+    LexCopyJob *job = (LexCopyJob *)arg;
+    const Lexer *from = &job->chunk->lexer;
+    Lexer *to = job->merged;
+
+    const int first = job->chunk->first_token;
+    const int amt = from->token_amt;
+
+    memcpy(to->token_offsets + first, from->token_offsets, sizeof(uint32_t) * amt);
+    memcpy(to->token_lengths + first, from->token_lengths, sizeof(uint32_t) * amt);
+    memcpy(to->token_types + first, from->token_types, amt);
 
-    inst.token_buffer_size = TOKEN_BUFFER_START;
-    inst.token_amt = 0;
-    inst.tokens = (LexerToken *)malloc(sizeof(LexerToken ) * inst.token_buffer_size);
-    inst.data = data;
+    // keywords already carry their global symbol, only identifiers have local ids
+    int i;
+    for (i = 0; i < amt; i++) {
+        uint32_t value = from->token_values[i];
+        const TokenType type = (TokenType)from->token_types[i];
 
-    inst.current_line = 0;
-    inst._line_start_ptr = data;
+        if (type == TT_IDENTIFIER) {
+            value = job->chunk->symbol_map[value];
+        }
+        else if (type == TT_NUMBER || type == TT_STRING) {
+            value += job->chunk->first_literal;
+        }
+        to->token_values[first + i] = value;
+    }
 
-    bool in_string = false;
+    const int first_literal = job->chunk->first_literal;
+    for (i = 0; i < from->literal_amt; i++) {
+        *LexLiteralAt(to, first_literal + i) = *LexLiteralAt(from, i);
+    }
+}
 
-    // skip initial whitespace
-    while (SFLEX_IS_WHITESPACE(&inst, (ch = (*data)))) {
-        data++;
+/**
+    Append the line starts in (`after`, `until`] from a chunk's line table.
+*/
+static void LexMergeLines(Lexer *inst, const LexerLineTable *from, size_t after, size_t until)
+{
+    int i;
+    for (i = 0; i < from->line_count; i++) {
+        const size_t line_start = from->line_starts[i];
+        if (line_start > after && line_start <= until) {
+            LexAddLine(inst, inst->data + line_start);
+        }
     }
+}
 
-    // char *newb = data;
-    inst.newb = data;
-    LexerToken *token = NULL;
+Lexer LexerLexParallel(char *data, const char *specials, int flags, int thread_count)
+{
+    const size_t size = strlen(data);
 
-    while ((ch = *(inst.newb))) {
-        // lex comments
-        if (ch == '/' && *(inst.newb + 1) == '/') {
-            // skip until our next newline or until the end of file
-            while ((ch = *(++inst.newb)) && ch != '\n' && ch != EOF);
-
-            // sklp any whitespace after, until the next statement
-            while (SFLEX_IS_WHITESPACE(&inst, *(++inst.newb)));
-            // if we have a current token, set it to the new start
-            if (token) {
-                token->start = inst.newb;
+    size_t chunk_count = (size_t)thread_count * LEX_PARALLEL_CHUNKS_PER_THREAD;
+    if (chunk_count > size / LEX_PARALLEL_MIN_CHUNK) {
+        chunk_count = size / LEX_PARALLEL_MIN_CHUNK;
+    }
+    if (thread_count < 2 || chunk_count < 2) {
+        return LexerLex(data, specials, flags);
+    }
+
+    Lexer inst = LexerInit(data, specials, flags);
+    if (size > UINT32_MAX) {
+        ThrowError(&inst, "Input is too large for the token store, use LexerNext instead!\n");
+    }
+
+    // split at the first line start after every chunk_size bytes
+    LexChunk *chunks = (LexChunk *)calloc(chunk_count, sizeof(LexChunk));
+    const size_t chunk_size = size / chunk_count;
+    char *const data_end = data + size;
+    char *chunk_start = data;
+    size_t amt = 0;
+
+    while (chunk_start < data_end) {
+        char *chunk_end = data_end;
+        if (amt + 1 < chunk_count && (size_t)(data_end - chunk_start) > chunk_size) {
+            char *newline = memchr(chunk_start + chunk_size, '\n', data_end - (chunk_start + chunk_size));
+            if (newline != NULL) {
+                chunk_end = newline + 1;
             }
+        }
 
-            continue;
+        LexChunk *chunk = &chunks[amt++];
+        chunk->specials = specials;
+        chunk->flags = flags;
+        chunk->start = chunk_start;
+        chunk->end = chunk_end;
+
+        chunk_start = chunk_end;
+    }
+
+    ThreadPool *pool = ThreadPoolCreate(thread_count);
+
+    size_t i;
+    for (i = 0; i < amt; i++) {
+        LexChunkReset(&chunks[i], data, chunks[i].start);
+        ThreadPoolSubmit(pool, LexChunkJob, &chunks[i]);
+    }
+    ThreadPoolWait(pool);
+
+    // Walk the chunks in order. A chunk is only valid if lexing the previous chunk ended
+    // exactly at its start; otherwise a string crossed into it and it is lexed again here.
+    char *resume = data;
+    int token_amt = 0;
+    int literal_amt = 0;
+
+    for (i = 0; i < amt; i++) {
+        LexChunk *chunk = &chunks[i];
+
+        if (chunk->failed || chunk->lex_start != resume) {
+            LexChunkFree(chunk);
+            LexChunkReset(chunk, data, resume);
+
+            // errors from here on are real, report them on the right line
+            chunk->lexer.current_line = inst.current_line;
+            LexChunkRun(chunk);
         }
 
-        if (SFLEX_IS_STRING(ch, flags))
-            in_string = !in_string;
+        chunk->first_token = token_amt;
+        token_amt += chunk->lexer.token_amt;
+        chunk->first_literal = literal_amt;
+        literal_amt += chunk->lexer.literal_amt;
 
-        // first character in string
-        if (inst.newb == data) {
-            // token is not initialized, create new one
-            token = LexTokenGetNext(&inst);
-            //
-            if (!SFLEX_IS_WHITESPACE(&inst, ch)) {
-                token->start = inst.newb;
-            }
+        resume = chunk->last_end;
+        if (i + 1 < amt && resume < chunks[i + 1].start) {
+            resume = chunks[i + 1].start;
         }
 
-        // handle whitespace
-        if ((SFLEX_IS_WHITESPACE(&inst, ch)) && (!in_string)) {
-            if (token != NULL)
-                token->end = inst.newb;
+        // the newlines scanned past the chunk's end belong to the next chunk
+        const size_t until = (i + 1 < amt) ? (size_t)(resume - data) : size;
+        LexMergeLines(&inst, chunk->lexer.lines, chunk->lex_start - data, until);
+
+        // intern in chunk order, so symbols get the same ids as when lexing sequentially
+        InternTable *local_symbols = chunk->lexer.local_symbols;
+        const uint32_t symbol_count = InternTableCount(local_symbols);
 
-            while (SFLEX_IS_WHITESPACE(&inst, *(inst.newb+1)))
-                inst.newb++;
+        chunk->symbol_map = (SymbolId *)malloc(sizeof(SymbolId) * symbol_count);
 
-            LexerSetType(&inst, token);
-            token = LexTokenGetNext(&inst);
-            token->start = inst.newb + 1;
+        SymbolId symbol;
+        for (symbol = 0; symbol < SYM_PREDEFINED_COUNT; symbol++) {
+            chunk->symbol_map[symbol] = symbol;
         }
-        // handle 'special' characters
-        else {
-            if (specials != NULL && SFLEX_IS_SPECIAL(specials, ch) && !in_string) {
-                if (!SFLEX_IS_WHITESPACE(&inst, lastch) && !SFLEX_IS_SPECIAL(specials, lastch) && (token != NULL)) {
-                    token->end = inst.newb;
+        for (; symbol < symbol_count; symbol++) {
+            int length;
+            const char *name = InternTableName(local_symbols, symbol, &length);
+            chunk->symbol_map[symbol] = InternString(name, length);
+        }
+    }
 
-                    LexerSetType(&inst, token);
-                    token = LexTokenGetNext(&inst);
-                }
-                token->start = inst.newb;
-                token->end = inst.newb+1;
+    LexAllocTokens(&inst, token_amt > 0 ? token_amt : 1);
+    inst.token_amt = token_amt;
+    inst.newb = data_end;
+    inst.lines->end = data_end;
 
-                LexerSetType(&inst, token);
-                token = LexTokenGetNext(&inst);
+    LexReserveLiterals(&inst, literal_amt);
+    inst.literal_amt = literal_amt;
 
-                while (SFLEX_IS_WHITESPACE(&inst, *(inst.newb + 1)))
-                    inst.newb++;
+    LexCopyJob *copy_jobs = (LexCopyJob *)malloc(sizeof(LexCopyJob) * amt);
+    for (i = 0; i < amt; i++) {
+        copy_jobs[i].merged = &inst;
+        copy_jobs[i].chunk = &chunks[i];
+        ThreadPoolSubmit(pool, LexCopyChunkJob, &copy_jobs[i]);
+    }
+    ThreadPoolWait(pool);
+    ThreadPoolDestroy(pool);
 
-                token->start = inst.newb + 1;
-            }
+    for (i = 0; i < amt; i++) {
+        // the merged literals still point into the chunk's escaped strings
+        Lexer *chunk_lexer = &chunks[i].lexer;
+        while (chunk_lexer->string_blocks != NULL) {
+            LexStringBlock *block = chunk_lexer->string_blocks;
+            chunk_lexer->string_blocks = block->next;
+            block->next = inst.string_blocks;
+            inst.string_blocks = block;
         }
-        lastch = ch;
-        inst.newb++;
+        LexChunkFree(&chunks[i]);
     }
+    free(copy_jobs);
+    free(chunks);
 
-    // chop off empty token at end
-    inst.token_amt--;
     return inst;
 }
@@ -1,8 +1,18 @@
 #ifndef SFLEXH_H
 #define SFLEXH_H
 
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Intern.h"
+
 #define SFLEX_USE_STRINGS 0x01
 
+// single character tokens of the alps language
+#define SFLEX_ALPS_SPECIALS "+-*/=:;,.(){}"
+
 #define LexToken(token) (token.start)
 
 // small helper when using strncmp and printf, due to the way tokens are stored.
@@ -32,33 +42,164 @@ typedef enum {
 
 } TokenType;
 
+// Payload of a number or string literal, decoded once while lexing so that later stages never
+// read the literal's text again.
+typedef struct {
+    // value of an integer literal, or the integer part of a decimal one
+    int64_t int_value;
+    double decimal_value;
+    bool is_decimal;
+
+    // contents of a string literal without the quotes and with escapes processed. Not NUL
+    // terminated; points into the source when the string had no escapes.
+    const char *string;
+    int string_length;
+} LexerLiteral;
+
 typedef struct {
     char *start;
     char *end;
 
-    int file_line;
-    int file_col;
-
     TokenType type;
+
+    // interned name of identifiers, keywords and types. SYM_NONE for any other token.
+    SymbolId symbol;
+    // decoded value of TT_NUMBER and TT_STRING tokens, NULL for any other token
+    const LexerLiteral *literal;
 } LexerToken;
 
+typedef struct LexStringBlock LexStringBlock;
+
+// Offsets of the start of every line in a lexed buffer, appended to while lexing. Line and
+// column numbers are only needed for error messages, so they are looked up from this table
+// instead of being stored on every token.
+typedef struct LexerLineTable {
+    const char *data;
+    // end of the text lexed so far, so that tokens of other buffers are not matched to this one
+    const char *end;
+
+    size_t *line_starts;
+    int line_count;
+    int line_buffer_size;
+
+    struct LexerLineTable *next;
+} LexerLineTable;
+
+typedef struct {
+    uint32_t line;
+    uint32_t col;
+} LexerPosition;
+
+// Positions of tokens that were not lexed from a buffer, like the tokens of a precompiled
+// module. The token at `tokens[i]` is at `positions[i]`, a line of 0 marks an unknown position.
+typedef struct LexerPositionTable {
+    const LexerToken *tokens;
+    const LexerPosition *positions;
+    uint32_t token_count;
+
+    struct LexerPositionTable *next;
+} LexerPositionTable;
+
 typedef struct {
-    LexerToken *tokens;
+    // compact token storage filled by LexerLex, read back with LexerGetToken
+    uint32_t *token_offsets;
+    uint32_t *token_lengths;
+    unsigned char *token_types;
+    // symbol of names, index into the literal pool for literals
+    uint32_t *token_values;
     int token_buffer_size;
     int token_amt;
 
+    // decoded literals, allocated in blocks so that pointers to them stay valid
+    LexerLiteral **literal_blocks;
+    int literal_block_amt;
+    int literal_amt;
+    // when not 0, only the literals of the last `literal_window` literal tokens are kept and
+    // their slots are reused after that. Only for pulling tokens with LexerNext.
+    int literal_window;
+
+    // storage for the contents of strings that had escapes
+    LexStringBlock *string_blocks;
+    char *string_bytes;
+    size_t string_bytes_left;
+
+    LexerLineTable *lines;
+
     int current_line;
     char *_line_start_ptr;
 
     char *newb;
     char *data;
+
+    // maps every byte to its LexClass, built from the specials string and flags
+    unsigned char char_class[256];
+
+    // when set, identifiers are interned here instead of in the global table
+    InternTable *local_symbols;
+    // when set, errors jump here instead of exiting
+    jmp_buf *error_jump;
 } Lexer;
 
 const char *LexerTokenTypeStr(TokenType type);
 long LexerTokenLength(LexerToken *token);
-void LexerSetType(Lexer *inst, LexerToken *token);
 
+/**
+    Set up a lexer over `data` without tokenizing anything, for use with LexerNext.
+*/
+Lexer LexerInit(char *data, const char *specials, int flags);
+
+/**
+    Lex the next token into `token`. At the end of the input `token` is set to a TT_NONE
+    end marker.
+    @return false once the end of the input has been reached.
+*/
+bool LexerNext(Lexer *inst, LexerToken *token);
+
+/**
+    Tokenize all of `data` into the lexer's compact token store.
+*/
 Lexer LexerLex(char *data, const char *specials, int flags);
+
+/**
+    Tokenize all of `data` like LexerLex, but split it into chunks at line boundaries that are
+    lexed on `thread_count` threads. The token store, line table and symbol ids are identical
+    to the ones LexerLex produces. Small inputs are lexed on the calling thread.
+*/
+Lexer LexerLexParallel(char *data, const char *specials, int flags, int thread_count);
+
+/**
+    Tokenize all of `data` like LexerLex without touching any global state, so that several
+    buffers can be lexed on different threads. Identifiers get ids from a table of the lexer's
+    own until LexerAttach is called.
+*/
+Lexer LexerLexDetached(char *data, const char *specials, int flags);
+
+/**
+    Give the identifiers of a detached lexer their global symbol ids and register its lines for
+    LexerTokenPosition. Nothing else may intern or look up positions at the same time.
+*/
+void LexerAttach(Lexer *inst);
+
+/**
+    Read a token back from the store filled by LexerLex. Indices past the last token return
+    a TT_NONE end marker.
+*/
+LexerToken LexerGetToken(Lexer *inst, int index);
+
+/**
+    Find the 1-based line and column of a token in any buffer that is currently being lexed
+    or was lexed by a lexer that has not been destroyed, or in a registered position table.
+    @return false if the token is not inside of a known buffer.
+*/
+bool LexerTokenPosition(const LexerToken *token, int *line, int *col);
+
+/**
+    Make the positions in `table` known to LexerTokenPosition until LexerRemovePositions is
+    called. The table and the arrays it points to must stay alive until then.
+*/
+void LexerAddPositions(LexerPositionTable *table);
+void LexerRemovePositions(LexerPositionTable *table);
+
 void LexerDestroy(Lexer *inst);
 
 #endif
@@ -0,0 +1,301 @@
+#include "LexerScan.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LEX_SCAN_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#define LEX_SCAN_NEON 1
+#include <arm_neon.h>
+#endif
+
+// The vector paths only ever load whole aligned blocks, so they never cross into a page that does
+// not contain part of the string. That may still read past the end of a heap allocation, which
+// the address sanitizer would report.
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define LEX_NO_ASAN __attribute__((no_sanitize_address))
+#endif
+#endif
+#if !defined(LEX_NO_ASAN) && defined(__SANITIZE_ADDRESS__)
+#define LEX_NO_ASAN __attribute__((no_sanitize_address))
+#endif
+#ifndef LEX_NO_ASAN
+#define LEX_NO_ASAN
+#endif
+
+//////////////////////////////
+// Scalar
+//////////////////////////////
+
+static const char *ScanLineEndScalar(const char *p)
+{
+    while (*p && *p != '\n')
+        p++;
+    return p;
+}
+
+static const char *ScanQuoteScalar(const char *p, char quote)
+{
+    while (*p && *p != quote && *p != '\n')
+        p++;
+    return p;
+}
+
+static const char *ScanSpacesScalar(const char *p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\r')
+        p++;
+    return p;
+}
+
+#ifdef LEX_SCAN_X86
+
+//////////////////////////////
+// SSE2
+//////////////////////////////
+
+// Run `match_` over aligned 16 byte blocks starting at `p_`, ignoring the bytes before `p_` in the
+// first block, and return a pointer to the first byte whose bit is set.
+#define SSE2_SCAN(p_, match_)                                                       \
+    do {                                                                            \
+        const uintptr_t misalign = (uintptr_t)(p_) & 15;                            \
+        const __m128i *block = (const __m128i *)((p_) - misalign);                  \
+        __m128i v = _mm_load_si128(block);                                          \
+        unsigned mask = (unsigned)_mm_movemask_epi8(match_) & (0xFFFFu << misalign); \
+        while (mask == 0) {                                                         \
+            v = _mm_load_si128(++block);                                            \
+            mask = (unsigned)_mm_movemask_epi8(match_);                             \
+        }                                                                           \
+        return (const char *)block + __builtin_ctz(mask);                           \
+    } while (0)
+
+LEX_NO_ASAN static const char *ScanLineEndSse2(const char *p)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+
+    SSE2_SCAN(p, _mm_or_si128(_mm_cmpeq_epi8(v, newline), _mm_cmpeq_epi8(v, zero)));
+}
+
+LEX_NO_ASAN static const char *ScanQuoteSse2(const char *p, char quote)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i quotes = _mm_set1_epi8(quote);
+    const __m128i zero = _mm_setzero_si128();
+
+    SSE2_SCAN(p, _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, newline), _mm_cmpeq_epi8(v, quotes)),
+        _mm_cmpeq_epi8(v, zero)
+    ));
+}
+
+LEX_NO_ASAN static const char *ScanSpacesSse2(const char *p)
+{
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i cr = _mm_set1_epi8('\r');
+
+    // invert the whitespace matches to find the first byte that is not whitespace
+    SSE2_SCAN(p, _mm_xor_si128(
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, tab)), _mm_cmpeq_epi8(v, cr)),
+        _mm_set1_epi8((char)0xFF)
+    ));
+}
+
+//////////////////////////////
+// AVX2
+//////////////////////////////
+
+#define AVX2_SCAN(p_, match_)                                                       \
+    do {                                                                            \
+        const uintptr_t misalign = (uintptr_t)(p_) & 31;                            \
+        const __m256i *block = (const __m256i *)((p_) - misalign);                  \
+        __m256i v = _mm256_load_si256(block);                                       \
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(match_) & (0xFFFFFFFFu << misalign); \
+        while (mask == 0) {                                                         \
+            v = _mm256_load_si256(++block);                                         \
+            mask = (uint32_t)_mm256_movemask_epi8(match_);                          \
+        }                                                                           \
+        return (const char *)block + __builtin_ctz(mask);                           \
+    } while (0)
+
+LEX_NO_ASAN __attribute__((target("avx2")))
+static const char *ScanLineEndAvx2(const char *p)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+
+    AVX2_SCAN(p, _mm256_or_si256(_mm256_cmpeq_epi8(v, newline), _mm256_cmpeq_epi8(v, zero)));
+}
+
+LEX_NO_ASAN __attribute__((target("avx2")))
+static const char *ScanQuoteAvx2(const char *p, char quote)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i quotes = _mm256_set1_epi8(quote);
+    const __m256i zero = _mm256_setzero_si256();
+
+    AVX2_SCAN(p, _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, newline), _mm256_cmpeq_epi8(v, quotes)),
+        _mm256_cmpeq_epi8(v, zero)
+    ));
+}
+
+LEX_NO_ASAN __attribute__((target("avx2")))
+static const char *ScanSpacesAvx2(const char *p)
+{
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i cr = _mm256_set1_epi8('\r');
+
+    AVX2_SCAN(p, _mm256_xor_si256(
+        _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(v, tab)), _mm256_cmpeq_epi8(v, cr)),
+        _mm256_set1_epi8((char)0xFF)
+    ));
+}
+
+#endif // LEX_SCAN_X86
+
+#ifdef LEX_SCAN_NEON
+
+//////////////////////////////
+// NEON
+//////////////////////////////
+
+// NEON has no movemask; narrowing each 16 bit lane by 4 gives a 64 bit mask with 4 bits per byte.
+#define NEON_SCAN(p_, match_)                                                       \
+    do {                                                                            \
+        const uintptr_t misalign = (uintptr_t)(p_) & 15;                            \
+        const uint8_t *block = (const uint8_t *)((p_) - misalign);                  \
+        uint8x16_t v = vld1q_u8(block);                                             \
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(match_), 4)), 0); \
+        mask &= ~0ull << (misalign * 4);                                            \
+        while (mask == 0) {                                                         \
+            block += 16;                                                            \
+            v = vld1q_u8(block);                                                    \
+            mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(match_), 4)), 0); \
+        }                                                                           \
+        return (const char *)block + (__builtin_ctzll(mask) >> 2);                  \
+    } while (0)
+
+LEX_NO_ASAN static const char *ScanLineEndNeon(const char *p)
+{
+    NEON_SCAN(p, vorrq_u8(vceqq_u8(v, vdupq_n_u8('\n')), vceqq_u8(v, vdupq_n_u8(0))));
+}
+
+LEX_NO_ASAN static const char *ScanQuoteNeon(const char *p, char quote)
+{
+    NEON_SCAN(p, vorrq_u8(
+        vorrq_u8(vceqq_u8(v, vdupq_n_u8('\n')), vceqq_u8(v, vdupq_n_u8((uint8_t)quote))),
+        vceqq_u8(v, vdupq_n_u8(0))
+    ));
+}
+
+LEX_NO_ASAN static const char *ScanSpacesNeon(const char *p)
+{
+    NEON_SCAN(p, vmvnq_u8(vorrq_u8(
+        vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')), vceqq_u8(v, vdupq_n_u8('\t'))),
+        vceqq_u8(v, vdupq_n_u8('\r'))
+    )));
+}
+
+#endif // LEX_SCAN_NEON
+
+LexScanFuncs lex_scan = {
+    ScanLineEndScalar,
+    ScanQuoteScalar,
+    ScanSpacesScalar,
+};
+
+static LexScanMode current_mode = LSM_AUTO;
+
+static LexScanMode LexScanBestMode(void)
+{
+#if defined(LEX_SCAN_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return LSM_AVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return LSM_SSE2;
+    }
+#elif defined(LEX_SCAN_NEON)
+    return LSM_NEON;
+#endif
+    return LSM_SCALAR;
+}
+
+bool LexScanSetMode(LexScanMode mode)
+{
+    if (mode == LSM_AUTO) {
+        mode = LexScanBestMode();
+    }
+
+    switch (mode) {
+    case LSM_SCALAR:
+        lex_scan.line_end = ScanLineEndScalar;
+        lex_scan.quote = ScanQuoteScalar;
+        lex_scan.spaces = ScanSpacesScalar;
+        break;
+#ifdef LEX_SCAN_X86
+    case LSM_SSE2:
+        lex_scan.line_end = ScanLineEndSse2;
+        lex_scan.quote = ScanQuoteSse2;
+        lex_scan.spaces = ScanSpacesSse2;
+        break;
+    case LSM_AVX2:
+        __builtin_cpu_init();
+        if (!__builtin_cpu_supports("avx2")) {
+            return false;
+        }
+        lex_scan.line_end = ScanLineEndAvx2;
+        lex_scan.quote = ScanQuoteAvx2;
+        lex_scan.spaces = ScanSpacesAvx2;
+        break;
+#endif
+#ifdef LEX_SCAN_NEON
+    case LSM_NEON:
+        lex_scan.line_end = ScanLineEndNeon;
+        lex_scan.quote = ScanQuoteNeon;
+        lex_scan.spaces = ScanSpacesNeon;
+        break;
+#endif
+    default:
+        return false;
+    }
+
+    current_mode = mode;
+    return true;
+}
+
+void LexScanInit(void)
+{
+    if (current_mode == LSM_AUTO) {
+        LexScanSetMode(LSM_AUTO);
+    }
+}
+
+LexScanMode LexScanGetMode(void)
+{
+    return current_mode;
+}
+
+const char *LexScanModeStr(LexScanMode mode)
+{
+    switch (mode) {
+        case LSM_AUTO:
+            return "auto";
+        case LSM_SCALAR:
+            return "scalar";
+        case LSM_SSE2:
+            return "sse2";
+        case LSM_AVX2:
+            return "avx2";
+        case LSM_NEON:
+            return "neon";
+    }
+    return "unknown";
+}
@@ -0,0 +1,42 @@
+#ifndef CML_LEXER_SCAN_H
+#define CML_LEXER_SCAN_H
+
+#include <stdbool.h>
+
+// Vectorized scanning helpers for the lexer. Each function walks forward from `p` and returns
+// the first byte that stops the scan; the NUL terminator always stops a scan.
+
+typedef enum {
+    LSM_AUTO,
+    LSM_SCALAR,
+    LSM_SSE2,
+    LSM_AVX2,
+    LSM_NEON,
+} LexScanMode;
+
+typedef struct {
+    // find the next '\n'
+    const char *(*line_end)(const char *p);
+    // find the next `quote` character or '\n'
+    const char *(*quote)(const char *p, char quote);
+    // find the first byte that is not ' ', '\t' or '\r'
+    const char *(*spaces)(const char *p);
+} LexScanFuncs;
+
+extern LexScanFuncs lex_scan;
+
+/**
+    Pick the scanning functions for the running CPU, unless a mode was already set.
+*/
+void LexScanInit(void);
+
+/**
+    Select the scanning functions. LSM_AUTO picks the widest instruction set supported by the
+    running CPU.
+    @return false if the requested mode is not available on this machine.
+*/
+bool LexScanSetMode(LexScanMode mode);
+LexScanMode LexScanGetMode(void);
+const char *LexScanModeStr(LexScanMode mode);
+
+#endif
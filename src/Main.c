@@ -1,67 +1,172 @@
 #include "Lexer.h"
 #include "Parser.h"
 #include "Compiler.h"
+#include "Source.h"
+#include "Arena.h"
+#include "FlatAst.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-char *LoadFile(void) {
-    FILE *fp = fopen("../test.alps", "rb");
-    if (fp == NULL)
-        return NULL;
-
-    fseek(fp, 0, SEEK_END);
-    unsigned file_size = ftell(fp);
-    rewind(fp);
-
-    char *buffer = (char *)malloc(file_size);
-    fread(buffer, 1, file_size, fp);
-    fclose(fp);
-    return buffer;
-}
-
-void PrintLexerTokens(Lexer *inst)
+void PrintLexerTokens(char *data)
 {
-    int i;
-    for (i = 0; i < inst->token_amt; i++) {
+    Lexer inst = LexerInit(data, SFLEX_ALPS_SPECIALS, SFLEX_USE_STRINGS);
+    LexerToken token;
+
+    while (LexerNext(&inst, &token)) {
         printf(
             "Token: [%.*s] type: %s\n",
-            (int)LexerTokenLength(&inst->tokens[i]),
-            LexToken(inst->tokens[i]),
-            LexerTokenTypeStr(inst->tokens[i].type)
+            (int)LexerTokenLength(&token),
+            LexToken(token),
+            LexerTokenTypeStr(token.type)
         );
     }
+
+    LexerDestroy(&inst);
 }
 
 
-int main() {
-    char *data;
-    if ((data = LoadFile()) == NULL) {
+void PrintUsage(const char *name)
+{
+    printf("usage: %s [--lex-threads N] [--parse-threads N] [--module-cache] [--lazy-bodies] [--print-tokens]\n       [--print-ast] [--print-asm] [--no-peephole] [--disable-peephole RULE] [--peephole-stats] [file]\n", name);
+}
+
+int main(int argc, char **argv) {
+    const char *input_path = "../test.alps";
+    // lex on this many threads before parsing, instead of lexing while parsing
+    int lex_threads = 1;
+    // parse included files on this many threads
+    int parse_threads = 1;
+    // load included files from precompiled modules, writing the ones that are missing
+    bool module_cache = false;
+    // only parse the bodies of functions that are reachable from _main
+    bool lazy_bodies = false;
+    // print every token of the input file
+    bool print_tokens = false;
+    // print the parse tree, with included files
+    bool print_ast = false;
+    // echo the generated assembly to stdout
+    bool print_asm = false;
+    // run the peephole optimizer on the generated code, without the disabled patterns
+    bool peephole = true;
+    const char *disabled_patterns[PEEP_COUNT];
+    int disabled_pattern_amt = 0;
+    // print how often each peephole pattern was applied
+    bool peephole_stats = false;
+
+    int i;
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--lex-threads") && i + 1 < argc) {
+            lex_threads = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--parse-threads") && i + 1 < argc) {
+            parse_threads = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--module-cache")) {
+            module_cache = true;
+        }
+        else if (!strcmp(argv[i], "--lazy-bodies")) {
+            lazy_bodies = true;
+        }
+        else if (!strcmp(argv[i], "--print-tokens")) {
+            print_tokens = true;
+        }
+        else if (!strcmp(argv[i], "--print-ast")) {
+            print_ast = true;
+        }
+        else if (!strcmp(argv[i], "--print-asm")) {
+            print_asm = true;
+        }
+        else if (!strcmp(argv[i], "--no-peephole")) {
+            peephole = false;
+        }
+        else if (!strcmp(argv[i], "--disable-peephole") && i + 1 < argc && disabled_pattern_amt < PEEP_COUNT) {
+            disabled_patterns[disabled_pattern_amt++] = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--peephole-stats")) {
+            peephole_stats = true;
+        }
+        else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+        else {
+            input_path = argv[i];
+        }
+    }
+
+    Source source;
+    if (!SourceLoad(&source, input_path)) {
         printf("Could not load file\n");
         return 1;
     }
-    Lexer inst;
-    inst = LexerLex(data, "+-*/=:;,.(){}", SFLEX_USE_STRINGS);
+    char *data = source.data;
 
-    PrintLexerTokens(&inst);
+    if (print_tokens) {
+        PrintLexerTokens(data);
+    }
 
-    printf("\n=== PARSE TREE ===\n\n");
+    // the parser pulls tokens from the lexer as it needs them, unless the whole file is lexed
+    // up front on multiple threads, scanned for includes before parsing or has bodies skipped
+    Lexer lexer;
+    if (lex_threads > 1) {
+        lexer = LexerLexParallel(data, SFLEX_ALPS_SPECIALS, SFLEX_USE_STRINGS, lex_threads);
+    }
+    else if (parse_threads > 1 || lazy_bodies) {
+        lexer = LexerLex(data, SFLEX_ALPS_SPECIALS, SFLEX_USE_STRINGS);
+    }
+    else {
+        lexer = LexerInit(data, SFLEX_ALPS_SPECIALS, SFLEX_USE_STRINGS);
+    }
+
+    // the AST and everything it points to is freed in one go once it has been compiled
+    Arena ast_arena;
+    ArenaInit(&ast_arena);
 
-    Parser parser = ParserInit(inst);
+    Parser parser = ParserInit(lexer, &ast_arena);
+    ParserSetFile(&parser, input_path);
+    ParserSetIncludeThreads(&parser, parse_threads);
+    ParserUseModules(&parser, module_cache);
+    ParserSetLazyBodies(&parser, lazy_bodies);
     Node *ast = Parse(&parser);
-    ParserPrintAST(ast, 0);
+
+    if (print_ast) {
+        printf("\n=== PARSE TREE ===\n\n");
+
+        FlatAst flat = FlatAstBuild(ast);
+        FlatAstPrint(&flat);
+        FlatAstDestroy(&flat);
+    }
 
     Compiler compiler;
 
-    printf("\n=== OUTPUT ===\n\n");
+    if (print_asm) {
+        printf("\n=== OUTPUT ===\n\n");
+    }
 
     compiler = CompilerInit(ast, "test.asm");
+    compiler.reachable_only = lazy_bodies;
+    compiler.echo = print_asm;
+    compiler.optimize = peephole;
+    for (i = 0; i < disabled_pattern_amt; i++) {
+        if (!PeepholeSetEnabled(&compiler.peephole, disabled_patterns[i], false)) {
+            printf("Unknown peephole pattern '%s'\n", disabled_patterns[i]);
+        }
+    }
 
     CmCompileProgram(&compiler);
 
+    if (peephole_stats) {
+        printf("\n=== PEEPHOLE ===\n\n");
+        PeepholePrintStats(&compiler.peephole);
+    }
+
     CompilerDestroy();
 
-    LexerDestroy(&inst);
+    ArenaFree(&ast_arena);
+    LexerDestroy(&parser.lexer);
+    SourceRelease(&source);
 
     return 0;
 }
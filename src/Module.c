@@ -0,0 +1,640 @@
+#include "Module.h"
+#include "Source.h"
+#include "Intern.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// "ALPM" in a little endian file
+#define MODULE_MAGIC 0x4D504C41u
+#define MODULE_VERSION 2
+
+// marks a token without a literal
+#define MODULE_NONE UINT32_MAX
+
+// A module file is a ModuleHeader followed by the sections in ModuleSection order, every
+// section starting at a multiple of 8 bytes. Everything is stored in the byte order of the
+// machine that wrote it; a module from another machine fails the magic check and is rebuilt.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t source_hash;
+
+    uint32_t node_amt;
+    uint32_t child_amt;
+    uint32_t token_amt;
+    uint32_t literal_amt;
+    uint32_t text_size;
+
+    FlatIndex root;
+    uint32_t reserved;
+} ModuleHeader;
+
+typedef enum {
+    MS_NODES,
+    // the source position of every node's token, a LexerPosition for each node. Tokens are
+    // shared between nodes, so positions can not be stored with them.
+    MS_POSITIONS,
+    MS_CHILDREN,
+    MS_TOKENS,
+    MS_LITERALS,
+    MS_TEXT,
+
+    MS_COUNT,
+} ModuleSection;
+
+// the same as a FlatNode, without padding
+typedef struct {
+    uint32_t type;
+    uint32_t token;
+    FlatIndex a;
+    FlatIndex b;
+} ModuleNode;
+
+// Tokens are stored once for every distinct text. The lexer does not depend on context, so
+// tokens with the same text also have the same type, symbol and literal.
+typedef struct {
+    uint32_t type;
+
+    // the token's text, at an offset in the text section
+    uint32_t text;
+    uint32_t length;
+
+    // the text is the name of the token's symbol
+    uint32_t is_name;
+    // index into the literals section, or MODULE_NONE
+    uint32_t literal;
+} ModuleToken;
+
+typedef struct {
+    int64_t int_value;
+    double decimal_value;
+    uint32_t is_decimal;
+
+    // the decoded string, at an offset in the text section. MODULE_NONE for numbers.
+    uint32_t string;
+    uint32_t string_length;
+    uint32_t reserved;
+} ModuleLiteral;
+
+// the sections of a mapped module
+typedef struct {
+    const ModuleHeader *header;
+    const ModuleNode *nodes;
+    const LexerPosition *positions;
+    const FlatIndex *children;
+    const ModuleToken *tokens;
+    const ModuleLiteral *literals;
+    const char *text;
+} ModuleView;
+
+typedef struct {
+    char *data;
+    size_t size;
+    size_t buffer_size;
+} ModuleBuffer;
+
+static size_t Align8(size_t size)
+{
+    return (size + 7) & ~(size_t)7;
+}
+
+/**
+    Find the offset of every section in a module with the counts in `header`.
+    @return the size of the whole module.
+*/
+static size_t ModuleLayout(const ModuleHeader *header, size_t offsets[MS_COUNT])
+{
+    const size_t sizes[MS_COUNT] = {
+        [MS_NODES] = sizeof(ModuleNode) * (size_t)header->node_amt,
+        [MS_POSITIONS] = sizeof(LexerPosition) * (size_t)header->node_amt,
+        [MS_CHILDREN] = sizeof(FlatIndex) * (size_t)header->child_amt,
+        [MS_TOKENS] = sizeof(ModuleToken) * (size_t)header->token_amt,
+        [MS_LITERALS] = sizeof(ModuleLiteral) * (size_t)header->literal_amt,
+        [MS_TEXT] = header->text_size,
+    };
+
+    size_t offset = Align8(sizeof(ModuleHeader));
+
+    int i;
+    for (i = 0; i < MS_COUNT; i++) {
+        offsets[i] = offset;
+        offset = Align8(offset + sizes[i]);
+    }
+    return offset;
+}
+
+uint64_t ModuleHash(const char *data, size_t size)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    size_t i;
+    for (i = 0; i < size; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+
+//////////////////////////////
+// Writing
+//////////////////////////////
+
+/**
+    Append bytes to a buffer.
+    @return the offset of the bytes in the buffer.
+*/
+static size_t BufferAppend(ModuleBuffer *buffer, const void *data, size_t size)
+{
+    if (buffer->size + size > buffer->buffer_size) {
+        while (buffer->size + size > buffer->buffer_size) {
+            buffer->buffer_size = buffer->buffer_size ? buffer->buffer_size * 2 : 4096;
+        }
+        buffer->data = realloc(buffer->data, buffer->buffer_size);
+    }
+
+    const size_t offset = buffer->size;
+    if (size > 0) {
+        memcpy(buffer->data + offset, data, size);
+    }
+    buffer->size += size;
+    return offset;
+}
+
+static bool WriteSection(FILE *fp, size_t offset, const void *data, size_t size)
+{
+    static const char padding[8] = { 0 };
+
+    const long position = ftell(fp);
+    if (position < 0 || (size_t)position > offset) {
+        return false;
+    }
+    if (fwrite(padding, 1, offset - (size_t)position, fp) != offset - (size_t)position) {
+        return false;
+    }
+    return size == 0 || fwrite(data, 1, size, fp) == size;
+}
+
+bool ModuleWrite(const char *path, const FlatAst *flat, uint64_t source_hash)
+{
+    ModuleBuffer sections[MS_COUNT];
+    memset(sections, 0, sizeof(sections));
+
+    // local ids of the distinct token texts, the id minus one is the index of the token
+    InternTable *texts = InternTableCreate();
+    uint32_t *token_map = (uint32_t *)malloc(sizeof(uint32_t) * (flat->token_amt + 1));
+
+    uint32_t i;
+    for (i = 0; i < flat->token_amt; i++) {
+        const Token *token = flat->tokens[i];
+        const int length = (int)(token->end - token->start);
+
+        const uint32_t amt_before = InternTableCount(texts);
+        token_map[i] = InternTableAdd(texts, token->start, length) - 1;
+        if (InternTableCount(texts) == amt_before) {
+            continue;
+        }
+
+        ModuleToken written;
+        written.type = token->type;
+        written.text = (uint32_t)BufferAppend(&sections[MS_TEXT], token->start, length);
+        written.length = (uint32_t)length;
+        written.is_name = (token->symbol != SYM_NONE);
+        written.literal = MODULE_NONE;
+
+        const LexerLiteral *literal = token->literal;
+        if (literal != NULL) {
+            ModuleLiteral literal_entry;
+            memset(&literal_entry, 0, sizeof(ModuleLiteral));
+            literal_entry.int_value = literal->int_value;
+            literal_entry.decimal_value = literal->decimal_value;
+            literal_entry.is_decimal = literal->is_decimal;
+            literal_entry.string = MODULE_NONE;
+            if (literal->string != NULL) {
+                literal_entry.string = (uint32_t)BufferAppend(&sections[MS_TEXT], literal->string, literal->string_length);
+                literal_entry.string_length = (uint32_t)literal->string_length;
+            }
+
+            written.literal = (uint32_t)(sections[MS_LITERALS].size / sizeof(ModuleLiteral));
+            BufferAppend(&sections[MS_LITERALS], &literal_entry, sizeof(ModuleLiteral));
+        }
+
+        BufferAppend(&sections[MS_TOKENS], &written, sizeof(ModuleToken));
+    }
+    InternTableDestroy(texts);
+
+    for (i = 0; i < flat->node_amt; i++) {
+        const FlatNode *node = &flat->nodes[i];
+        const uint32_t token = (node->token == FLAT_NONE) ? FLAT_NONE : token_map[node->token];
+        const ModuleNode written = { node->type, token, node->a, node->b };
+        BufferAppend(&sections[MS_NODES], &written, sizeof(ModuleNode));
+
+        // the lexer of the source is still alive, so errors in a loaded module can point into it
+        LexerPosition position = { 0, 0 };
+        int line, col;
+        if (node->token != FLAT_NONE && LexerTokenPosition(flat->tokens[node->token], &line, &col)) {
+            position.line = (uint32_t)line;
+            position.col = (uint32_t)col;
+        }
+        BufferAppend(&sections[MS_POSITIONS], &position, sizeof(LexerPosition));
+    }
+    BufferAppend(&sections[MS_CHILDREN], flat->children, sizeof(FlatIndex) * flat->child_amt);
+    free(token_map);
+
+    ModuleHeader header;
+    memset(&header, 0, sizeof(ModuleHeader));
+    header.magic = MODULE_MAGIC;
+    header.version = MODULE_VERSION;
+    header.source_hash = source_hash;
+    header.node_amt = flat->node_amt;
+    header.child_amt = flat->child_amt;
+    header.token_amt = (uint32_t)(sections[MS_TOKENS].size / sizeof(ModuleToken));
+    header.literal_amt = (uint32_t)(sections[MS_LITERALS].size / sizeof(ModuleLiteral));
+    header.text_size = (uint32_t)sections[MS_TEXT].size;
+    header.root = flat->root;
+
+    size_t offsets[MS_COUNT];
+    const size_t module_size = ModuleLayout(&header, offsets);
+
+    // write next to the module and move it in place, so that a module is never seen half written
+    char temp_path[SOURCE_PATH_MAX + 8];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    bool written = sections[MS_TEXT].size <= UINT32_MAX;
+    FILE *fp = written ? fopen(temp_path, "wb") : NULL;
+    written = (fp != NULL) && fwrite(&header, sizeof(ModuleHeader), 1, fp) == 1;
+
+    int section;
+    for (section = 0; section < MS_COUNT && written; section++) {
+        written = WriteSection(fp, offsets[section], sections[section].data, sections[section].size);
+    }
+    written = written && WriteSection(fp, module_size, NULL, 0);
+
+    if (fp != NULL) {
+        written = (fclose(fp) == 0) && written;
+        written = written && rename(temp_path, path) == 0;
+        if (!written) {
+            remove(temp_path);
+        }
+    }
+
+    for (section = 0; section < MS_COUNT; section++) {
+        free(sections[section].data);
+    }
+    return written;
+}
+
+
+//////////////////////////////
+// Loading
+//////////////////////////////
+
+typedef struct {
+    ModuleView view;
+    Arena *arena;
+    Token *tokens;
+    // a copy of its token for every node, so that each can be given the node's position
+    Token *node_tokens;
+} ModuleLoader;
+
+static bool InText(const ModuleHeader *header, uint32_t offset, uint32_t length)
+{
+    return (uint64_t)offset + length <= header->text_size;
+}
+
+/**
+    Check that a child index points to a node after its parent, which keeps the tree free of
+    cycles. FLAT_NONE is only allowed when `optional` is set.
+*/
+static bool ValidChild(const ModuleHeader *header, FlatIndex parent, FlatIndex child, bool optional)
+{
+    if (child == FLAT_NONE) {
+        return optional;
+    }
+    return child > parent && child < header->node_amt;
+}
+
+/**
+    Map the sections of a module and check that every index in it is in bounds, so that a
+    damaged module can not make loading read outside of it.
+*/
+static bool ModuleOpen(ModuleView *view, const char *data, size_t size, uint64_t source_hash)
+{
+    const ModuleHeader *header = (const ModuleHeader *)data;
+    if (size < sizeof(ModuleHeader) || header->magic != MODULE_MAGIC || header->version != MODULE_VERSION
+        || header->source_hash != source_hash) {
+        return false;
+    }
+
+    size_t offsets[MS_COUNT];
+    if (ModuleLayout(header, offsets) > size) {
+        return false;
+    }
+
+    view->header = header;
+    view->nodes = (const ModuleNode *)(data + offsets[MS_NODES]);
+    view->positions = (const LexerPosition *)(data + offsets[MS_POSITIONS]);
+    view->children = (const FlatIndex *)(data + offsets[MS_CHILDREN]);
+    view->tokens = (const ModuleToken *)(data + offsets[MS_TOKENS]);
+    view->literals = (const ModuleLiteral *)(data + offsets[MS_LITERALS]);
+    view->text = data + offsets[MS_TEXT];
+
+    uint32_t i;
+    for (i = 0; i < header->literal_amt; i++) {
+        const ModuleLiteral *literal = &view->literals[i];
+        if (literal->string != MODULE_NONE && !InText(header, literal->string, literal->string_length)) {
+            return false;
+        }
+    }
+    for (i = 0; i < header->token_amt; i++) {
+        const ModuleToken *token = &view->tokens[i];
+        if (!InText(header, token->text, token->length)
+            || (token->literal != MODULE_NONE && token->literal >= header->literal_amt)) {
+            return false;
+        }
+    }
+
+    if (header->root >= header->node_amt || view->nodes[header->root].type != NT_BLOCK) {
+        return false;
+    }
+
+    for (i = 0; i < header->node_amt; i++) {
+        const ModuleNode *node = &view->nodes[i];
+        bool valid = true;
+
+        if (node->token != FLAT_NONE && node->token >= header->token_amt) {
+            return false;
+        }
+
+        switch ((NodeType)node->type) {
+            case NT_LITERAL:
+            case NT_VAR:
+                valid = node->token != FLAT_NONE;
+                break;
+
+            case NT_UNARYOP:
+            case NT_DECLARE:
+                valid = node->token != FLAT_NONE && ValidChild(header, i, node->a, false);
+                break;
+
+            case NT_RETURN:
+                valid = ValidChild(header, i, node->a, false);
+                break;
+
+            case NT_BINOP:
+            case NT_ASSIGN:
+                valid = node->token != FLAT_NONE && ValidChild(header, i, node->a, false)
+                    && ValidChild(header, i, node->b, false);
+                break;
+
+            case NT_BLOCK:
+            case NT_FUNC_CALL:
+            case NT_FUNC_DECLARE: {
+                if (node->type == NT_FUNC_CALL && node->token == FLAT_NONE) {
+                    return false;
+                }
+                if (node->type == NT_FUNC_DECLARE && node->b < FLAT_FUNC_ARGUMENTS) {
+                    return false;
+                }
+                if ((uint64_t)node->a + node->b > header->child_amt) {
+                    return false;
+                }
+
+                uint32_t j;
+                for (j = 0; j < node->b && valid; j++) {
+                    const bool optional = (node->type == NT_FUNC_DECLARE && j == FLAT_FUNC_BLOCK);
+                    valid = ValidChild(header, i, view->children[node->a + j], optional);
+                }
+                break;
+            }
+
+            default:
+                valid = false;
+                break;
+        }
+
+        if (!valid) {
+            return false;
+        }
+    }
+
+    // the parts of a function declaration are accessed as their own node types
+    for (i = 0; i < header->node_amt; i++) {
+        const ModuleNode *node = &view->nodes[i];
+        if (node->type != NT_FUNC_DECLARE) {
+            continue;
+        }
+
+        const FlatIndex *children = &view->children[node->a];
+        const ModuleNode *declaration = &view->nodes[children[FLAT_FUNC_DECLARATION]];
+        if (declaration->type != NT_DECLARE || view->nodes[declaration->a].type != NT_VAR) {
+            return false;
+        }
+        if (children[FLAT_FUNC_BLOCK] != FLAT_NONE && view->nodes[children[FLAT_FUNC_BLOCK]].type != NT_BLOCK) {
+            return false;
+        }
+
+        uint32_t j;
+        for (j = FLAT_FUNC_ARGUMENTS; j < node->b; j++) {
+            if (view->nodes[children[j]].type != NT_DECLARE) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static Node *AllocNode(ModuleLoader *loader, size_t size, NodeType type)
+{
+    Node *node = (Node *)ArenaAlloc(loader->arena, size);
+    memset(node, 0, size);
+    node->type = type;
+    return node;
+}
+
+#define NewNode(loader_, ntype_, type_) ((ntype_ *)AllocNode((loader_), sizeof(ntype_), (type_)))
+
+static Node *InflateNode(ModuleLoader *loader, FlatIndex index);
+
+static Node **InflateRange(ModuleLoader *loader, const FlatIndex *children, uint32_t count)
+{
+    if (count == 0) {
+        return NULL;
+    }
+
+    Node **nodes = (Node **)ArenaAlloc(loader->arena, sizeof(Node *) * count);
+
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        nodes[i] = InflateNode(loader, children[i]);
+    }
+    return nodes;
+}
+
+/**
+    Build the node at `index` and everything under it.
+*/
+static Node *InflateNode(ModuleLoader *loader, FlatIndex index)
+{
+    if (index == FLAT_NONE) {
+        return NULL;
+    }
+
+    const ModuleNode *node = &loader->view.nodes[index];
+    Token *token = NULL;
+    if (node->token != FLAT_NONE) {
+        token = &loader->node_tokens[index];
+        *token = loader->tokens[node->token];
+    }
+    const FlatIndex *children = &loader->view.children[node->a];
+
+    switch ((NodeType)node->type) {
+        case NT_LITERAL: {
+            NodeLiteral *literal = NewNode(loader, NodeLiteral, NT_LITERAL);
+            literal->token = token;
+            return (Node *)literal;
+        }
+
+        case NT_VAR: {
+            NodeVar *var = NewNode(loader, NodeVar, NT_VAR);
+            var->value = token;
+            return (Node *)var;
+        }
+
+        case NT_UNARYOP: {
+            NodeUnaryOp *unary = NewNode(loader, NodeUnaryOp, NT_UNARYOP);
+            unary->op = token;
+            unary->node = InflateNode(loader, node->a);
+            return (Node *)unary;
+        }
+
+        case NT_BINOP: {
+            NodeBinOp *binop = NewNode(loader, NodeBinOp, NT_BINOP);
+            binop->op = token;
+            binop->left = InflateNode(loader, node->a);
+            binop->right = InflateNode(loader, node->b);
+            return (Node *)binop;
+        }
+
+        case NT_ASSIGN: {
+            NodeAssign *assign = NewNode(loader, NodeAssign, NT_ASSIGN);
+            assign->op = token;
+            assign->left = InflateNode(loader, node->a);
+            assign->right = InflateNode(loader, node->b);
+            return (Node *)assign;
+        }
+
+        case NT_DECLARE: {
+            NodeDeclare *declare = NewNode(loader, NodeDeclare, NT_DECLARE);
+            declare->type = token;
+            declare->variable = InflateNode(loader, node->a);
+            return (Node *)declare;
+        }
+
+        case NT_RETURN: {
+            NodeReturn *ret = NewNode(loader, NodeReturn, NT_RETURN);
+            ret->value = InflateNode(loader, node->a);
+            return (Node *)ret;
+        }
+
+        case NT_BLOCK: {
+            NodeBlock *block = NewNode(loader, NodeBlock, NT_BLOCK);
+            block->statements = InflateRange(loader, children, node->b);
+            block->statement_count = (int)node->b;
+            block->statement_buf_size = (int)node->b;
+            return (Node *)block;
+        }
+
+        case NT_FUNC_CALL: {
+            NodeFuncCall *call = NewNode(loader, NodeFuncCall, NT_FUNC_CALL);
+            call->func = NewNode(loader, NodeVar, NT_VAR);
+            call->func->value = token;
+            call->arguments = InflateRange(loader, children, node->b);
+            call->argument_count = (int)node->b;
+            return (Node *)call;
+        }
+
+        case NT_FUNC_DECLARE: {
+            NodeFuncDeclare *fdecl = NewNode(loader, NodeFuncDeclare, NT_FUNC_DECLARE);
+            fdecl->declaration = (NodeDeclare *)InflateNode(loader, children[FLAT_FUNC_DECLARATION]);
+            fdecl->block = (NodeBlock *)InflateNode(loader, children[FLAT_FUNC_BLOCK]);
+            fdecl->argument_count = (int)(node->b - FLAT_FUNC_ARGUMENTS);
+            fdecl->arguments = (NodeDeclare **)InflateRange(loader, children + FLAT_FUNC_ARGUMENTS, fdecl->argument_count);
+            return (Node *)fdecl;
+        }
+    }
+    return NULL;
+}
+
+static void ReleasePositions(void *arg)
+{
+    LexerRemovePositions((LexerPositionTable *)arg);
+}
+
+static void ReleaseModule(void *arg)
+{
+    SourceRelease((Source *)arg);
+}
+
+Node *ModuleLoad(const char *path, uint64_t source_hash, Arena *arena)
+{
+    Source file;
+    if (!SourceLoad(&file, path)) {
+        return NULL;
+    }
+
+    ModuleLoader loader;
+    if (!ModuleOpen(&loader.view, file.data, file.size, source_hash)) {
+        SourceRelease(&file);
+        return NULL;
+    }
+    loader.arena = arena;
+
+    const ModuleHeader *header = loader.view.header;
+    const char *text = loader.view.text;
+
+    uint32_t i;
+    LexerLiteral *literals = (LexerLiteral *)ArenaAlloc(arena, sizeof(LexerLiteral) * (header->literal_amt + 1));
+    for (i = 0; i < header->literal_amt; i++) {
+        const ModuleLiteral *from = &loader.view.literals[i];
+        literals[i].int_value = from->int_value;
+        literals[i].decimal_value = from->decimal_value;
+        literals[i].is_decimal = from->is_decimal != 0;
+        literals[i].string = (from->string == MODULE_NONE) ? NULL : text + from->string;
+        literals[i].string_length = (int)from->string_length;
+    }
+
+    // tokens point straight into the mapped text. Every token is distinct, so every name is
+    // only interned once.
+    loader.tokens = (Token *)ArenaAlloc(arena, sizeof(Token) * (header->token_amt + 1));
+    for (i = 0; i < header->token_amt; i++) {
+        const ModuleToken *from = &loader.view.tokens[i];
+        Token *token = &loader.tokens[i];
+
+        token->start = (char *)text + from->text;
+        token->end = token->start + from->length;
+        token->type = (TokenType)from->type;
+        token->symbol = from->is_name ? InternString(token->start, (int)from->length) : SYM_NONE;
+        token->literal = (from->literal == MODULE_NONE) ? NULL : &literals[from->literal];
+    }
+
+    loader.node_tokens = (Token *)ArenaAlloc(arena, sizeof(Token) * (header->node_amt + 1));
+    Node *root = InflateNode(&loader, header->root);
+
+    // cleanups run last to first, so the positions are unregistered before they are unmapped
+    Source *mapping = (Source *)ArenaAlloc(arena, sizeof(Source));
+    *mapping = file;
+    ArenaOnFree(arena, ReleaseModule, mapping);
+
+    LexerPositionTable *positions = (LexerPositionTable *)ArenaAlloc(arena, sizeof(LexerPositionTable));
+    positions->tokens = loader.node_tokens;
+    positions->positions = loader.view.positions;
+    positions->token_count = header->node_amt;
+    LexerAddPositions(positions);
+    ArenaOnFree(arena, ReleasePositions, positions);
+
+    return root;
+}
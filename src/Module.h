@@ -0,0 +1,35 @@
+#ifndef CML_MODULE_H
+#define CML_MODULE_H
+
+#include "FlatAst.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Precompiled modules. A module holds the parsed AST of one source file, with names and
+// decoded literals, so that the file does not have to be lexed and parsed again on later runs.
+// Modules are loaded by mapping them and building the AST straight from the mapping. They carry
+// a hash of the source they were built from, so a module is ignored once the source changes.
+
+#define MODULE_EXTENSION ".alpm"
+
+/**
+    Hash the contents of a source file, to tell whether a module was built from it.
+*/
+uint64_t ModuleHash(const char *data, size_t size);
+
+/**
+    Write the tree under `flat->root` to a module file.
+    @return false if the file could not be written.
+*/
+bool ModuleWrite(const char *path, const FlatAst *flat, uint64_t source_hash);
+
+/**
+    Load the AST in a module file. The nodes, tokens and literals are allocated from `arena`, and
+    the mapping of the file stays alive until the arena is freed.
+    @return NULL if the module does not exist, was built from a different source or is damaged.
+*/
+Node *ModuleLoad(const char *path, uint64_t source_hash, Arena *arena);
+
+#endif
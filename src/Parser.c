@@ -1,5 +1,9 @@
 #include "Parser.h"
 #include "Lexer.h"
+#include "Source.h"
+#include "ThreadPool.h"
+#include "FlatAst.h"
+#include "Module.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,24 +14,63 @@ Node *ParseAssignment(Parser *pr, NodeVar *override_var);
 Node *ParseVariable(Parser *pr);
 NodeFuncDeclare *ParseFuncDeclaration(Parser *pr);
 Node *ParseDeclaration(Parser *pr);
-Node *ParseFactor(Parser *pr);
+Node *ParsePrimary(Parser *pr);
 Node *ParseFuncCall(Parser *pr);
 
-Parser ParserInit(Lexer lexer)
+Token *CurrentToken(Parser *parser);
+
+Parser ParserInit(Lexer lexer, Arena *arena)
 {
     Parser parser;
     parser.lexer = lexer;
+    parser.arena = arena;
+
+    // pulled tokens only need their literals while they are in the ring, kept tokens get a copy
+    if (lexer.token_offsets == NULL) {
+        parser.lexer.literal_window = PARSER_TOKEN_RING_SIZE;
+    }
     parser.token_index = 0;
+    parser.tokens_lexed = 0;
+    parser.kept_tokens = NULL;
+    parser.kept_tokens_left = 0;
+
+    parser.includes = NULL;
+    parser.include_threads = 1;
+    parser.use_modules = false;
+    parser.keep_includes = false;
+    parser.lazy_bodies = false;
+    parser.lazy_lexer = NULL;
+
+    parser.defer_includes = false;
+    parser.include_sites = NULL;
+    parser.include_site_amt = 0;
+    parser.include_sites_parsed = 0;
+
+    parser.newly_declared_var = NULL;
+
+    parser.expr_ops = NULL;
+    parser.expr_op_amt = 0;
+    parser.expr_op_buffer_size = 0;
+    parser.expr_operands = NULL;
+    parser.expr_operand_amt = 0;
+    parser.expr_operand_buffer_size = 0;
     return parser;
 }
 
 static void ThrowError(Parser *pr, char *msg, ...)
 {
-    Token *token = &pr->lexer.tokens[pr->token_index];
+    Token *token = CurrentToken(pr);
+
+    int line, col;
 
     va_list ap;
     va_start(ap, msg);
-    printf("[ERROR] [%d,%d]: ", token->file_line, token->file_col);
+    if (LexerTokenPosition(token, &line, &col)) {
+        printf("[ERROR] [%d,%d]: ", line, col);
+    }
+    else {
+        printf("[ERROR]: ");
+    }
     vprintf(msg, ap);
     va_end(ap);
 
@@ -45,34 +88,82 @@ void CheckExpect(Parser *pr, Token *token, TokenType type)
     exit(1);
 }
 
+/**
+    Get a token from the ring buffer, pulling tokens from the lexer until it has been lexed.
+    When the lexer was already run with LexerLex, tokens are read from its store instead.
+*/
+static Token *FetchToken(Parser *parser, int index)
+{
+    while (parser->tokens_lexed <= index) {
+        Token *token = &parser->token_ring[parser->tokens_lexed % PARSER_TOKEN_RING_SIZE];
+
+        if (parser->lexer.token_offsets != NULL) {
+            *token = LexerGetToken(&parser->lexer, parser->tokens_lexed);
+        }
+        else {
+            LexerNext(&parser->lexer, token);
+        }
+        parser->tokens_lexed++;
+    }
+    return &parser->token_ring[index % PARSER_TOKEN_RING_SIZE];
+}
+
+/**
+    Copy a token out of the ring buffer so that a node can reference it.
+*/
+static Token *KeepToken(Parser *parser, Token *token)
+{
+    if (parser->kept_tokens_left == 0) {
+        parser->kept_tokens = ArenaAlloc(parser->arena, sizeof(Token) * PARSER_KEPT_TOKEN_CHUNK);
+        parser->kept_tokens_left = PARSER_KEPT_TOKEN_CHUNK;
+    }
+
+    Token *kept = parser->kept_tokens++;
+    parser->kept_tokens_left--;
+
+    *kept = *token;
+
+    // the lexer reuses the literals of pulled tokens once they leave the ring
+    if (kept->literal != NULL && parser->lexer.literal_window != 0) {
+        LexerLiteral *literal = ArenaAlloc(parser->arena, sizeof(LexerLiteral));
+        *literal = *kept->literal;
+        kept->literal = literal;
+    }
+    return kept;
+}
+
 Token *EatRaw(Parser *parser)
 {
-    Token *token = &parser->lexer.tokens[parser->token_index++];
+    Token *token = FetchToken(parser, parser->token_index++);
     return token;
 }
 
 Token *Eat(Parser *parser, TokenType expect)
 {
-    Token *token = &parser->lexer.tokens[parser->token_index++];
+    Token *token = FetchToken(parser, parser->token_index++);
     CheckExpect(parser, token, expect);
     return token;
 }
 
 Token *CurrentToken(Parser *parser)
 {
-    return &parser->lexer.tokens[parser->token_index];
+    return FetchToken(parser, parser->token_index);
 }
 
 Token *PeekToken(Parser *parser, int peek)
 {
-    return &parser->lexer.tokens[parser->token_index + peek];
+    if (peek > PARSER_MAX_LOOKAHEAD) {
+        ThrowError(parser, "Peeking %d tokens ahead, past PARSER_MAX_LOOKAHEAD!\n", peek);
+    }
+    return FetchToken(parser, parser->token_index + peek);
 }
 
 // node creation functions
 
-#define NewN(ntype, name) ntype *name = (ntype *)malloc(sizeof(ntype))
+// nodes are allocated in the parser's arena and freed with it
+#define NewN(ntype, name) ntype *name = (ntype *)ArenaAlloc(pr->arena, sizeof(ntype))
 
-NodeBinOp *NewBinOp()
+NodeBinOp *NewBinOp(Parser *pr)
 {
     NewN(NodeBinOp, node);
 
@@ -84,7 +175,7 @@ NodeBinOp *NewBinOp()
     return node;
 }
 
-NodeLiteral *NewLiteral()
+NodeLiteral *NewLiteral(Parser *pr)
 {
     NewN(NodeLiteral, node);
 
@@ -94,7 +185,7 @@ NodeLiteral *NewLiteral()
     return node;
 }
 
-NodeUnaryOp *NewUnaryOp()
+NodeUnaryOp *NewUnaryOp(Parser *pr)
 {
     NewN(NodeUnaryOp, node);
 
@@ -105,19 +196,19 @@ NodeUnaryOp *NewUnaryOp()
     return node;
 }
 
-NodeBlock *NewBlock()
+NodeBlock *NewBlock(Parser *pr)
 {
     NewN(NodeBlock, node);
 
     node->base.type = NT_BLOCK;
     node->statement_buf_size = 64;
-    node->statements = malloc(sizeof(Node *) * node->statement_buf_size);
+    node->statements = ArenaAlloc(pr->arena, sizeof(Node *) * node->statement_buf_size);
     node->statement_count = 0;
 
     return node;
 }
 
-NodeAssign *NewAssign()
+NodeAssign *NewAssign(Parser *pr)
 {
     NewN(NodeAssign, node);
 
@@ -128,17 +219,18 @@ NodeAssign *NewAssign()
     return node;
 }
 
-NodeVar *NewVar()
+NodeVar *NewVar(Parser *pr)
 {
     NewN(NodeVar, node);
 
     node->base.type = NT_VAR;
     node->value = NULL;
+    node->var = VAR_NONE;
 
     return node;
 }
 
-NodeDeclare *NewDeclare()
+NodeDeclare *NewDeclare(Parser *pr)
 {
     NewN(NodeDeclare, node);
 
@@ -149,7 +241,7 @@ NodeDeclare *NewDeclare()
     return node;
 }
 
-NodeFuncDeclare *NewFuncDeclare()
+NodeFuncDeclare *NewFuncDeclare(Parser *pr)
 {
     NewN(NodeFuncDeclare, node);
 
@@ -158,11 +250,12 @@ NodeFuncDeclare *NewFuncDeclare()
     node->arguments = NULL;
     node->argument_count = 0;
     node->block = NULL;
+    node->lazy_body = NULL;
 
     return node;
 }
 
-NodeReturn *NewReturn()
+NodeReturn *NewReturn(Parser *pr)
 {
     NewN(NodeReturn, node);
 
@@ -172,7 +265,7 @@ NodeReturn *NewReturn()
     return node;
 }
 
-NodeFuncCall *NewFuncCall()
+NodeFuncCall *NewFuncCall(Parser *pr)
 {
     NewN(NodeFuncCall, node);
 
@@ -185,89 +278,198 @@ NodeFuncCall *NewFuncCall()
 }
 
 
-Node *ParseTerm(Parser *pr)
+typedef struct {
+    // how tightly the operator binds, higher binds tighter. 0 for tokens that are not operators.
+    unsigned char precedence;
+    bool right_assoc;
+} ParserBinaryOp;
+
+// Binary operators by token type. Unary operators bind tighter than all of them.
+static const ParserBinaryOp binary_operators[] = {
+    [TT_PLUS]  = { 1, false },
+    [TT_MINUS] = { 1, false },
+    [TT_STAR]  = { 2, false },
+    [TT_SLASH] = { 2, false },
+};
+
+static const bool unary_operators[] = {
+    [TT_PLUS] = true,
+    [TT_MINUS] = true,
+};
+
+#define TableHas(table_, type_) ((type_) < sizeof(table_) / sizeof((table_)[0]))
+
+static const ParserBinaryOp *GetBinaryOp(TokenType type)
 {
-    Node *node = ParseFactor(pr);
+    if (!TableHas(binary_operators, type) || binary_operators[type].precedence == 0) {
+        return NULL;
+    }
+    return &binary_operators[type];
+}
 
-    Token *ctok;
+static bool IsUnaryOp(TokenType type)
+{
+    return TableHas(unary_operators, type) && unary_operators[type];
+}
 
-    while ((ctok = CurrentToken(pr)) && (ctok->type == TT_STAR || ctok->type == TT_SLASH)) {
-        if (ctok->type == TT_STAR) {
-            Eat(pr, TT_STAR);
-        }
-        else if (ctok->type == TT_SLASH) {
-            Eat(pr, TT_SLASH);
-        }
+static void PushExprOp(Parser *pr, ParserExprOpKind kind, Token *op, int precedence)
+{
+    if (pr->expr_op_amt == pr->expr_op_buffer_size) {
+        const int new_size = pr->expr_op_buffer_size ? pr->expr_op_buffer_size * 2 : PARSER_EXPR_STACK_START;
+        pr->expr_ops = ArenaRealloc(
+            pr->arena, pr->expr_ops,
+            sizeof(ParserExprOp) * pr->expr_op_buffer_size, sizeof(ParserExprOp) * new_size
+        );
+        pr->expr_op_buffer_size = new_size;
+    }
 
-        NodeBinOp *dir_node = NewBinOp();
-        dir_node->left = node;
-        dir_node->op = ctok;
-        dir_node->right = ParseFactor(pr);
-        node = (Node *)dir_node;
+    ParserExprOp *entry = &pr->expr_ops[pr->expr_op_amt++];
+    entry->op = op;
+    entry->kind = kind;
+    entry->precedence = precedence;
+}
+
+static void PushExprOperand(Parser *pr, Node *node)
+{
+    if (pr->expr_operand_amt == pr->expr_operand_buffer_size) {
+        const int new_size = pr->expr_operand_buffer_size ? pr->expr_operand_buffer_size * 2 : PARSER_EXPR_STACK_START;
+        pr->expr_operands = ArenaRealloc(
+            pr->arena, pr->expr_operands,
+            sizeof(Node *) * pr->expr_operand_buffer_size, sizeof(Node *) * new_size
+        );
+        pr->expr_operand_buffer_size = new_size;
     }
+    pr->expr_operands[pr->expr_operand_amt++] = node;
+}
 
-    return node;
+/**
+    Pop the top operator and apply it to the operands on top of the operand stack.
+*/
+static void ReduceExprOp(Parser *pr)
+{
+    ParserExprOp *entry = &pr->expr_ops[--pr->expr_op_amt];
+
+    if (entry->kind == PEO_UNARY) {
+        NodeUnaryOp *node = NewUnaryOp(pr);
+        node->op = entry->op;
+        node->node = pr->expr_operands[pr->expr_operand_amt - 1];
+        pr->expr_operands[pr->expr_operand_amt - 1] = (Node *)node;
+    }
+    else {
+        NodeBinOp *node = NewBinOp(pr);
+        node->right = pr->expr_operands[--pr->expr_operand_amt];
+        node->op = entry->op;
+        node->left = pr->expr_operands[pr->expr_operand_amt - 1];
+        pr->expr_operands[pr->expr_operand_amt - 1] = (Node *)node;
+    }
 }
 
+/**
+    Parse an expression with precedence climbing over explicit stacks, so that deeply nested
+    parentheses and unary operators do not recurse.
+*/
 Node *ParseExpr(Parser *pr)
 {
-    Node *node = ParseTerm(pr);
+    // entries below these belong to the expressions this one is nested in
+    const int op_base = pr->expr_op_amt;
+    const int operand_base = pr->expr_operand_amt;
 
-    Token *ctok;
+    for (;;) {
+        // expecting an operand, after any amount of unary operators and opening parentheses
+        Token *tk = CurrentToken(pr);
 
-    while ((ctok = CurrentToken(pr)) && (ctok->type == TT_PLUS || ctok->type == TT_MINUS)) {
-        if (ctok->type == TT_PLUS) {
-            Eat(pr, TT_PLUS);
+        if (IsUnaryOp(tk->type)) {
+            PushExprOp(pr, PEO_UNARY, KeepToken(pr, EatRaw(pr)), 0);
+            continue;
         }
-        else if (ctok->type == TT_MINUS) {
-            Eat(pr, TT_MINUS);
+        if (tk->type == TT_LPAREN) {
+            Eat(pr, TT_LPAREN);
+            PushExprOp(pr, PEO_PAREN, NULL, 0);
+            continue;
         }
 
-        NodeBinOp *dir_node = NewBinOp();
+        PushExprOperand(pr, ParsePrimary(pr));
+
+        // expecting an operator, after any amount of closing parentheses
+        for (;;) {
+            tk = CurrentToken(pr);
+
+            if (tk->type == TT_RPAREN && pr->expr_op_amt > op_base) {
+                while (pr->expr_ops[pr->expr_op_amt - 1].kind != PEO_PAREN) {
+                    ReduceExprOp(pr);
+                    if (pr->expr_op_amt == op_base) {
+                        break;
+                    }
+                }
+                // the parenthesis belongs to an enclosing function call
+                if (pr->expr_op_amt == op_base) {
+                    break;
+                }
+                pr->expr_op_amt--;
+                Eat(pr, TT_RPAREN);
+                continue;
+            }
+            break;
+        }
 
-        dir_node->left = node;
-        dir_node->op = ctok;
-        dir_node->right = ParseTerm(pr);
+        const ParserBinaryOp *binary = GetBinaryOp(tk->type);
+        if (binary == NULL) {
+            break;
+        }
+
+        // unary operators and tighter binding binary operators are applied first
+        while (pr->expr_op_amt > op_base) {
+            const ParserExprOp *top = &pr->expr_ops[pr->expr_op_amt - 1];
+            if (top->kind == PEO_PAREN) {
+                break;
+            }
+            if (top->kind == PEO_BINARY) {
+                if (top->precedence < binary->precedence) {
+                    break;
+                }
+                if (top->precedence == binary->precedence && binary->right_assoc) {
+                    break;
+                }
+            }
+            ReduceExprOp(pr);
+        }
+
+        PushExprOp(pr, PEO_BINARY, KeepToken(pr, EatRaw(pr)), binary->precedence);
+    }
 
-        node = (Node *)dir_node;
+    // end of the expression
+    while (pr->expr_op_amt > op_base) {
+        if (pr->expr_ops[pr->expr_op_amt - 1].kind == PEO_PAREN) {
+            Eat(pr, TT_RPAREN);
+        }
+        ReduceExprOp(pr);
     }
 
+    Node *node = pr->expr_operands[operand_base];
+    pr->expr_operand_amt = operand_base;
     return node;
 }
 
-Node *ParseFactor(Parser *pr)
+/**
+    Parse a literal, variable or function call.
+*/
+Node *ParsePrimary(Parser *pr)
 {
     Token *tk = CurrentToken(pr);
 
-    if (tk->type == TT_PLUS || tk->type == TT_MINUS) {
-        EatRaw(pr);
-
-        NodeUnaryOp *node = NewUnaryOp();
-        node->op = tk;
-        node->node = ParseFactor(pr);
-        return (Node *)node;
-    }
-    else if (tk->type == TT_NUMBER || tk->type == TT_STRING) {
+    if (tk->type == TT_NUMBER || tk->type == TT_STRING) {
         EatRaw(pr);
 
-        NodeLiteral *node = NewLiteral();
-        node->token = tk;
+        NodeLiteral *node = NewLiteral(pr);
+        node->token = KeepToken(pr, tk);
 
         return (Node *)node;
     }
-    else if (tk->type == TT_LPAREN) {
-        Eat(pr, TT_LPAREN);
-        Node *node = ParseExpr(pr);
-        Eat(pr, TT_RPAREN);
-        return node;
-    }
-    else {
-        if (PeekToken(pr, 1)->type == TT_LPAREN) {
-            return ParseFuncCall(pr);
-        }
-        return ParseVariable(pr);
+
+    if (PeekToken(pr, 1)->type == TT_LPAREN) {
+        return ParseFuncCall(pr);
     }
-    return NULL;
+    return ParseVariable(pr);
 }
 
 
@@ -276,7 +478,7 @@ Node *ParseBlock(Parser *pr);
 
 Node *ParseReturn(Parser *pr)
 {
-    NodeReturn *ret = NewReturn();
+    NodeReturn *ret = NewReturn(pr);
 
     Eat(pr, TT_KEYWORD);
 
@@ -288,33 +490,245 @@ Node *ParseReturn(Parser *pr)
 Node *ParseKeyword(Parser *pr)
 {
     Token *token = CurrentToken(pr);
-    if (!strncmp(token->start, "return", LexerTokenLength(token))) {
+    if (token->symbol == SYM_RETURN) {
         return ParseReturn(pr);
     }
     return NULL;
 }
 
-static char *LoadFile_(char *path) {
-    FILE *fp = fopen(path, "rb");
-    if (fp == NULL)
-        return NULL;
+// An included file, kept alive until the AST is freed since its nodes point into it
+typedef struct {
+    Source source;
+    Lexer lexer;
+} ParserInclude;
+
+static void FreeInclude(void *arg)
+{
+    ParserInclude *include = (ParserInclude *)arg;
+    LexerDestroy(&include->lexer);
+    SourceRelease(&include->source);
+}
+
+static void FreeIncludeCache(void *arg)
+{
+    ParserIncludeCache *cache = (ParserIncludeCache *)arg;
+    InternTableDestroy(cache->keys);
+}
+
+/**
+    Find the cache entry of a file, adding one if the file has not been included yet.
+    @return the index of the entry, or SYM_NONE if the file does not exist.
+*/
+static SymbolId FindInclude(Parser *pr, const char *path, bool *is_new)
+{
+    if (pr->includes == NULL) {
+        pr->includes = ArenaAlloc(pr->arena, sizeof(ParserIncludeCache));
+        pr->includes->keys = InternTableCreate();
+        ArenaOnFree(pr->arena, FreeIncludeCache, pr->includes);
+    }
+    ParserIncludeCache *cache = pr->includes;
+
+    SourceId id;
+    if (!SourceIdentify(path, &id)) {
+        return SYM_NONE;
+    }
+
+    // the key is the file id where the platform has one, as a file can have many canonical
+    // paths through hard links. The table does not copy keys, so they live in the arena.
+    uint64_t file_key[4] = { id.device, id.inode, (uint64_t)id.mtime, id.size };
+    const char *key = (const char *)file_key;
+    int key_length = sizeof(file_key);
+    if (id.inode == 0) {
+        key = id.path;
+        key_length = strlen(id.path);
+    }
+    char *kept_key = ArenaAlloc(pr->arena, key_length);
+    memcpy(kept_key, key, key_length);
+
+    const uint32_t amt_before = InternTableCount(cache->keys);
+    const SymbolId index = InternTableAdd(cache->keys, kept_key, key_length);
+    *is_new = (InternTableCount(cache->keys) != amt_before);
+    return index;
+}
+
+/**
+    Get the path token of an include, which must be a single string literal.
+*/
+static const Token *IncludePath(Parser *pr, NodeFuncCall *call)
+{
+    const Node *path = (call->argument_count == 1) ? call->arguments[0] : NULL;
+
+    if (path == NULL || path->type != NT_LITERAL || ((NodeLiteral *)path)->token->type != TT_STRING) {
+        ThrowError(pr, "The path of an include must be a string literal!\n");
+    }
+    return ((NodeLiteral *)path)->token;
+}
+
+/**
+    Match an include to the next site found by scanning the file. The included file is parsed
+    on its own and spliced into the returned block afterwards.
+*/
+static Node *DeferInclude(Parser *pr, NodeFuncCall *call)
+{
+    const Token *path = IncludePath(pr, call);
+
+    if (pr->include_sites_parsed == pr->include_site_amt
+        || pr->include_sites[pr->include_sites_parsed].path_start != path->start) {
+        ThrowError(pr, "The path of an include must be a string literal!\n");
+    }
+    ParserIncludeSite *site = &pr->include_sites[pr->include_sites_parsed++];
+
+    if (site->entry == SYM_NONE) {
+        ThrowError(pr, "Could not load '%.*s'!\n", site->path->string_length, site->path->string);
+    }
+
+    site->block = NewBlock(pr);
+    return (Node *)site->block;
+}
+
+static Node *ParseInclude(Parser *pr, NodeFuncCall *call);
 
-    fseek(fp, 0, SEEK_END);
-    unsigned file_size = ftell(fp);
-    rewind(fp);
+/**
+    Replace the include calls that were left in the statements of a tree by the files they
+    include.
+*/
+static void ExpandIncludes(Parser *pr, Node *node)
+{
+    if (node->type == NT_FUNC_DECLARE) {
+        NodeBlock *block = ((NodeFuncDeclare *)node)->block;
+        if (block != NULL) {
+            ExpandIncludes(pr, (Node *)block);
+        }
+        return;
+    }
+    if (node->type != NT_BLOCK) {
+        return;
+    }
+
+    NodeBlock *block = (NodeBlock *)node;
+
+    int i;
+    for (i = 0; i < block->statement_count; i++) {
+        Node *statement = block->statements[i];
 
-    char *buffer = (char *)malloc(file_size);
-    fread(buffer, 1, file_size, fp);
-    fclose(fp);
-    return buffer;
+        if (statement->type == NT_FUNC_CALL && ((NodeFuncCall *)statement)->func->value->symbol == SYM_INCLUDE) {
+            block->statements[i] = ParseInclude(pr, (NodeFuncCall *)statement);
+        }
+        else {
+            ExpandIncludes(pr, statement);
+        }
+    }
+}
+
+/**
+    Parse an included file through its precompiled module. The module is used when it was built
+    from the file as it is now, and written again otherwise. Modules hold the file with its
+    includes still as calls, which are expanded afterwards the same way the parser would have.
+*/
+static Node *ParseModule(Parser *pr, ParserInclude *include, const char *path)
+{
+    char module_path[SOURCE_PATH_MAX];
+    snprintf(module_path, sizeof(module_path), "%s" MODULE_EXTENSION, path);
+
+    const uint64_t hash = ModuleHash(include->source.data, include->source.size);
+    Node *ast = ModuleLoad(module_path, hash, pr->arena);
+
+    if (ast != NULL) {
+        // the module has its own copy of all of the text the AST needs
+        SourceRelease(&include->source);
+    }
+    else {
+        Parser newpr = ParserInit(LexerInit(include->source.data, SFLEX_ALPS_SPECIALS, SFLEX_USE_STRINGS), pr->arena);
+        newpr.keep_includes = true;
+        ast = Parse(&newpr);
+
+        include->lexer = newpr.lexer;
+        ArenaOnFree(pr->arena, FreeInclude, include);
+
+        // the module is only a cache, when it can not be written the file is parsed next time
+        FlatAst flat = FlatAstBuild(ast);
+        ModuleWrite(module_path, &flat, hash);
+        FlatAstDestroy(&flat);
+    }
+
+    ExpandIncludes(pr, ast);
+    return ast;
+}
+
+/**
+    Parse the file that an include names. Every file is only included once, later includes of
+    it (or includes of a file that is still being parsed) are an empty block.
+*/
+static Node *ParseInclude(Parser *pr, NodeFuncCall *call)
+{
+    char path[256];
+    const LexerLiteral *path_literal = IncludePath(pr, call)->literal;
+    snprintf(path, sizeof(path), "%.*s", path_literal->string_length, path_literal->string);
+
+    bool is_new;
+    const SymbolId entry = FindInclude(pr, path, &is_new);
+    if (entry == SYM_NONE) {
+        ThrowError(pr, "Could not load '%s'!\n", path);
+    }
+
+    if (!is_new) {
+        return (Node *)NewBlock(pr);
+    }
+
+    // the source stays loaded until the AST is freed, as the AST points into it
+    ParserInclude *include = ArenaAlloc(pr->arena, sizeof(ParserInclude));
+    if (!SourceLoad(&include->source, path)) {
+        ThrowError(pr, "Could not load '%s'!\n", path);
+    }
+
+    Node *ast;
+    if (pr->use_modules) {
+        ast = ParseModule(pr, include, path);
+    }
+    else {
+        // bodies can only be skipped over in a token store
+        Lexer lexer;
+        if (pr->lazy_bodies) {
+            lexer = LexerLex(include->source.data, SFLEX_ALPS_SPECIALS, SFLEX_USE_STRINGS);
+        }
+        else {
+            lexer = LexerInit(include->source.data, SFLEX_ALPS_SPECIALS, SFLEX_USE_STRINGS);
+        }
+
+        Parser newpr = ParserInit(lexer, pr->arena);
+        newpr.includes = pr->includes;
+        newpr.lazy_bodies = pr->lazy_bodies;
+        ast = Parse(&newpr);
+
+        include->lexer = newpr.lexer;
+        ArenaOnFree(pr->arena, FreeInclude, include);
+    }
+
+    return ast;
+}
+
+void ParserSetLazyBodies(Parser *pr, bool lazy_bodies)
+{
+    pr->lazy_bodies = lazy_bodies;
+}
+
+void ParserUseModules(Parser *pr, bool use_modules)
+{
+    pr->use_modules = use_modules;
+}
+
+void ParserSetFile(Parser *pr, const char *path)
+{
+    bool is_new;
+    FindInclude(pr, path, &is_new);
 }
 
 Node *ParseFuncCall(Parser *pr)
 {
-    NodeFuncCall *call = NewFuncCall();
+    NodeFuncCall *call = NewFuncCall(pr);
 
-    NodeVar *var = NewVar();
-    var->value = Eat(pr, TT_IDENTIFIER);
+    NodeVar *var = NewVar(pr);
+    var->value = KeepToken(pr, Eat(pr, TT_IDENTIFIER));
 
     call->func = var;
 
@@ -324,42 +738,31 @@ Node *ParseFuncCall(Parser *pr)
     if (CurrentToken(pr)->type != TT_RPAREN) {
         int arg_size = 8;
 
-        call->arguments = malloc(sizeof(Node *) * arg_size);
+        call->arguments = ArenaAlloc(pr->arena, sizeof(Node *) * arg_size);
 
         do {
             Node *arg = ParseExpr(pr);
 
-            call->arguments[call->argument_count++] = (Node *)arg;
-
-            if (call->argument_count > arg_size) {
+            if (call->argument_count == arg_size) {
+                call->arguments = ArenaRealloc(pr->arena, call->arguments, sizeof(Node *) * arg_size, sizeof(Node *) * arg_size * 2);
                 arg_size *= 2;
-                call->arguments = realloc(call->arguments, sizeof(Node *) * arg_size);
             }
+            call->arguments[call->argument_count++] = (Node *)arg;
         } while (CurrentToken(pr)->type == TT_COMMA && Eat(pr, TT_COMMA));
-
-        if (call->argument_count < arg_size) {
-            call->arguments = realloc(call->arguments, sizeof(Node *) * call->argument_count);
-        }
     }
 
     Eat(pr, TT_RPAREN);
 
-    if (!strncmp(call->func->value->start, "include", LexerTokenLength(call->func->value))) {
-        Lexer lexer;
-        char path[256];
-        Token *path_token = ((NodeLiteral *)call->arguments[0])->token;
-        strncpy(path, path_token->start + 1, LexerTokenLength(path_token) - 2);
-        char *data = LoadFile_(path);
-        if (data == NULL) {
-            ThrowError(pr, "Could not load '%s'!\n", path);
+    if (call->func->value->symbol == SYM_INCLUDE) {
+        if (pr->defer_includes) {
+            return DeferInclude(pr, call);
         }
-        lexer = LexerLex(data, "+-*/=:;,.(){}", SFLEX_USE_STRINGS);
-
 
-        Parser newpr = ParserInit(lexer);
-
-        Node *ast = Parse(&newpr);
-        return ast;
+        // left as a call when the file is written to a module, and expanded afterwards
+        if (pr->keep_includes) {
+            return (Node *)call;
+        }
+        return ParseInclude(pr, call);
     }
 
     return (Node *)call;
@@ -370,11 +773,6 @@ Node *ParseStatement(Parser *pr)
     Token *token = CurrentToken(pr);
     Node *node = NULL;
 
-    // when a variable is newly declared and assigned to in the same line, we set this variable
-    // to the NodeVar of the variable. The assign will be picked up as a new statement without
-    // extra jank to find the variable name. (this is still jank)
-    static NodeVar *newly_declared_var = NULL;
-
     if (token->type == TT_LBRACE) {
         return ParseBlock(pr);
     }
@@ -389,7 +787,7 @@ Node *ParseStatement(Parser *pr)
             if (CurrentToken(pr)->type == TT_EQUALS) {
                 // end the statement, the next read will pick up the
                 // 'x = [value]' statement
-                newly_declared_var = (NodeVar *)((NodeDeclare *)vdecl)->variable;
+                pr->newly_declared_var = (NodeVar *)((NodeDeclare *)vdecl)->variable;
 
                 // return early as we finished our first statement. The next will be the
                 // caught by the assign, and that will finish our line.
@@ -404,9 +802,9 @@ Node *ParseStatement(Parser *pr)
         }
     }
     // this is for inline variable declaration and then assignment!
-    else if (token->type == TT_EQUALS && newly_declared_var) {
-        node = ParseAssignment(pr, newly_declared_var);
-        newly_declared_var = NULL;
+    else if (token->type == TT_EQUALS && pr->newly_declared_var) {
+        node = ParseAssignment(pr, pr->newly_declared_var);
+        pr->newly_declared_var = NULL;
     }
 
     else if (token->type == TT_KEYWORD) {
@@ -457,39 +855,88 @@ static void ParseArgumentsDeclaration_(Parser *pr, NodeFuncDeclare *fdecl)
     if (CurrentToken(pr)->type != TT_RPAREN) {
         int arg_size = 8;
 
-        fdecl->arguments = malloc(sizeof(Node *) * arg_size);
+        fdecl->arguments = ArenaAlloc(pr->arena, sizeof(Node *) * arg_size);
 
         do {
             Node *arg = ParseDeclaration(pr);
 
-            fdecl->arguments[fdecl->argument_count++] = (NodeDeclare *)arg;
-
-            if (fdecl->argument_count > arg_size) {
+            if (fdecl->argument_count == arg_size) {
+                fdecl->arguments = ArenaRealloc(pr->arena, fdecl->arguments, sizeof(Node *) * arg_size, sizeof(Node *) * arg_size * 2);
                 arg_size *= 2;
-                fdecl->arguments = realloc(fdecl->arguments, sizeof(Node *) * arg_size);
             }
+            fdecl->arguments[fdecl->argument_count++] = (NodeDeclare *)arg;
         } while (CurrentToken(pr)->type == TT_COMMA && Eat(pr, TT_COMMA));
+    }
+}
+
+/**
+    Match the braces of a function body in the token store and record where it starts instead
+    of parsing it. Bodies with includes in them are not skipped, as includes are parsed in the
+    order they appear.
+    @return false if the body has to be parsed now.
+*/
+static bool SkipBody(Parser *pr, NodeFuncDeclare *fdecl)
+{
+    Lexer *lexer = &pr->lexer;
+    if (lexer->token_offsets == NULL) {
+        return false;
+    }
 
-        if (fdecl->argument_count < arg_size) {
-            fdecl->arguments = realloc(fdecl->arguments, sizeof(Node *) * fdecl->argument_count);
+    const int start = pr->token_index;
+    int depth = 0;
+
+    int i;
+    for (i = start; i < lexer->token_amt; i++) {
+        const TokenType type = (TokenType)lexer->token_types[i];
+
+        if (type == TT_LBRACE) {
+            depth++;
         }
+        else if (type == TT_RBRACE && --depth == 0) {
+            break;
+        }
+        else if (type == TT_IDENTIFIER && lexer->token_values[i] == SYM_INCLUDE) {
+            return false;
+        }
+    }
+
+    // unbalanced, parsing it reports the error
+    if (i == lexer->token_amt) {
+        return false;
     }
+
+    // the token store is complete, so one copy of the lexer serves every body in the file
+    if (pr->lazy_lexer == NULL) {
+        pr->lazy_lexer = ArenaAlloc(pr->arena, sizeof(Lexer));
+        *pr->lazy_lexer = *lexer;
+    }
+
+    ParserLazyBody *body = ArenaAlloc(pr->arena, sizeof(ParserLazyBody));
+    body->lexer = pr->lazy_lexer;
+    body->arena = pr->arena;
+    body->token_index = start;
+    fdecl->lazy_body = body;
+
+    // continue after the closing brace, nothing in the body was kept
+    pr->token_index = i + 1;
+    pr->tokens_lexed = i + 1;
+    return true;
 }
 
 NodeFuncDeclare *ParseFuncDeclaration(Parser *pr)
 {
     Token *ctok = CurrentToken(pr);
 
-    if (ctok->type != TT_KEYWORD || strncmp(ctok->start, "fn", LexerTokenLength(ctok))) {
+    if (ctok->type != TT_KEYWORD || ctok->symbol != SYM_FN) {
         return NULL;
     }
 
     Eat(pr, TT_KEYWORD);
 
-    NodeDeclare *declare = NewDeclare();
+    NodeDeclare *declare = NewDeclare(pr);
     declare->variable = ParseVariable(pr);
 
-    NodeFuncDeclare *fdecl = NewFuncDeclare();
+    NodeFuncDeclare *fdecl = NewFuncDeclare(pr);
     fdecl->declaration = declare;
 
     Eat(pr, TT_LPAREN);
@@ -497,10 +944,13 @@ NodeFuncDeclare *ParseFuncDeclaration(Parser *pr)
     Eat(pr, TT_RPAREN);
 
     // after arguments, parse type
-    declare->type = Eat(pr, TT_TYPE);
+    declare->type = KeepToken(pr, Eat(pr, TT_TYPE));
 
     // start of function definition
     if (CurrentToken(pr)->type == TT_LBRACE) {
+        if (pr->lazy_bodies && SkipBody(pr, fdecl)) {
+            return fdecl;
+        }
         fdecl->block = (NodeBlock *)ParseBlock(pr);
     }
 
@@ -509,6 +959,25 @@ NodeFuncDeclare *ParseFuncDeclaration(Parser *pr)
     return fdecl;
 }
 
+void ParserParseBody(NodeFuncDeclare *fdecl)
+{
+    const ParserLazyBody *body = fdecl->lazy_body;
+    if (body == NULL) {
+        return;
+    }
+
+    Parser pr = ParserInit(*body->lexer, body->arena);
+    pr.lazy_bodies = true;
+    pr.lazy_lexer = body->lexer;
+    pr.token_index = body->token_index;
+    pr.tokens_lexed = body->token_index;
+
+    fdecl->block = (NodeBlock *)ParseBlock(&pr);
+    fdecl->lazy_body = NULL;
+
+    AssertReturnStatement_(&pr, fdecl);
+}
+
 Node *ParseDeclaration(Parser *pr)
 {
     // NodeFuncDeclare *fdecl = ParseFuncDeclaration(pr);
@@ -525,19 +994,19 @@ Node *ParseDeclaration(Parser *pr)
         return NULL;
     }
 
-    NodeDeclare *declare = NewDeclare();
+    NodeDeclare *declare = NewDeclare(pr);
     declare->variable = vdecl;
-    declare->type = Eat(pr, TT_TYPE);
+    declare->type = KeepToken(pr, Eat(pr, TT_TYPE));
 
     return (Node *)declare;
 }
 
 Node *ParseAssignment(Parser *pr, NodeVar *override_var)
 {
-    NodeAssign *assign = NewAssign();
+    NodeAssign *assign = NewAssign(pr);
 
     assign->left = override_var ? (Node *)override_var : ParseVariable(pr);
-    assign->op = Eat(pr, TT_EQUALS);
+    assign->op = KeepToken(pr, Eat(pr, TT_EQUALS));
     assign->right = ParseExpr(pr);
 
     return (Node *)assign;
@@ -545,32 +1014,38 @@ Node *ParseAssignment(Parser *pr, NodeVar *override_var)
 
 Node *ParseVariable(Parser *pr)
 {
-    NodeVar *var = NewVar();
-    var->value = Eat(pr, TT_IDENTIFIER);
+    NodeVar *var = NewVar(pr);
+    var->value = KeepToken(pr, Eat(pr, TT_IDENTIFIER));
     return (Node *)var;
 }
 
 
 NodeBlock *ParseStatementList(Parser *pr)
 {
-    NodeBlock *block = NewBlock();
+    NodeBlock *block = NewBlock(pr);
 
     Node *statement;
 
     while ((statement = ParseStatement(pr))) {
-        block->statements[block->statement_count++] = statement;
-
         // resize the amount of statements
-        if (block->statement_count > block->statement_buf_size) {
+        if (block->statement_count == block->statement_buf_size) {
+            block->statements = ArenaRealloc(
+                pr->arena, block->statements,
+                sizeof(Node *) * block->statement_buf_size, sizeof(Node *) * block->statement_buf_size * 2
+            );
             block->statement_buf_size *= 2;
-            block->statements = realloc(block->statements, sizeof(Node *) * block->statement_buf_size);
         }
+        block->statements[block->statement_count++] = statement;
     }
 
-    // fix overshoot, large codebases can balloon this significantly
+    // fix overshoot, large codebases can balloon this significantly. Only gives the space back
+    // when the array is still the arena's last allocation.
     if (block->statement_buf_size > block->statement_count) {
+        block->statements = ArenaRealloc(
+            pr->arena, block->statements,
+            sizeof(Node *) * block->statement_buf_size, sizeof(Node *) * block->statement_count
+        );
         block->statement_buf_size = block->statement_count;
-        block->statements = realloc(block->statements, sizeof(Node *) * block->statement_buf_size);
     }
 
     return block;
@@ -592,88 +1067,260 @@ Node *ParseProgram(Parser *pr)
     return node;
 }
 
-Node *Parse(Parser *pr)
+
+//////////////////////////////
+// Parallel includes
+//////////////////////////////
+
+// A file that is lexed and parsed on its own thread in a parallel parse
+typedef struct {
+    char path[256];
+    ParserInclude include;
+    bool loaded;
+    bool lazy_bodies;
+
+    // owns the file's nodes, as arenas can not be shared between threads
+    Arena *arena;
+    Parser parser;
+    Node *ast;
+} ParserFile;
+
+// The files of a parallel parse, indexed by their include cache entry. The root file and files
+// that do not exist have none.
+typedef struct {
+    ParserFile **files;
+    int file_buffer_size;
+    ThreadPool *pool;
+} ParserFileSet;
+
+static void FreeFileArena(void *arg)
 {
-    return ParseProgram(pr);
+    ArenaFree((Arena *)arg);
 }
 
-void ParserPrintAST(Node *ast, int indent)
+static ParserFile *GetFile(const ParserFileSet *set, SymbolId entry)
 {
-    int i;
-    for (i = 0; i < indent; i++) {
-        printf("    ");
+    if (entry >= (SymbolId)set->file_buffer_size) {
+        return NULL;
     }
+    return set->files[entry];
+}
 
-    if (ast->type == NT_LITERAL) {
-        NodeLiteral *lit = (NodeLiteral *)ast;
-        printf("LITERAL (%.*s)\n", (int)LexerTokenLength(lit->token), lit->token->start);
-    }
-    else if (ast->type == NT_UNARYOP) {
-        NodeUnaryOp *unary = (NodeUnaryOp *)ast;
-        printf("UNARYOP %.*s\n", (int)LexerTokenLength(unary->op), unary->op->start);
-        ParserPrintAST(unary->node, indent + 1);
-    }
-    else if (ast->type == NT_BINOP) {
-        NodeBinOp *binop = (NodeBinOp *)ast;
-        printf("BINOP %.*s\n", (int)LexerTokenLength(binop->op), binop->op->start);
-        ParserPrintAST(binop->left, indent + 1);
-        ParserPrintAST(binop->right, indent + 1);
-    }
-    else if (ast->type == NT_BLOCK) {
-        printf("BLOCK\n");
-        NodeBlock *block = (NodeBlock *)ast;
+/**
+    Find the `include("...")` calls in a file's token store, in the order they appear. The
+    parser matches its includes to them instead of parsing the included files.
+*/
+static void ScanIncludes(Parser *pr)
+{
+    const Lexer *lexer = &pr->lexer;
+    int site_buffer_size = 0;
 
-        for (i = 0; i < block->statement_count; i++) {
-            ParserPrintAST(block->statements[i], indent + 1);
+    pr->defer_includes = true;
+
+    int i;
+    for (i = 0; i + 2 < lexer->token_amt; i++) {
+        if (lexer->token_types[i] != TT_IDENTIFIER || lexer->token_types[i + 1] != TT_LPAREN
+            || lexer->token_types[i + 2] != TT_STRING) {
+            continue;
+        }
+        // detached lexers have local symbol ids, so compare the name
+        if (lexer->token_lengths[i] != 7 || memcmp(lexer->data + lexer->token_offsets[i], "include", 7)) {
+            continue;
+        }
+
+        if (pr->include_site_amt == site_buffer_size) {
+            const int new_size = site_buffer_size ? site_buffer_size * 2 : 8;
+            pr->include_sites = ArenaRealloc(
+                pr->arena, pr->include_sites,
+                sizeof(ParserIncludeSite) * site_buffer_size, sizeof(ParserIncludeSite) * new_size
+            );
+            site_buffer_size = new_size;
         }
+
+        const LexerToken path = LexerGetToken(&pr->lexer, i + 2);
+
+        ParserIncludeSite *site = &pr->include_sites[pr->include_site_amt++];
+        site->path_start = path.start;
+        site->path = path.literal;
+        site->entry = SYM_NONE;
+        site->block = NULL;
     }
-    else if (ast->type == NT_ASSIGN) {
-        NodeAssign *assign = (NodeAssign *)ast;
-        printf("ASSIGN %.*s\n", (int)LexerTokenLength(assign->op), assign->op->start);
-        ParserPrintAST(assign->left, indent + 1);
-        ParserPrintAST(assign->right, indent + 1);
+}
+
+static void LexFileJob(void *arg)
+{
+    ParserFile *file = (ParserFile *)arg;
+
+    if (!SourceLoad(&file->include.source, file->path)) {
+        return;
     }
-    else if (ast->type == NT_DECLARE) {
-        NodeDeclare *declare = (NodeDeclare *)ast;
-        printf("DECLARE %.*s\n", (int)LexerTokenLength(declare->type), declare->type->start);
-        ParserPrintAST(declare->variable, indent + 1);
+    file->loaded = true;
+
+    Lexer lexer = LexerLexDetached(file->include.source.data, SFLEX_ALPS_SPECIALS, SFLEX_USE_STRINGS);
+    file->parser = ParserInit(lexer, file->arena);
+    file->parser.lazy_bodies = file->lazy_bodies;
+    ScanIncludes(&file->parser);
+}
+
+static void ParseFileJob(void *arg)
+{
+    ParserFile *file = (ParserFile *)arg;
+    file->ast = ParseProgram(&file->parser);
+}
+
+/**
+    Look up the files included by `file`, and start lexing the ones that have not been seen
+    before. Runs on the main thread, so cache entries are numbered in a deterministic order.
+*/
+static void ResolveIncludes(Parser *pr, Parser *file, ParserFileSet *set)
+{
+    int i;
+    for (i = 0; i < file->include_site_amt; i++) {
+        ParserIncludeSite *site = &file->include_sites[i];
+
+        char path[256];
+        snprintf(path, sizeof(path), "%.*s", site->path->string_length, site->path->string);
+
+        bool is_new;
+        site->entry = FindInclude(pr, path, &is_new);
+        if (!is_new || site->entry == SYM_NONE) {
+            continue;
+        }
+
+        if (site->entry >= (SymbolId)set->file_buffer_size) {
+            const int new_size = set->file_buffer_size ? set->file_buffer_size * 2 : 16;
+            set->files = realloc(set->files, sizeof(ParserFile *) * new_size);
+            memset(set->files + set->file_buffer_size, 0, sizeof(ParserFile *) * (new_size - set->file_buffer_size));
+            set->file_buffer_size = new_size;
+        }
+
+        ParserFile *included = ArenaAlloc(pr->arena, sizeof(ParserFile));
+        memcpy(included->path, path, sizeof(path));
+        included->loaded = false;
+        included->lazy_bodies = pr->lazy_bodies;
+        included->ast = NULL;
+
+        included->arena = ArenaAlloc(pr->arena, sizeof(Arena));
+        ArenaInit(included->arena);
+        ArenaOnFree(pr->arena, FreeFileArena, included->arena);
+
+        set->files[site->entry] = included;
+        ThreadPoolSubmit(set->pool, LexFileJob, included);
     }
-    else if (ast->type == NT_VAR) {
-        NodeVar *var = (NodeVar *)ast;
-        printf("VARIABLE %.*s\n", (int)LexerTokenLength(var->value), var->value->start);
+}
+
+/**
+    Point the includes of files that could not be loaded nowhere, so the parser reports them.
+*/
+static void DropMissingIncludes(Parser *file, const ParserFileSet *set)
+{
+    int i;
+    for (i = 0; i < file->include_site_amt; i++) {
+        const ParserFile *included = GetFile(set, file->include_sites[i].entry);
+        if (included != NULL && !included->loaded) {
+            file->include_sites[i].entry = SYM_NONE;
+        }
     }
-    else if (ast->type == NT_FUNC_DECLARE) {
-        NodeFuncDeclare *fdecl = (NodeFuncDeclare *)ast;
+}
 
-        Token *name = ((NodeVar *)fdecl->declaration->variable)->value;
-        Token *type = fdecl->declaration->type;
-        printf("FUNCDECL %.*s -> %.*s\n", (int)LexerTokenLength(name), name->start, (int)LexerTokenLength(type), type->start);
+/**
+    Fill in the include blocks of a file in the order a sequential parse would have parsed
+    them. The first include of every file gets its AST, later ones stay empty.
+*/
+static void SpliceIncludes(Parser *file, ParserFileSet *set, bool *spliced)
+{
+    int i;
+    for (i = 0; i < file->include_site_amt; i++) {
+        const ParserIncludeSite *site = &file->include_sites[i];
 
-        int i;
-        for (i = 0; i < fdecl->argument_count; i++) {
-            ParserPrintAST((Node *)fdecl->arguments[i], indent + 1);
+        ParserFile *included = GetFile(set, site->entry);
+        if (site->block == NULL || included == NULL || spliced[site->entry]) {
+            continue;
         }
+        spliced[site->entry] = true;
 
-        if (fdecl->block) {
-            ParserPrintAST((Node *)fdecl->block, indent + 1);
-        }
+        SpliceIncludes(&included->parser, set, spliced);
+
+        const NodeBlock *ast = (NodeBlock *)included->ast;
+        site->block->statements = ast->statements;
+        site->block->statement_count = ast->statement_count;
+        site->block->statement_buf_size = ast->statement_buf_size;
     }
-    else if (ast->type == NT_FUNC_CALL) {
-        NodeFuncCall *call = (NodeFuncCall *)ast;
+}
 
-        printf("FUNCCALL %.*s\n", TKPF(call->func->value));
-        int i;
-        for (i = 0; i < call->argument_count; i++) {
-            ParserPrintAST((Node *)call->arguments[i], indent + 1);
+/**
+    Parse a file and everything it includes. Included files are found by scanning the token
+    stores, then lexed and parsed at the same time, and finally spliced in at their includes.
+*/
+static Node *ParseParallel(Parser *pr)
+{
+    ParserFileSet set;
+    set.files = NULL;
+    set.file_buffer_size = 0;
+    set.pool = ThreadPoolCreate(pr->include_threads);
+
+    ScanIncludes(pr);
+    ResolveIncludes(pr, pr, &set);
+
+    // every round lexes the files included by the files of the round before
+    SymbolId resolved = 1;
+    SymbolId entry_amt = 0;
+    while (pr->includes != NULL && resolved < (entry_amt = InternTableCount(pr->includes->keys))) {
+        ThreadPoolWait(set.pool);
+
+        for (; resolved < entry_amt; resolved++) {
+            ParserFile *file = GetFile(&set, resolved);
+            if (file != NULL && file->loaded) {
+                ResolveIncludes(pr, &file->parser, &set);
+            }
+        }
+    }
+    ThreadPoolWait(set.pool);
+
+    DropMissingIncludes(pr, &set);
+
+    // intern on this thread in entry order, so symbol ids do not depend on thread timing
+    SymbolId entry;
+    for (entry = 1; entry < entry_amt; entry++) {
+        ParserFile *file = GetFile(&set, entry);
+        if (file != NULL && file->loaded) {
+            DropMissingIncludes(&file->parser, &set);
+            LexerAttach(&file->parser.lexer);
+            ThreadPoolSubmit(set.pool, ParseFileJob, file);
         }
     }
-    else if (ast->type == NT_RETURN) {
-        NodeReturn *ret = (NodeReturn *)ast;
 
-        printf("RETURN\n");
-        ParserPrintAST(ret->value, indent + 1);
+    Node *ast = ParseProgram(pr);
+    ThreadPoolWait(set.pool);
+    ThreadPoolDestroy(set.pool);
+
+    bool *spliced = calloc(entry_amt + 1, sizeof(bool));
+    SpliceIncludes(pr, &set, spliced);
+    free(spliced);
+
+    for (entry = 1; entry < entry_amt; entry++) {
+        ParserFile *file = GetFile(&set, entry);
+        if (file == NULL || !file->loaded) {
+            continue;
+        }
+        file->include.lexer = file->parser.lexer;
+        ArenaOnFree(pr->arena, FreeInclude, &file->include);
     }
-    else {
-        printf("UNKNOWN %d\n", ast->type);
+    free(set.files);
+
+    return ast;
+}
+
+void ParserSetIncludeThreads(Parser *pr, int thread_count)
+{
+    pr->include_threads = thread_count;
+}
+
+Node *Parse(Parser *pr)
+{
+    // the includes can only be found up front in a token store
+    if (pr->include_threads > 1 && pr->lexer.token_offsets != NULL) {
+        return ParseParallel(pr);
     }
+    return ParseProgram(pr);
 }
@@ -2,13 +2,107 @@
 #define CML_PARSER_H
 
 #include "Lexer.h"
+#include "Arena.h"
+#include "Intern.h"
+
+typedef LexerToken Token;
+
+// how far past the current token the parser can look with PeekToken
+#define PARSER_MAX_LOOKAHEAD 1
+
+// Tokens are pulled from the lexer on demand into this ring buffer. It is larger than the
+// lookahead so the last few eaten tokens stay valid until they are kept by a node.
+#define PARSER_TOKEN_RING_SIZE 4
+
+#define PARSER_KEPT_TOKEN_CHUNK 256
+
+#define PARSER_EXPR_STACK_START 32
+
+typedef enum {
+    PEO_BINARY,
+    PEO_UNARY,
+    PEO_PAREN,
+} ParserExprOpKind;
+
+// an entry on ParseExpr's operator stack
+typedef struct {
+    Token *op;
+    unsigned char kind;
+    unsigned char precedence;
+} ParserExprOp;
+
+// Every file included during a parse, so that each one is parsed only once. Files are keyed by
+// their identity, so different paths to the same file find the same entry.
+typedef struct {
+    // the ids are the entries of the files
+    InternTable *keys;
+} ParserIncludeCache;
+
+// An include call found by scanning a file's tokens before it is parsed
+typedef struct {
+    // start of the path's string token
+    const char *path_start;
+    const LexerLiteral *path;
+
+    // cache entry of the included file, SYM_NONE if it could not be loaded
+    SymbolId entry;
+
+    // where the parser put the include, the included file's AST is spliced into it afterwards
+    struct NodeBlock *block;
+} ParserIncludeSite;
 
 typedef struct {
     Lexer lexer;
+
+    // owns every node, array and kept token of the parse, shared with the parsers of includes
+    Arena *arena;
+
+    // shared with the parsers of includes, created on the first include
+    ParserIncludeCache *includes;
+
+    // threads to parse the included files on, see ParserSetIncludeThreads
+    int include_threads;
+
+    // see ParserUseModules
+    bool use_modules;
+    // see ParserSetLazyBodies
+    bool lazy_bodies;
+    // copy of `lexer` that the skipped bodies read their tokens from, made on the first skip
+    Lexer *lazy_lexer;
+    // leave includes as calls instead of parsing the included files
+    bool keep_includes;
+
+    // Includes are not parsed where they appear when files are parsed in parallel. They are
+    // matched to the sites found by scanning the file instead, in order.
+    bool defer_includes;
+    ParserIncludeSite *include_sites;
+    int include_site_amt;
+    int include_sites_parsed;
+
+    // when a variable is declared and assigned to in the same statement, the declaration is
+    // returned first and the assignment to this variable is picked up as the next statement
+    struct NodeVar *newly_declared_var;
+
+    Token token_ring[PARSER_TOKEN_RING_SIZE];
+    // index of the current token in the token stream
     int token_index;
-} Parser;
+    // amount of tokens pulled from the lexer so far
+    int tokens_lexed;
 
-typedef LexerToken Token;
+    // storage for tokens that are referenced by the AST
+    Token *kept_tokens;
+    int kept_tokens_left;
+
+    // operator and operand stacks of ParseExpr. Expressions inside of function call arguments
+    // push on top of the expression they are in.
+    ParserExprOp *expr_ops;
+    int expr_op_amt;
+    int expr_op_buffer_size;
+
+    struct Node **expr_operands;
+    int expr_operand_amt;
+    int expr_operand_buffer_size;
+} Parser;
 // typedef void Node;
 
 typedef enum {
@@ -24,7 +118,11 @@ typedef enum {
     NT_RETURN,
 } NodeType;
 
-typedef struct {
+// a variable declared in the program, numbered by the compiler's name resolution
+typedef uint32_t VarId;
+#define VAR_NONE 0
+
+typedef struct Node {
     NodeType type;
 } Node;
 
@@ -50,7 +148,7 @@ typedef struct {
 } NodeLiteral;
 
 
-typedef struct {
+typedef struct NodeBlock {
     Node base;
 
     Node **statements;
@@ -73,6 +171,15 @@ typedef struct {
     Node *variable;
 } NodeDeclare;
 
+// A function body that was skipped over by the parser, see ParserSetLazyBodies
+typedef struct {
+    Lexer *lexer;
+    Arena *arena;
+
+    // index of the body's opening brace in the lexer's token store
+    int token_index;
+} ParserLazyBody;
+
 typedef struct {
     Node base;
 
@@ -82,12 +189,17 @@ typedef struct {
     int argument_count;
 
     NodeBlock *block;
+
+    // set while the body has not been parsed yet, `block` is NULL until then
+    ParserLazyBody *lazy_body;
 } NodeFuncDeclare;
 
-typedef struct {
+typedef struct NodeVar {
     Node base;
 
     Token *value;
+    // the variable the name was resolved to by the compiler
+    VarId var;
 } NodeVar;
 
 typedef struct {
@@ -104,8 +216,45 @@ typedef struct {
     int argument_count;
 } NodeFuncCall;
 
-Parser ParserInit(Lexer lexer);
+/**
+    Set up a parser over `lexer`. Everything the parse allocates is owned by `arena`, the
+    AST stays valid until the arena is freed.
+*/
+Parser ParserInit(Lexer lexer, Arena *arena);
+
+/**
+    Record that the parser is reading the file at `path`, so that includes of it are skipped.
+*/
+void ParserSetFile(Parser *pr, const char *path);
+
+/**
+    Parse the files included by the parser's file, and the files they include, on
+    `thread_count` threads. The result is the same as parsing them one after the other. Only
+    takes effect when the parser's lexer was run with LexerLex or LexerLexParallel, as the
+    includes are found by scanning the token store before parsing.
+*/
+void ParserSetIncludeThreads(Parser *pr, int thread_count);
+
+/**
+    Load included files from the precompiled modules next to them (the file's path with
+    MODULE_EXTENSION appended), and write the module of every included file that does not have
+    an up to date one. Not used when includes are parsed on multiple threads.
+*/
+void ParserUseModules(Parser *pr, bool use_modules);
+
+/**
+    Skip over function bodies by matching their braces, and only parse them once
+    ParserParseBody is called. Bodies are still parsed right away when the tokens are not in a
+    store (see LexerLex) or when they contain an include. Errors inside of a skipped body are
+    only found once it is parsed.
+*/
+void ParserSetLazyBodies(Parser *pr, bool lazy_bodies);
+
+/**
+    Parse the body of a function that was skipped over. Does nothing when the body has already
+    been parsed.
+*/
+void ParserParseBody(NodeFuncDeclare *fdecl);
 Node *Parse(Parser *pr);
-void ParserPrintAST(Node *ast, int indent);
 
 #endif
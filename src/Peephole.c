@@ -0,0 +1,570 @@
+#include "Peephole.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// how many instructions after a write are looked at for a read, before the register is taken
+// to be live
+#define PEEP_LOOKAHEAD 32
+
+// The instructions being optimized. The ones from `start` to `out` have been through the
+// window, the ones from `next` to `end` are still to come.
+typedef struct {
+    IrInst *insts;
+    uint32_t start;
+    uint32_t out;
+    uint32_t next;
+    uint32_t end;
+} PeepWindow;
+
+typedef struct {
+    const char *name;
+
+    // how many instructions at the end of the window the pattern looks at
+    uint32_t length;
+
+    // try to apply the pattern to the instructions starting at `at`
+    bool (*apply)(PeepWindow *w, IrInst *at);
+} PeepPattern;
+
+static bool IsOpcode(const IrInst *inst, IrOpcode opcode)
+{
+    return inst->opcode == opcode;
+}
+
+static bool IsArith(const IrInst *inst)
+{
+    switch (inst->opcode) {
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_SDIV:
+        case IR_LSL:
+        case IR_LSR:
+        case IR_ASR:
+            return true;
+        default:
+            break;
+    }
+    return false;
+}
+
+static bool IsReg(const IrOperand *operand)
+{
+    return operand->kind == IO_REG;
+}
+
+/**
+    Whether a register operand is one of X0-X28 or W0-W28, rather than SP, FP or LR.
+*/
+static bool IsGeneral(const IrOperand *operand)
+{
+    return operand->kind == IO_REG && operand->reg >= CR_X0;
+}
+
+static bool SameReg(const IrOperand *a, const IrOperand *b)
+{
+    return a->kind == IO_REG && b->kind == IO_REG && a->reg == b->reg;
+}
+
+/**
+    Whether two registers have the same number, whatever the size of their values.
+*/
+static bool Overlaps(RegN a, RegN b)
+{
+    return RegSized(a, 8) == RegSized(b, 8);
+}
+
+static bool IsImm(const IrOperand *operand, long long value)
+{
+    return operand->kind == IO_IMM && operand->value == value;
+}
+
+/**
+    Whether two memory operands access the same stack slot or field, without moving their base.
+*/
+static bool SameSlot(const IrOperand *a, const IrOperand *b)
+{
+    return a->kind == IO_MEM && b->kind == IO_MEM
+        && a->addressing == IA_OFFSET && b->addressing == IA_OFFSET
+        && a->reg == b->reg && a->value == b->value;
+}
+
+/**
+    Whether a register is clobbered by calls and not used to pass arguments.
+*/
+static bool IsCallClobbered(RegN reg)
+{
+    reg = RegSized(reg, 8);
+    return reg >= CR_X8 && reg <= CR_X18;
+}
+
+static bool Writes(const IrInst *inst, RegN reg)
+{
+    const IrOperand *first = &inst->operands[0];
+    if (IrWritesFirst(inst->opcode) && IsReg(first) && Overlaps(first->reg, reg)) {
+        return true;
+    }
+    const IrOperand *second = &inst->operands[1];
+    return IsOpcode(inst, IR_LDP) && (Overlaps(first->reg, reg) || Overlaps(second->reg, reg));
+}
+
+static bool Reads(const IrInst *inst, RegN reg)
+{
+    int operand;
+    for (operand = 0; operand < inst->operand_amt; operand++) {
+        const IrOperand *op = &inst->operands[operand];
+
+        if (op->kind == IO_MEM && Overlaps(op->reg, reg)) {
+            return true;
+        }
+        if (op->kind != IO_REG || !Overlaps(op->reg, reg)) {
+            continue;
+        }
+        const bool written = (operand == 0 && IrWritesFirst(inst->opcode))
+            || (operand < 2 && IsOpcode(inst, IR_LDP));
+        if (!written) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+    Whether the value in a register is never read after the instruction at `index`. Labels, the
+    end of the code and registers that are not settled within PEEP_LOOKAHEAD instructions count
+    as live.
+*/
+static bool IsDeadAfter(const PeepWindow *w, uint32_t index, RegN reg)
+{
+    uint32_t i = index + 1;
+
+    int seen;
+    for (seen = 0; seen < PEEP_LOOKAHEAD; seen++, i++) {
+        // skip the gap between the window and the instructions to come
+        if (i == w->out) {
+            i = w->next;
+        }
+        if (i >= w->end) {
+            return false;
+        }
+
+        const IrInst *inst = &w->insts[i];
+        switch (inst->opcode) {
+            case IR_LABEL:
+            case IR_IMM:
+                return false;
+            // calls may read the argument registers, returns read X0 and the callee-saved ones
+            case IR_BL:
+            case IR_RET:
+                return IsCallClobbered(reg);
+            default:
+                break;
+        }
+
+        if (Reads(inst, reg)) {
+            return false;
+        }
+        if (Writes(inst, reg)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+    Remove the instruction at `inst` from the window.
+*/
+static void Remove(PeepWindow *w, IrInst *inst)
+{
+    const uint32_t index = inst - w->insts;
+    memmove(inst, inst + 1, sizeof(IrInst) * (w->out - index - 1));
+    w->out--;
+}
+
+static bool SelfMove(PeepWindow *w, IrInst *at)
+{
+    if (!IsOpcode(at, IR_MOV) || !SameReg(&at->operands[0], &at->operands[1])) {
+        return false;
+    }
+    Remove(w, at);
+    return true;
+}
+
+static bool MoveBack(PeepWindow *w, IrInst *at)
+{
+    IrInst *back = at + 1;
+    if (!IsOpcode(at, IR_MOV) || !IsOpcode(back, IR_MOV)) {
+        return false;
+    }
+    if (!SameReg(&at->operands[0], &back->operands[1]) || !SameReg(&at->operands[1], &back->operands[0])) {
+        return false;
+    }
+    Remove(w, back);
+    return true;
+}
+
+static bool StoreLoad(PeepWindow *w, IrInst *at)
+{
+    IrInst *load = at + 1;
+    if (!IsOpcode(at, IR_STR) || !IsOpcode(load, IR_LDR) || !SameSlot(&at->operands[1], &load->operands[1])) {
+        return false;
+    }
+
+    const IrOperand *stored = &at->operands[0];
+    const IrOperand *loaded = &load->operands[0];
+    if (!IsReg(stored) || !IsReg(loaded) || RegSize(stored->reg) != RegSize(loaded->reg)) {
+        return false;
+    }
+
+    if (stored->reg == loaded->reg) {
+        Remove(w, load);
+        return true;
+    }
+
+    // the value is still in the register it was stored from
+    load->opcode = IR_MOV;
+    load->operands[1] = *stored;
+    return true;
+}
+
+static bool LoadStore(PeepWindow *w, IrInst *at)
+{
+    IrInst *store = at + 1;
+    if (!IsOpcode(at, IR_LDR) || !IsOpcode(store, IR_STR) || !SameSlot(&at->operands[1], &store->operands[1])) {
+        return false;
+    }
+
+    // the load must not have replaced the base of the address
+    const IrOperand *loaded = &at->operands[0];
+    if (!SameReg(loaded, &store->operands[0]) || Overlaps(loaded->reg, at->operands[1].reg)) {
+        return false;
+    }
+    Remove(w, store);
+    return true;
+}
+
+static bool StoreStore(PeepWindow *w, IrInst *at)
+{
+    IrInst *store = at + 1;
+    if (!IsOpcode(at, IR_STR) || !IsOpcode(store, IR_STR) || !SameSlot(&at->operands[1], &store->operands[1])) {
+        return false;
+    }
+    if (!IsReg(&at->operands[0]) || !IsReg(&store->operands[0])) {
+        return false;
+    }
+    // a smaller store leaves some of the first one in place
+    if (RegSize(at->operands[0].reg) != RegSize(store->operands[0].reg)) {
+        return false;
+    }
+    Remove(w, at);
+    return true;
+}
+
+static bool FoldMove(PeepWindow *w, IrInst *at)
+{
+    IrInst *op = at + 1;
+    if (!IsOpcode(at, IR_MOV) || !IsArith(op) || !IsGeneral(&at->operands[1])) {
+        return false;
+    }
+
+    const IrOperand *dest = &at->operands[0];
+    const IrOperand src = at->operands[1];
+    if (!SameReg(&op->operands[0], dest)) {
+        return false;
+    }
+
+    // mov D, S; op D, D, x becomes op D, S, x
+    IrOperand *a = &op->operands[1];
+    IrOperand *b = &op->operands[2];
+    if (SameReg(a, dest) && !(IsReg(b) && Overlaps(b->reg, dest->reg))) {
+        *a = src;
+    }
+    // add and mul do not care about the order, so mov D, S; op D, x, D becomes op D, x, S
+    else if ((IsOpcode(op, IR_ADD) || IsOpcode(op, IR_MUL)) && SameReg(b, dest)
+             && !(IsReg(a) && Overlaps(a->reg, dest->reg))) {
+        *b = src;
+    }
+    else {
+        return false;
+    }
+
+    Remove(w, at);
+    return true;
+}
+
+static bool FoldResult(PeepWindow *w, IrInst *at)
+{
+    IrInst *move = at + 1;
+    if (!IsOpcode(move, IR_MOV) || !IsGeneral(&move->operands[0]) || !IsGeneral(&move->operands[1])) {
+        return false;
+    }
+    if (!IsArith(at) && !IsOpcode(at, IR_MOV) && !(IsOpcode(at, IR_LDR) && at->operands[1].addressing == IA_OFFSET)) {
+        return false;
+    }
+
+    const IrOperand *temp = &at->operands[0];
+    const IrOperand *dest = &move->operands[0];
+    if (!SameReg(temp, &move->operands[1]) || RegSize(temp->reg) != RegSize(dest->reg)) {
+        return false;
+    }
+    if (!IsDeadAfter(w, w->out - 1, temp->reg)) {
+        return false;
+    }
+
+    // the instruction reads its operands before writing, so it can write the destination
+    // straight away
+    at->operands[0] = *dest;
+    Remove(w, move);
+    return true;
+}
+
+/**
+    Find the operand an instruction combines with the register `temp`, as in op D, S, T, or
+    op D, T, S for instructions where the order does not matter.
+    @return NULL if the instruction does not read `temp` that way.
+*/
+static const IrOperand *OtherOperand(const IrInst *op, const IrOperand *temp, bool commutes)
+{
+    const IrOperand *a = &op->operands[1];
+    const IrOperand *b = &op->operands[2];
+    if (SameReg(b, temp) && IsReg(a) && !Overlaps(a->reg, temp->reg)) {
+        return a;
+    }
+    if (commutes && SameReg(a, temp) && IsReg(b) && !Overlaps(b->reg, temp->reg)) {
+        return b;
+    }
+    return NULL;
+}
+
+static bool ImmOperand(PeepWindow *w, IrInst *at)
+{
+    (void)w;
+
+    IrInst *op = at + 1;
+    if (!IsOpcode(at, IR_MOV) || at->operands[1].kind != IO_IMM) {
+        return false;
+    }
+    if (!IsOpcode(op, IR_ADD) && !IsOpcode(op, IR_SUB)) {
+        return false;
+    }
+
+    const IrOperand *src = OtherOperand(op, &at->operands[0], IsOpcode(op, IR_ADD));
+    const long long imm = at->operands[1].value;
+    // add and sub take 12 bit immediates
+    if (src == NULL || imm < -4095 || imm > 4095) {
+        return false;
+    }
+
+    // the move is left to PEEP_DEAD_DEF, as the register may still be read later on
+    op->operands[1] = *src;
+    op->operands[2] = IrOpImm((imm < 0) ? -imm : imm);
+    if (imm < 0) {
+        op->opcode = IsOpcode(op, IR_ADD) ? IR_SUB : IR_ADD;
+    }
+    return true;
+}
+
+static bool Pow2Mul(PeepWindow *w, IrInst *at)
+{
+    (void)w;
+
+    IrInst *op = at + 1;
+    if (!IsOpcode(at, IR_MOV) || at->operands[1].kind != IO_IMM) {
+        return false;
+    }
+    // signed division rounds towards zero and a shift does not, so divisions by a power of two
+    // are turned into shifts by CmArithInstImm where it has a register to spare
+    if (!IsOpcode(op, IR_MUL)) {
+        return false;
+    }
+
+    const long long imm = at->operands[1].value;
+    if (imm <= 0 || (imm & (imm - 1)) != 0) {
+        return false;
+    }
+    int shift = 0;
+    while ((1LL << shift) != imm) {
+        shift++;
+    }
+
+    const IrOperand *src = OtherOperand(op, &at->operands[0], true);
+    if (src == NULL || shift >= RegSize(op->operands[0].reg) * 8) {
+        return false;
+    }
+
+    // the move is left to PEEP_DEAD_DEF, as the register may still be read later on
+    op->opcode = IR_LSL;
+    op->operands[1] = *src;
+    op->operands[2] = IrOpImm(shift);
+    return true;
+}
+
+static bool ZeroArith(PeepWindow *w, IrInst *at)
+{
+    const bool no_change = IsOpcode(at, IR_ADD) || IsOpcode(at, IR_SUB)
+        || IsOpcode(at, IR_LSL) || IsOpcode(at, IR_LSR) || IsOpcode(at, IR_ASR);
+    if (!no_change || !IsImm(&at->operands[2], 0) || !IsReg(&at->operands[1])) {
+        return false;
+    }
+
+    if (SameReg(&at->operands[0], &at->operands[1])) {
+        Remove(w, at);
+        return true;
+    }
+    if (!IsGeneral(&at->operands[0]) || !IsGeneral(&at->operands[1])) {
+        return false;
+    }
+    at->opcode = IR_MOV;
+    at->operand_amt = 2;
+    return true;
+}
+
+/**
+    Get how much an instruction moves SP by, with `is_adjust` set when it only adjusts SP.
+*/
+static long long SPAdjustment(const IrInst *inst, bool *is_adjust)
+{
+    const IrOperand *dest = &inst->operands[0];
+    const IrOperand *src = &inst->operands[1];
+    const IrOperand *amount = &inst->operands[2];
+
+    *is_adjust = (IsOpcode(inst, IR_ADD) || IsOpcode(inst, IR_SUB))
+        && IsReg(dest) && dest->reg == CR_SP && IsReg(src) && src->reg == CR_SP
+        && amount->kind == IO_IMM;
+    if (!*is_adjust) {
+        return 0;
+    }
+    return IsOpcode(inst, IR_ADD) ? amount->value : -amount->value;
+}
+
+static bool SPMerge(PeepWindow *w, IrInst *at)
+{
+    bool first_adjusts;
+    bool second_adjusts;
+    const long long total = SPAdjustment(at, &first_adjusts) + SPAdjustment(at + 1, &second_adjusts);
+    if (!first_adjusts || !second_adjusts) {
+        return false;
+    }
+
+    if (total == 0) {
+        Remove(w, at + 1);
+        Remove(w, at);
+        return true;
+    }
+    if (total > 4095 || total < -4095) {
+        return false;
+    }
+
+    at->opcode = (total > 0) ? IR_ADD : IR_SUB;
+    at->operands[2] = IrOpImm((total > 0) ? total : -total);
+    Remove(w, at + 1);
+    return true;
+}
+
+static bool DeadDef(PeepWindow *w, IrInst *at)
+{
+    if (!IrWritesFirst(at->opcode) || !IsGeneral(&at->operands[0])) {
+        return false;
+    }
+    if (IsOpcode(at, IR_LDR) && at->operands[1].addressing != IA_OFFSET && at->operands[1].addressing != IA_PAGEOFF) {
+        return false;
+    }
+    if (!IsDeadAfter(w, at - w->insts, at->operands[0].reg)) {
+        return false;
+    }
+    Remove(w, at);
+    return true;
+}
+
+// indexed by PeepholeRule, and tried in that order
+static const PeepPattern patterns[PEEP_COUNT] = {
+    [PEEP_SELF_MOVE] = { "self-move", 1, SelfMove },
+    [PEEP_MOVE_BACK] = { "move-back", 2, MoveBack },
+    [PEEP_STORE_LOAD] = { "store-load", 2, StoreLoad },
+    [PEEP_LOAD_STORE] = { "load-store", 2, LoadStore },
+    [PEEP_STORE_STORE] = { "store-store", 2, StoreStore },
+    [PEEP_FOLD_MOVE] = { "fold-move", 2, FoldMove },
+    [PEEP_FOLD_RESULT] = { "fold-result", 2, FoldResult },
+    [PEEP_IMM_OPERAND] = { "imm-operand", 2, ImmOperand },
+    [PEEP_POW2_MUL] = { "pow2-mul", 2, Pow2Mul },
+    [PEEP_ZERO_ARITH] = { "zero-arith", 1, ZeroArith },
+    [PEEP_SP_MERGE] = { "sp-merge", 2, SPMerge },
+    // looks at the instruction before the newest one, so that its reads are in the window
+    [PEEP_DEAD_DEF] = { "dead-def", 2, DeadDef },
+};
+
+void PeepholeInit(Peephole *peep)
+{
+    int rule;
+    for (rule = 0; rule < PEEP_COUNT; rule++) {
+        peep->enabled[rule] = true;
+        peep->hits[rule] = 0;
+    }
+}
+
+bool PeepholeSetEnabled(Peephole *peep, const char *name, bool enabled)
+{
+    const bool all = !strcmp(name, "all");
+
+    bool found = false;
+    int rule;
+    for (rule = 0; rule < PEEP_COUNT; rule++) {
+        if (all || !strcmp(patterns[rule].name, name)) {
+            peep->enabled[rule] = enabled;
+            found = true;
+        }
+    }
+    return found;
+}
+
+/**
+    Apply the first pattern that matches the end of the window.
+    @return false if none of them matched.
+*/
+static bool PeepholeMatch(Peephole *peep, PeepWindow *w)
+{
+    int rule;
+    for (rule = 0; rule < PEEP_COUNT; rule++) {
+        const PeepPattern *pattern = &patterns[rule];
+        if (!peep->enabled[rule] || w->out - w->start < pattern->length) {
+            continue;
+        }
+        if (pattern->apply(w, &w->insts[w->out - pattern->length])) {
+            peep->hits[rule]++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void PeepholeRun(Peephole *peep, IrCode *code, uint32_t start)
+{
+    PeepWindow w;
+    w.insts = code->insts;
+    w.start = start;
+    w.out = start;
+    w.next = start;
+    w.end = code->inst_amt;
+
+    while (w.next < w.end) {
+        if (w.out != w.next) {
+            w.insts[w.out] = w.insts[w.next];
+        }
+        w.out++;
+        w.next++;
+
+        while (PeepholeMatch(peep, &w)) {
+        }
+    }
+
+    code->inst_amt = w.out;
+}
+
+void PeepholePrintStats(const Peephole *peep)
+{
+    int rule;
+    for (rule = 0; rule < PEEP_COUNT; rule++) {
+        printf("%-12s %s %u\n", patterns[rule].name, peep->enabled[rule] ? "  " : "x ", peep->hits[rule]);
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef CML_PEEPHOLE_H
+#define CML_PEEPHOLE_H
+
+#include "Ir.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Peephole optimization of the instructions once they have real registers. A window slides
+// over the code, and each pattern in a table is matched against the instructions at the end
+// of it, rewriting or removing them. The window is matched again after a change, so the
+// patterns build on each other's results.
+
+typedef enum {
+    // mov R, R
+    PEEP_SELF_MOVE,
+    // mov A, B; mov B, A
+    PEEP_MOVE_BACK,
+    // str R, [m]; ldr R2, [m]
+    PEEP_STORE_LOAD,
+    // ldr R, [m]; str R, [m]
+    PEEP_LOAD_STORE,
+    // str A, [m]; str B, [m]
+    PEEP_STORE_STORE,
+    // mov D, S; op D, D, x
+    PEEP_FOLD_MOVE,
+    // op T, a, b; mov D, T
+    PEEP_FOLD_RESULT,
+    // mov T, #imm; add D, S, T
+    PEEP_IMM_OPERAND,
+    // mov T, #2^k; mul D, S, T
+    PEEP_POW2_MUL,
+    // add D, S, #0
+    PEEP_ZERO_ARITH,
+    // add SP, SP, #a; sub SP, SP, #b
+    PEEP_SP_MERGE,
+    // a register written again before it is read
+    PEEP_DEAD_DEF,
+
+    PEEP_COUNT,
+} PeepholeRule;
+
+typedef struct {
+    bool enabled[PEEP_COUNT];
+
+    // how many times each pattern was applied
+    uint32_t hits[PEEP_COUNT];
+} Peephole;
+
+/**
+    Set up the optimizer with all patterns enabled.
+*/
+void PeepholeInit(Peephole *peep);
+
+/**
+    Enable or disable a pattern by its name, or every pattern with "all".
+    @return false if there is no pattern with the name.
+*/
+bool PeepholeSetEnabled(Peephole *peep, const char *name, bool enabled);
+
+/**
+    Optimize the code from instruction `start` to the end. The code must not use virtual
+    registers anymore.
+*/
+void PeepholeRun(Peephole *peep, IrCode *code, uint32_t start);
+
+/**
+    Print how many times each pattern was applied.
+*/
+void PeepholePrintStats(const Peephole *peep);
+
+#endif
@@ -0,0 +1,483 @@
+#include "RegAlloc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// registers that spilled values are loaded into for the instruction that uses them
+#define REG_SCRATCH_AMT 2
+
+// the register of a range that was not given one yet
+#define REG_UNASSIGNED ((RegN)-1)
+
+static const RegN scratch_registers[REG_SCRATCH_AMT] = { CR_X16, CR_X17 };
+
+static const RegN caller_saved[] = {
+    CR_X8, CR_X9, CR_X10, CR_X11, CR_X12, CR_X13, CR_X14, CR_X15
+};
+
+static const RegN callee_saved[] = {
+    CR_X19, CR_X20, CR_X21, CR_X22, CR_X23, CR_X24, CR_X25, CR_X26, CR_X27, CR_X28
+};
+
+#define CALLER_SAVED_AMT ((int)(sizeof(caller_saved) / sizeof(caller_saved[0])))
+#define CALLEE_SAVED_AMT ((int)(sizeof(callee_saved) / sizeof(callee_saved[0])))
+
+// The live range of a virtual register and where it ended up
+typedef struct {
+    // first and last instruction that uses the register, counted from the start of the range.
+    // -1 for registers that are not used in the range.
+    int first;
+    int last;
+
+    // live across a call, so it needs a callee-saved register
+    bool crosses_call;
+
+    // read before it is written, like a variable declared without a value, which starts out as
+    // zero
+    bool undefined;
+
+    // the register a move at the start of the range copies from, whose real register this one
+    // takes when it is free, so that the move can be dropped
+    IrVReg hint;
+
+    // the real register, the 8 byte one, or the stack slot when `spill_slot` is not -1
+    RegN reg;
+    int spill_slot;
+} RegInterval;
+
+typedef struct {
+    RegInterval *intervals;
+
+    // the registers that are live at the current instruction, ordered by where they end
+    IrVReg active[CALLER_SAVED_AMT + CALLEE_SAVED_AMT];
+    int active_amt;
+
+    // by 8 byte register
+    bool in_use[CR_W0];
+    // callee-saved registers that were handed out, which the function has to save
+    bool saved[CR_W0];
+
+    int spill_amt;
+} RegAllocator;
+
+static bool IsCalleeSaved(RegN reg)
+{
+    return reg >= CR_X19 && reg <= CR_X28;
+}
+
+/**
+    Get the virtual register an operand uses, VREG_NONE if it uses none.
+*/
+static IrVReg OperandVReg(const IrOperand *operand)
+{
+    if (operand->kind == IO_VREG || operand->kind == IO_MEM) {
+        return operand->vreg;
+    }
+    return VREG_NONE;
+}
+
+/**
+    Find the live ranges of the virtual registers, and the order they start in.
+    @return the amount of registers in `order`.
+*/
+static IrVReg BuildIntervals(RegAllocator *ra, const IrInst *insts, int inst_amt, IrVReg *order)
+{
+    IrVReg order_amt = 0;
+
+    // calls_before[i] is the amount of calls before instruction i
+    int *calls_before = malloc(sizeof(int) * (inst_amt + 1));
+    calls_before[0] = 0;
+
+    int i;
+    for (i = 0; i < inst_amt; i++) {
+        const IrInst *inst = &insts[i];
+        calls_before[i + 1] = calls_before[i] + (inst->opcode == IR_BL);
+
+        int operand;
+        for (operand = 0; operand < inst->operand_amt; operand++) {
+            const IrVReg vreg = OperandVReg(&inst->operands[operand]);
+            if (vreg == VREG_NONE) {
+                continue;
+            }
+
+            RegInterval *interval = &ra->intervals[vreg];
+            if (interval->first < 0) {
+                interval->first = i;
+                interval->undefined = !(operand == 0 && inst->operands[0].kind == IO_VREG && IrWritesFirst(inst->opcode));
+                order[order_amt++] = vreg;
+            }
+            interval->last = i;
+        }
+
+        const IrOperand *dest = &inst->operands[0];
+        const IrOperand *src = &inst->operands[1];
+        if (inst->opcode == IR_MOV && dest->kind == IO_VREG && src->kind == IO_VREG) {
+            if (ra->intervals[dest->vreg].first == i) {
+                ra->intervals[dest->vreg].hint = src->vreg;
+            }
+        }
+    }
+
+    IrVReg vreg;
+    for (vreg = 0; vreg < order_amt; vreg++) {
+        RegInterval *interval = &ra->intervals[order[vreg]];
+
+        // calls strictly inside the range clobber the caller-saved registers
+        if (interval->last > interval->first + 1) {
+            interval->crosses_call = (calls_before[interval->last] - calls_before[interval->first + 1]) > 0;
+        }
+
+        // the hint is only useful when the source starts before this register, so that it has
+        // been allocated by then, and ends where this register starts
+        const RegInterval *hint = (interval->hint != VREG_NONE) ? &ra->intervals[interval->hint] : NULL;
+        if (hint != NULL && (hint->first >= interval->first || hint->last != interval->first)) {
+            interval->hint = VREG_NONE;
+        }
+    }
+
+    free(calls_before);
+    return order_amt;
+}
+
+/**
+    Free the registers of the active ranges that end at or before `position`. An instruction
+    reads its operands before it writes, so a range that ends there can share its register with
+    one that starts there.
+*/
+static void ExpireIntervals(RegAllocator *ra, int position)
+{
+    int kept = 0;
+
+    int i;
+    for (i = 0; i < ra->active_amt; i++) {
+        const RegInterval *interval = &ra->intervals[ra->active[i]];
+
+        if (interval->last <= position) {
+            ra->in_use[interval->reg] = false;
+        }
+        else {
+            ra->active[kept++] = ra->active[i];
+        }
+    }
+    ra->active_amt = kept;
+}
+
+static void AddActive(RegAllocator *ra, IrVReg vreg)
+{
+    const int last = ra->intervals[vreg].last;
+
+    int i = ra->active_amt++;
+    while (i > 0 && ra->intervals[ra->active[i - 1]].last > last) {
+        ra->active[i] = ra->active[i - 1];
+        i--;
+    }
+    ra->active[i] = vreg;
+}
+
+static void RemoveActive(RegAllocator *ra, IrVReg vreg)
+{
+    int i;
+    for (i = 0; i < ra->active_amt; i++) {
+        if (ra->active[i] == vreg) {
+            memmove(&ra->active[i], &ra->active[i + 1], sizeof(IrVReg) * (ra->active_amt - i - 1));
+            ra->active_amt--;
+            return;
+        }
+    }
+}
+
+static bool TakeFree(RegAllocator *ra, const RegN *pool, int pool_amt, RegN *reg)
+{
+    int i;
+    for (i = 0; i < pool_amt; i++) {
+        if (!ra->in_use[pool[i]]) {
+            *reg = pool[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+    Pick a real register for a range, or spill the range that ends last.
+*/
+static void AllocateInterval(RegAllocator *ra, IrVReg vreg)
+{
+    RegInterval *interval = &ra->intervals[vreg];
+    RegN reg;
+
+    bool found = false;
+    if (interval->hint != VREG_NONE) {
+        const RegInterval *hint = &ra->intervals[interval->hint];
+
+        if (hint->reg != REG_UNASSIGNED && hint->spill_slot < 0 && !ra->in_use[hint->reg] && (!interval->crosses_call || IsCalleeSaved(hint->reg))) {
+            reg = hint->reg;
+            found = true;
+        }
+    }
+    if (!found && !interval->crosses_call) {
+        found = TakeFree(ra, caller_saved, CALLER_SAVED_AMT, &reg);
+    }
+    if (!found) {
+        found = TakeFree(ra, callee_saved, CALLEE_SAVED_AMT, &reg);
+    }
+
+    if (!found) {
+        // take the register of the range that ends last, if it ends after this one
+        int i;
+        for (i = ra->active_amt - 1; i >= 0; i--) {
+            RegInterval *victim = &ra->intervals[ra->active[i]];
+
+            if (interval->crosses_call && !IsCalleeSaved(victim->reg)) {
+                continue;
+            }
+            if (victim->last > interval->last) {
+                reg = victim->reg;
+                victim->spill_slot = ra->spill_amt++;
+                RemoveActive(ra, ra->active[i]);
+                found = true;
+            }
+            break;
+        }
+    }
+
+    if (!found) {
+        interval->spill_slot = ra->spill_amt++;
+        return;
+    }
+
+    interval->reg = reg;
+    ra->in_use[reg] = true;
+    if (IsCalleeSaved(reg)) {
+        ra->saved[reg] = true;
+    }
+    AddActive(ra, vreg);
+}
+
+static void EmitStackAccess(IrCode *out, IrOpcode opcode, RegN reg, int offset, int depth)
+{
+    IrInst *inst = IrAppend(out, opcode, depth);
+    IrAddOperand(inst, IrOpReg(reg));
+    IrAddOperand(inst, IrOpMem(IrOpReg(CR_SP), offset, IA_OFFSET));
+}
+
+static void EmitZero(IrCode *out, RegN reg, int depth)
+{
+    IrInst *inst = IrAppend(out, IR_MOV, depth);
+    IrAddOperand(inst, IrOpReg(reg));
+    IrAddOperand(inst, IrOpImm(0));
+}
+
+/**
+    Save or restore the callee-saved registers that were handed out, in the slots on top of the
+    original frame.
+*/
+static void EmitSaves(RegAllocator *ra, IrCode *out, IrOpcode opcode, int frame_size, int depth)
+{
+    int slot = 0;
+
+    int i;
+    for (i = 0; i < CALLEE_SAVED_AMT; i++) {
+        if (ra->saved[callee_saved[i]]) {
+            EmitStackAccess(out, opcode, callee_saved[i], frame_size + 8 * slot++, depth);
+        }
+    }
+}
+
+// The spilled registers of one instruction, and the scratch registers they are loaded into
+typedef struct {
+    IrVReg vregs[REG_SCRATCH_AMT];
+    bool read[REG_SCRATCH_AMT];
+    bool written[REG_SCRATCH_AMT];
+    int amt;
+} RegSpills;
+
+/**
+    Get the real register of a virtual one in an instruction, giving spilled ones a scratch
+    register.
+*/
+static RegN AssignedReg(RegAllocator *ra, RegSpills *spills, IrVReg vreg, bool written)
+{
+    const RegInterval *interval = &ra->intervals[vreg];
+    if (interval->spill_slot < 0) {
+        return interval->reg;
+    }
+
+    int i;
+    for (i = 0; i < spills->amt; i++) {
+        if (spills->vregs[i] == vreg) {
+            break;
+        }
+    }
+    if (i == spills->amt) {
+        // no instruction uses more than two virtual registers
+        spills->vregs[i] = vreg;
+        spills->read[i] = false;
+        spills->written[i] = false;
+        spills->amt++;
+    }
+
+    if (written) {
+        spills->written[i] = true;
+    }
+    else {
+        spills->read[i] = true;
+    }
+    return scratch_registers[i];
+}
+
+bool RegAllocRange(IrCode *code, uint32_t start, int frame_size)
+{
+    if (code->vreg_amt == VREG_NONE) {
+        return true;
+    }
+
+    const IrInst *insts = &code->insts[start];
+    const int inst_amt = code->inst_amt - start;
+
+    RegAllocator ra;
+    memset(&ra, 0, sizeof(RegAllocator));
+    ra.intervals = malloc(sizeof(RegInterval) * (code->vreg_amt + 1));
+
+    IrVReg vreg;
+    for (vreg = 0; vreg <= code->vreg_amt; vreg++) {
+        RegInterval *interval = &ra.intervals[vreg];
+        interval->first = -1;
+        interval->last = -1;
+        interval->crosses_call = false;
+        interval->undefined = false;
+        interval->hint = VREG_NONE;
+        interval->reg = REG_UNASSIGNED;
+        interval->spill_slot = -1;
+    }
+
+    IrVReg *order = malloc(sizeof(IrVReg) * (code->vreg_amt + 1));
+    const IrVReg order_amt = BuildIntervals(&ra, insts, inst_amt, order);
+
+    for (vreg = 0; vreg < order_amt; vreg++) {
+        ExpireIntervals(&ra, ra.intervals[order[vreg]].first);
+        AllocateInterval(&ra, order[vreg]);
+    }
+    free(order);
+
+    if (ra.spill_amt > 0 && frame_size < 0) {
+        free(ra.intervals);
+        return false;
+    }
+
+    // code outside of functions has no caller to keep registers for
+    if (frame_size < 0) {
+        memset(ra.saved, 0, sizeof(ra.saved));
+    }
+
+    int saved_amt = 0;
+    int i;
+    for (i = 0; i < CALLEE_SAVED_AMT; i++) {
+        saved_amt += ra.saved[callee_saved[i]];
+    }
+
+    // the saved registers and spilled values go on top of the original frame, so the offsets
+    // inside it stay the same
+    const int spill_base = frame_size + 8 * saved_amt;
+    const int extra_size = (8 * (saved_amt + ra.spill_amt) + 15) & ~15;
+
+    IrCode out;
+    IrInit(&out);
+
+    for (i = 0; i < inst_amt; i++) {
+        IrInst inst = insts[i];
+        const int depth = inst.depth;
+
+        // the instructions that set up and tear down the frame
+        const bool frame_adjust = (inst.opcode == IR_SUB || inst.opcode == IR_ADD) &&
+            inst.operands[0].kind == IO_REG && inst.operands[0].reg == CR_SP &&
+            inst.operands[2].kind == IO_IMM;
+
+        if (frame_adjust) {
+            if (inst.opcode == IR_ADD) {
+                EmitSaves(&ra, &out, IR_LDR, frame_size, depth);
+            }
+
+            inst.operands[2].value += extra_size;
+            *IrAppend(&out, inst.opcode, depth) = inst;
+
+            if (inst.opcode == IR_SUB) {
+                EmitSaves(&ra, &out, IR_STR, frame_size, depth);
+            }
+            continue;
+        }
+
+        RegSpills spills;
+        spills.amt = 0;
+
+        int operand_index;
+        for (operand_index = 0; operand_index < inst.operand_amt; operand_index++) {
+            IrOperand *operand = &inst.operands[operand_index];
+
+            const IrVReg operand_vreg = OperandVReg(operand);
+            if (operand_vreg != VREG_NONE && ra.intervals[operand_vreg].first == i &&
+                ra.intervals[operand_vreg].spill_slot < 0 && ra.intervals[operand_vreg].undefined) {
+                const RegN reg = ra.intervals[operand_vreg].reg;
+                EmitZero(&out, (operand->kind == IO_VREG) ? RegSized(reg, operand->size) : reg, depth);
+                ra.intervals[operand_vreg].undefined = false;
+            }
+
+            if (operand->kind == IO_VREG) {
+                const bool written = (operand_index == 0 && IrWritesFirst(inst.opcode));
+                operand->kind = IO_REG;
+                operand->reg = RegSized(AssignedReg(&ra, &spills, operand->vreg, written), operand->size);
+                operand->vreg = VREG_NONE;
+            }
+            else if (operand->kind == IO_MEM && operand->vreg != VREG_NONE) {
+                operand->reg = AssignedReg(&ra, &spills, operand->vreg, false);
+                operand->vreg = VREG_NONE;
+            }
+            else if (operand->kind == IO_MEM && operand->reg == CR_SP && operand->addressing == IA_OFFSET) {
+                // variables of enclosing functions are above the frame, which has grown
+                if (frame_size >= 0 && operand->value >= frame_size) {
+                    operand->value += extra_size;
+                }
+            }
+        }
+
+        int spill;
+        for (spill = 0; spill < spills.amt; spill++) {
+            RegInterval *interval = &ra.intervals[spills.vregs[spill]];
+            if (interval->undefined && interval->first == i) {
+                // stored after the instruction, for the reads that load it later
+                EmitZero(&out, scratch_registers[spill], depth);
+                spills.written[spill] = true;
+            }
+            else if (spills.read[spill]) {
+                const int slot = interval->spill_slot;
+                EmitStackAccess(&out, IR_LDR, scratch_registers[spill], spill_base + 8 * slot, depth);
+            }
+        }
+
+        // moves between the same register are left over from moves the ranges were joined over
+        const bool self_move = inst.opcode == IR_MOV && inst.operands[1].kind == IO_REG &&
+            inst.operands[0].reg == inst.operands[1].reg;
+        if (!self_move) {
+            *IrAppend(&out, inst.opcode, depth) = inst;
+        }
+
+        for (spill = 0; spill < spills.amt; spill++) {
+            if (spills.written[spill]) {
+                const int slot = ra.intervals[spills.vregs[spill]].spill_slot;
+                EmitStackAccess(&out, IR_STR, scratch_registers[spill], spill_base + 8 * slot, depth);
+            }
+        }
+    }
+
+    // replace the range with the rewritten one
+    code->inst_amt = start;
+    for (i = 0; i < (int)out.inst_amt; i++) {
+        const IrInst *inst = &out.insts[i];
+        *IrAppend(code, inst->opcode, inst->depth) = *inst;
+    }
+    code->vreg_amt = VREG_NONE;
+
+    IrDestroy(&out);
+    free(ra.intervals);
+    return true;
+}
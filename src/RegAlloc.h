@@ -0,0 +1,27 @@
+#ifndef CML_REG_ALLOC_H
+#define CML_REG_ALLOC_H
+
+#include "Ir.h"
+
+#include <stdbool.h>
+
+// Linear scan register allocation. Code is generated with a virtual register for every
+// temporary and every variable that is not kept on the stack, which are then given real
+// registers one function at a time. The code has no branches, so the live range of a virtual
+// register runs from the first instruction that uses it to the last one.
+//
+// Values that live across a call are given callee-saved registers (X19-X28), which the function
+// saves in its frame. The others prefer the caller-saved X8-X15. X0-X7 are left for arguments
+// and results, X16 and X17 are the scratch registers of spilled values and X18 is reserved by
+// the platform.
+
+/**
+    Give real registers to the virtual registers of the code from instruction `start` to the end,
+    after which the numbering of virtual registers starts over.
+    @param frame_size - the size of the stack frame the code sets up, which grows to hold the
+        saved registers and spilled values. -1 for code outside of functions, which has no frame.
+    @return false if a value has to be spilled outside of a function.
+*/
+bool RegAllocRange(IrCode *code, uint32_t start, int frame_size);
+
+#endif
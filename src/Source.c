@@ -0,0 +1,163 @@
+#include "Source.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SOURCE_USE_MMAP 1
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define SOURCE_READ_CHUNK (64 * 1024)
+
+/**
+    Read a stream to its end into a NUL terminated heap buffer.
+*/
+static bool SourceReadStream(Source *source, FILE *fp)
+{
+    size_t buffer_size = SOURCE_READ_CHUNK;
+    size_t size = 0;
+    char *buffer = (char *)malloc(buffer_size + 1);
+
+    size_t amt_read;
+    while ((amt_read = fread(buffer + size, 1, buffer_size - size, fp)) > 0) {
+        size += amt_read;
+
+        if (size == buffer_size) {
+            buffer_size *= 2;
+            buffer = (char *)realloc(buffer, buffer_size + 1);
+        }
+    }
+
+    if (ferror(fp)) {
+        free(buffer);
+        return false;
+    }
+
+    buffer[size] = 0;
+
+    source->data = buffer;
+    source->size = size;
+    source->mapping_size = 0;
+    return true;
+}
+
+#ifdef SOURCE_USE_MMAP
+
+/**
+    Map a regular file read-only. An extra zeroed page is reserved directly after the file, so
+    the byte after the last one in the file is always a NUL, even when the file size is an exact
+    multiple of the page size.
+*/
+static bool SourceMap(Source *source, int fd, size_t size)
+{
+    const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t file_pages_size = (size + page_size - 1) & ~(page_size - 1);
+    const size_t mapping_size = file_pages_size + page_size;
+
+    char *base = mmap(NULL, mapping_size, PROT_READ, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+
+    if (size > 0 && mmap(base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, mapping_size);
+        return false;
+    }
+
+    source->data = base;
+    source->size = size;
+    source->mapping_size = mapping_size;
+    return true;
+}
+
+#endif
+
+bool SourceLoad(Source *source, const char *path)
+{
+    if (!strcmp(path, "-")) {
+        return SourceReadStream(source, stdin);
+    }
+
+#ifdef SOURCE_USE_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && SourceMap(source, fd, (size_t)st.st_size)) {
+        // the mapping stays valid after the descriptor is closed
+        close(fd);
+        return true;
+    }
+    close(fd);
+#endif
+
+    // not a regular file, or it could not be mapped
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    bool loaded = SourceReadStream(source, fp);
+    fclose(fp);
+
+    return loaded;
+}
+
+void SourceRelease(Source *source)
+{
+    if (source->data == NULL) {
+        return;
+    }
+
+#ifdef SOURCE_USE_MMAP
+    if (source->mapping_size > 0) {
+        munmap(source->data, source->mapping_size);
+    }
+    else
+#endif
+    {
+        free(source->data);
+    }
+
+    source->data = NULL;
+    source->size = 0;
+    source->mapping_size = 0;
+}
+
+bool SourceIdentify(const char *path, SourceId *id)
+{
+    memset(id, 0, sizeof(SourceId));
+
+#ifdef SOURCE_USE_MMAP
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return false;
+    }
+
+    char resolved[PATH_MAX];
+    if (realpath(path, resolved) != NULL) {
+        path = resolved;
+    }
+
+    id->device = (uint64_t)st.st_dev;
+    id->inode = (uint64_t)st.st_ino;
+    id->mtime = (int64_t)st.st_mtime;
+    id->size = (uint64_t)st.st_size;
+#else
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    fclose(fp);
+#endif
+
+    snprintf(id->path, sizeof(id->path), "%s", path);
+    return true;
+}
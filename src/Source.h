@@ -0,0 +1,48 @@
+#ifndef CML_SOURCE_H
+#define CML_SOURCE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SOURCE_PATH_MAX 4096
+
+// A loaded source file. Regular files are memory mapped read-only, anything else (pipes,
+// stdin) is read into a heap buffer. Either way `data` is followed by a NUL terminator, so the
+// lexer can run over it without a copy.
+typedef struct {
+    char *data;
+    size_t size;
+
+    // size of the mapping when `data` is mapped, 0 for heap buffers
+    size_t mapping_size;
+} Source;
+
+/**
+    Load a source file. A path of "-" reads from stdin.
+    @return false if the file could not be opened or read.
+*/
+bool SourceLoad(Source *source, const char *path);
+void SourceRelease(Source *source);
+
+// Identifies a file on disk, so that the same file is recognised through different paths.
+typedef struct {
+    // canonical path of the file, or the path as given where it can not be resolved
+    char path[SOURCE_PATH_MAX];
+
+    // 0 on platforms without file ids
+    uint64_t device;
+    uint64_t inode;
+
+    // a file that changes while it is being compiled gets a new identity
+    int64_t mtime;
+    uint64_t size;
+} SourceId;
+
+/**
+    Look up the identity of a file.
+    @return false if the file does not exist.
+*/
+bool SourceIdentify(const char *path, SourceId *id);
+
+#endif
@@ -0,0 +1,151 @@
+#include "ThreadPool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define JOB_BUFFER_START 16
+
+typedef struct {
+    ThreadPoolFunc func;
+    void *arg;
+} ThreadPoolJob;
+
+struct ThreadPool {
+    pthread_t *threads;
+    int thread_count;
+
+    pthread_mutex_t lock;
+    // signalled when a job is queued or the pool is shutting down
+    pthread_cond_t job_ready;
+    // signalled when the last running job finishes
+    pthread_cond_t jobs_done;
+
+    // queue of jobs that have not been picked up yet
+    ThreadPoolJob *jobs;
+    int job_buffer_size;
+    int job_head;
+    int job_amt;
+
+    int jobs_running;
+    bool shutting_down;
+};
+
+static void *ThreadPoolWorker(void *arg)
+{
+    ThreadPool *pool = (ThreadPool *)arg;
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (;;) {
+        while (pool->job_amt == 0 && !pool->shutting_down) {
+            pthread_cond_wait(&pool->job_ready, &pool->lock);
+        }
+        if (pool->job_amt == 0 && pool->shutting_down) {
+            break;
+        }
+
+        ThreadPoolJob job = pool->jobs[pool->job_head];
+        pool->job_head = (pool->job_head + 1) % pool->job_buffer_size;
+        pool->job_amt--;
+        pool->jobs_running++;
+
+        pthread_mutex_unlock(&pool->lock);
+        job.func(job.arg);
+        pthread_mutex_lock(&pool->lock);
+
+        pool->jobs_running--;
+        if (pool->job_amt == 0 && pool->jobs_running == 0) {
+            pthread_cond_broadcast(&pool->jobs_done);
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+ThreadPool *ThreadPoolCreate(int thread_count)
+{
+    ThreadPool *pool = malloc(sizeof(ThreadPool));
+
+    if (thread_count < 1) {
+        thread_count = 1;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->job_ready, NULL);
+    pthread_cond_init(&pool->jobs_done, NULL);
+
+    pool->job_buffer_size = JOB_BUFFER_START;
+    pool->jobs = malloc(sizeof(ThreadPoolJob) * pool->job_buffer_size);
+    pool->job_head = 0;
+    pool->job_amt = 0;
+    pool->jobs_running = 0;
+    pool->shutting_down = false;
+
+    pool->thread_count = thread_count;
+    pool->threads = malloc(sizeof(pthread_t) * thread_count);
+
+    int i;
+    for (i = 0; i < thread_count; i++) {
+        pthread_create(&pool->threads[i], NULL, ThreadPoolWorker, pool);
+    }
+
+    return pool;
+}
+
+void ThreadPoolSubmit(ThreadPool *pool, ThreadPoolFunc func, void *arg)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->job_amt + 1 > pool->job_buffer_size) {
+        // unwrap the queue into a larger buffer
+        ThreadPoolJob *jobs = malloc(sizeof(ThreadPoolJob) * pool->job_buffer_size * 2);
+        int i;
+        for (i = 0; i < pool->job_amt; i++) {
+            jobs[i] = pool->jobs[(pool->job_head + i) % pool->job_buffer_size];
+        }
+        free(pool->jobs);
+        pool->jobs = jobs;
+        pool->job_head = 0;
+        pool->job_buffer_size *= 2;
+    }
+
+    ThreadPoolJob *job = &pool->jobs[(pool->job_head + pool->job_amt) % pool->job_buffer_size];
+    job->func = func;
+    job->arg = arg;
+    pool->job_amt++;
+
+    pthread_cond_signal(&pool->job_ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void ThreadPoolWait(ThreadPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->job_amt > 0 || pool->jobs_running > 0) {
+        pthread_cond_wait(&pool->jobs_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void ThreadPoolDestroy(ThreadPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->shutting_down = true;
+    pthread_cond_broadcast(&pool->job_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    int i;
+    for (i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->job_ready);
+    pthread_cond_destroy(&pool->jobs_done);
+
+    free(pool->threads);
+    free(pool->jobs);
+    free(pool);
+}
@@ -0,0 +1,24 @@
+#ifndef CML_THREAD_POOL_H
+#define CML_THREAD_POOL_H
+
+// A fixed set of worker threads that run submitted jobs in any order.
+
+typedef void (*ThreadPoolFunc)(void *arg);
+
+typedef struct ThreadPool ThreadPool;
+
+ThreadPool *ThreadPoolCreate(int thread_count);
+
+/**
+    Queue a job to be run on one of the pool's threads.
+*/
+void ThreadPoolSubmit(ThreadPool *pool, ThreadPoolFunc func, void *arg);
+
+/**
+    Block until every submitted job has finished.
+*/
+void ThreadPoolWait(ThreadPool *pool);
+
+void ThreadPoolDestroy(ThreadPool *pool);
+
+#endif